@@ -23,6 +23,17 @@
 int message_id_counter=1;		// <-- This is a global message_id counter, used to keep track of
 					//     messages sent to the EV3
 int *socket_id;				// <-- Socked identifier for your EV3
+double BT_cmdTime=0;			// <-- Time (ms, CLOCK_MONOTONIC) at which the EV3 acknowledged the last
+					//     motor command
+
+static double BT_clock()
+{
+ // Monotonic time in ms. Same clock as the V4L2 frame timestamps, so the time from a camera
+ // frame to a motor command can be measured.
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC,&t);
+ return((t.tv_sec*1000.0)+(t.tv_nsec/1000000.0));
+}
 
 int BT_open(const char *device_id)
 {
@@ -306,6 +317,7 @@ int BT_motor_port_start(char port_ids, char power)
  
  write(*socket_id,&cmd_string[0],15);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
 
  message_id_counter++;
 
@@ -370,6 +382,7 @@ int BT_motor_port_stop(char port_ids, int brake_mode)
  
  write(*socket_id,&cmd_string[0],11);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
 
  message_id_counter++;
 
@@ -424,6 +437,7 @@ int BT_all_stop(int brake_mode){
 
  write(*socket_id,&cmd_string[0],11);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
  message_id_counter++;
 
  if (reply[4]==0x02){
@@ -508,6 +522,7 @@ int BT_drive(char lport, char rport, char power){
 
  write(*socket_id,&cmd_string[0],15);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
 
  message_id_counter++;
 
@@ -595,6 +610,7 @@ int BT_turn(char lport, char lpower, char rport, char rpower){
 
  write(*socket_id,&cmd_string[0],20);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
 
  message_id_counter++;
 
@@ -683,6 +699,7 @@ int BT_timed_motor_port_start(char port_id, char power, int ramp_up_time, int ru
 
  write(*socket_id,&cmd_string[0],22);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -782,6 +799,7 @@ int BT_timed_motor_port_start_v2(char port_id, char power, int time){
 
  write(*socket_id,&cmd[0],26);
  read(*socket_id,&reply[0],1023);
+ BT_cmdTime=BT_clock();
 
  if (reply[4]==0x02){
 #ifdef __BT_debug
@@ -41,6 +41,7 @@
 #include <sys/param.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
+#include <time.h>
 
 
 // Bluetooth libraries - make sure they are installed in your machine
@@ -54,6 +55,9 @@
 					           //     file included with this distribution for details.
 
 extern int message_id_counter;		// <-- Global message id counter
+extern double BT_cmdTime;		// <-- When the last motor command was acknowledged by the EV3 (ms, CLOCK_MONOTONIC).
+					//     write() returns as soon as a command is queued on the socket, the reply
+					//     is the first sign it reached the brick.
 
 // Hex identifiers for the 4 motor ports (defined by Lego)
 #define MOTOR_A 0x01
@@ -0,0 +1 @@
+g++ -O2 -fopenmp -fpermissive imageProc_bench.c imageProc.c imageCapture.c avilib.c color.c gui.c svdDynamic.c utils.c v4l2uvc.c ../API/btcomm.c -lpthread -lm -lbluetooth -ljpeg -lglut -lSDL -lGLU -lGL -o imageProc_bench
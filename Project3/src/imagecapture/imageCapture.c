@@ -58,13 +58,22 @@ int sx,sy;				// Image size - set by the webcam init function
 // Webcam image data and processed image components
 struct vdIn *webcam;			// The input video device
 struct image *proc_im;			// Image structure for processing
-unsigned char *im;			// The current frame in RGB
-unsigned char bigIm[1024*1024*3];	// Big texture to hold our image for OpenGL
-unsigned char fieldIm[1024*768*3]; 	// Unwarped field 
-unsigned char bgIm[1024*768*3];		// Background image
+unsigned char *im;			// The current frame in RGB (rgbFrame, or NULL if not converted)
+unsigned char *rgbFrame;		// Buffer for the RGB frame, sx*sy*3
+unsigned char bigIm[3][1024*768*3];	// Images for the OpenGL texture (triple buffered)
+struct overlay dispOvl[3][OVL_MAX];	// Blob overlays drawn over each bigIm (see overlayBlobs())
+int dispNOvl[3];			// Number of overlays for each bigIm
+GLuint texturePBO=0;			// Pixel buffer object for texture uploads, 0 if not supported
+unsigned char fieldIm[1024*768*3]; 	// Unwarped field, the foreground in YUV once H is known (see fieldFromYUYVWin())
+unsigned char bgIm[1024*768*3];		// Background image (RGB, as saved with the calibration data)
+unsigned char bgYUV[1024*768*3];	// Background mean in YUV, rounded (see bgUpdate())
+unsigned short bgMean[1024*768*3];	// Running background mean in YUV, 8.8 fixed point
+unsigned short bgVar[1024*768];		// Running background variance of the squared colour distance, * BG_VAR_ONE
+unsigned long long fgMask[MASK_WORDS(1024)*768];	// Foreground pixels of fieldIm, 1 bit each (see fieldFromYUYVWin())
 
 // Global image processing parameters
 int gotbg=0;				// Background acquired flag
+int bgAdapt=1;				// Background model follows lighting changes
 int toggleProc;				// Toggles processing on/off
 double Mcorners[4][2];			// Manually specified corners for the field
 double mcx,mcy;				// Crosshair x and y
@@ -74,10 +83,48 @@ double bgThresh=900;			// Background subtract threshold
 double colThresh=.95;			// Saturation threshold
 double colAngThresh=.985;		// Colour angle threshold
 struct blob *blobs=NULL;		// Blob list for the current frame * DO NOT USE THIS LIST *
+struct blob *blobFree=NULL;		// Unused blob nodes (see newBlob())
+struct frameArena frameMem;		// Scratch memory for the current frame (see arenaAlloc())
+struct image *labPool=NULL;		// Label image reused by the blob detectors (see labelImage())
+int *labSpan=NULL;			// First and last labeled pixel in each row of labPool
+struct blobRun *stripBuf[16];		// Run buffers for the strips in labelWindow(), kept between frames
+int stripBufCap[16];			// Capacity of each stripBuf
 double *H = NULL;			// Homography matrix for field rectification
+struct unwarpMap uwMap;			// Cached remap table for H (see buildUnwarpMap())
+struct hueLUT hueTab;			// Quantized chroma -> hue/sat table (see buildHueLUT())
+int roiMode=0;				// Only process windows around tracked blobs (see roiDetect())
+struct roiState roi;			// Windows processed in ROI mode
+struct tracker tracker;			// Blob tracks, gives blobs stable ids (see trackBlobs())
 int frameNo=0;				// Frame id
 time_t time1,time2;		    	// timing variables
 int printFPS=0;				// Flag that controls FPS printout
+struct stageStats stats;		// Per-stage timing histograms (see stageRecord())
+pthread_mutex_t statLock=PTHREAD_MUTEX_INITIALIZER;	// Protects stats, stages run on two threads
+int showStats=0;			// Flag that controls the stage timing overlay
+const char *stageName[NSTAGES]={"grab","rgb","field","blobs","track","ai","render","compose","upload","frame","latency"};
+int capturePolicy=RING_DROP_OLDEST;	// What the capture thread does when frames pile up
+char *recordFile=NULL;			// Record processed frames to this AVI (see startRecording())
+int replayMode=0;			// Frames come from a recording instead of the camera
+int replayPaced=1;			// Replay at the recorded frame rate
+int mjpegScale=0;			// Capture MJPEG decoded at 1/mjpegScale size (0 - capture YUYV)
+int tuneWidth=0;			// Pick the capture mode for frames at least this wide (0 - off, see autotuneCam())
+avi_t *recAvi=NULL;			// Recording in progress
+FILE *recStamps=NULL;			// Timestamps for the recording
+avi_t *playAvi=NULL;			// Recording being replayed
+FILE *playStamps=NULL;			// Timestamps for the replayed recording
+long playFrame;				// Next frame to replay
+double playStart,playFirst;		// stageClock() and recorded time (ms) of the first frame
+
+// Processing thread and display hand-off
+pthread_t procThread;			// Runs ProcessingLoop()
+pthread_mutex_t procLock=PTHREAD_MUTEX_INITIALIZER;	// Held while a frame is processed, and by kbHandler()
+volatile int procRunning=0;		// Cleared to stop the processing thread
+volatile int quitRequested=0;		// Set to shut down as if 'q' was pressed (end of a headless replay)
+int headless=0;				// No OpenGL display at all
+int dispBack=0;				// bigIm being drawn by the processing thread
+volatile int dispMid=1;			// Latest finished bigIm, | DISP_FRESH if not yet shown
+int dispFront=2;			// bigIm being shown by DisplayFrame()
+double grabTime=0;			// stageClock() when the frame being processed was grabbed
 
 // Robot-control data
 struct RoboAI skynet;			// Bot's AI structure
@@ -92,7 +139,7 @@ int got_Y=0;				// Got Y adjustment
 /*********************************************************************
 Image processing setup and frame processing loop
 **********************************************************************/
-int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
+int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode, int no_display)
 {
  ///////////////////////////////////////////////////////////////////////////////////
  //
@@ -104,12 +151,16 @@ int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
  //	- rx, ry: Requested image resolution, typically 720, 1280
  //	- own_col: Color of the bot controlled by this program (passed on from command line)
  //	- AI_mode: Penalties, Follow the Ball, or Robo-Soccer (passed on from command line)
+ //	- no_display: If set, run headless - no OpenGL at all, keyboard commands
+ //	  are read from stdin (see headlessLoop())
+ //
+ // Recording and replay are set up beforehand with captureOptions().
  //
  // This function performs the following tasks:
  //  - Initializes the webcam and opens the video input device
- //  - Sets up and opens an OpenGL window for image display
  //  - Initializes the AI data structure
- //  - Calls the image processing main loop
+ //  - Starts the image processing/AI thread (see ProcessingLoop())
+ //  - Sets up and opens an OpenGL window for image display, unless headless
  //  
  // Returns:
  //     - Hopefully it doesn't! (glutMainLoop() exits without returning here)
@@ -120,19 +171,30 @@ int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
  toggleProc=0;
  memset(&bgIm[0],0,1024*768*3*sizeof(unsigned char));
  AIMode=AI_mode;
+ headless=no_display;
  botCol=own_col;
 
  fprintf(stderr,"Camera initialization!\n");
- // Initialize the webcam
- webcam=initCam(devName,rx,ry);
+ // Initialize the webcam, or open the recording to replay
+ if (replayMode) webcam=initReplay(devName);
+ else if (tuneWidth>0) webcam=autotuneCam(devName,rx,ry,tuneWidth);
+ else webcam=initCam(devName,rx,ry);
  if (webcam==NULL)
  {
   fprintf(stderr,"Unable to initialize webcam!\n");
   return -1;
  }
+ if (recordFile!=NULL) startRecording(webcam,recordFile);
  sx=webcam->width;
  sy=webcam->height;
  fprintf(stderr,"Camera initialized! grabbing frames at %d x %d\n",sx,sy);
+ rgbFrame=(unsigned char *)calloc(sx*sy*3,sizeof(unsigned char));
+ if (rgbFrame==NULL)
+ {
+  fprintf(stderr,"Unable to allocate memory for the RGB frame!\n");
+  closeCam(webcam);
+  return -1;
+ }
 
  // Done, set up OpenGL and call particle filter loop
  fprintf(stderr,"Entering main loop...\n");
@@ -146,74 +208,237 @@ int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int AI_mode)
  setupAI(AIMode,botCol, &skynet);
  memset(&adj_Y[0][0],0,4*sizeof(double));
 
+ // Image processing and AI run on their own thread, the display (if any)
+ // just shows the latest result.
+ procRunning=1;
+ if (pthread_create(&procThread,NULL,ProcessingLoop,NULL)!=0)
+ {
+  fprintf(stderr,"Unable to start the image processing thread!\n");
+  closeCam(webcam);
+  return -1;
+ }
+
+ if (headless)
+ {
+  headlessLoop();
+  return 0;
+ }
  initGlut(devName);
  glutMainLoop();
 
  return 0;
 }
 
+void *ProcessingLoop(void *arg)
+{
+ ///////////////////////////////////////////////////////////////////
+ //
+ // Image processing thread. Waits for each new camera frame and
+ // runs FrameGrabLoop() on it. procLock is held while the frame is
+ // processed so keyboard commands are applied between frames.
+ //
+ ///////////////////////////////////////////////////////////////////
+ double t0;
+
+ while (procRunning&&!quitRequested)
+ {
+  t0=stageClock();
+  if (grabFrame(webcam)<0) {usleep(10000); continue;}
+  grabTime=stageClock();
+  stageRecord(STAGE_GRAB,t0);
+  pthread_mutex_lock(&procLock);
+  t0=stageClock();
+  FrameGrabLoop();
+  releaseFrame(webcam);				// The camera can refill the frame's buffer
+  stageRecord(STAGE_FRAME,t0);
+  pthread_mutex_unlock(&procLock);
+  stageReport();
+ }
+ return(NULL);
+}
+
+void stopProcessing(void)
+{
+ // Stop the processing thread and wait for it to finish its frame
+ if (!procRunning) return;
+ procRunning=0;
+ pthread_join(procThread,NULL);
+}
+
+static struct termios ttySaved;		// Terminal settings to restore on exit (headless mode)
+
+static void restoreTerminal(void)
+{
+ tcsetattr(0,TCSANOW,&ttySaved);
+}
+
+void headlessLoop(void)
+{
+ ///////////////////////////////////////////////////////////////////
+ //
+ // Stand-in for glutMainLoop() when running headless. Keyboard
+ // commands are read from stdin and passed on to kbHandler(), one
+ // key at a time if stdin is a terminal. stdin is polled so that a
+ // quit request from the processing thread is seen even when no
+ // keys arrive; it is then handled here as a 'q' key.
+ //
+ ///////////////////////////////////////////////////////////////////
+ struct termios raw;
+ struct pollfd pfd;
+ int eof=0;
+ char c;
+
+ if (isatty(0))
+ {
+  tcgetattr(0,&ttySaved);
+  raw=ttySaved;
+  raw.c_lflag&=~(ICANON|ECHO);
+  tcsetattr(0,TCSANOW,&raw);
+  atexit(restoreTerminal);	// Also covers exit() from kbHandler()
+ }
+ fprintf(stderr,"Running headless - keyboard commands are read from the terminal\n");
+ while (!quitRequested)
+ {
+  if (eof) {usleep(100000); continue;}		// stdin closed, wait for a quit request
+  pfd.fd=0;
+  pfd.events=POLLIN;
+  if (poll(&pfd,1,100)<=0) continue;
+  if (read(0,&c,1)<=0) {eof=1; continue;}	// read(), not getchar(), so no keys sit unseen in a stdio buffer
+  if (c=='\n') continue;
+  kbHandler((unsigned char)c,0,0);
+ }
+ kbHandler('q',0,0);
+}
+
+static void publishDisplay(void)
+{
+ // Hand the finished display image over to DisplayFrame() and take the
+ // previous hand-off buffer to draw the next one (triple buffering, so
+ // neither side ever waits on the other).
+ __sync_synchronize();
+ dispBack=__sync_lock_test_and_set(&dispMid,dispBack|DISP_FRESH)&3;
+}
+
+static void frameTiming(struct AI_data *st, struct vdIn *vd)
+{
+ // Sets the capture time of the current frame (stageClock() ms) in the AI data, and keeps
+ // a running average of the time between frames. The capture time is the V4L2 timestamp if
+ // it is on the monotonic clock (usual for UVC cameras), otherwise (older drivers, replayed
+ // recordings) the time the frame was grabbed.
+ double t,d;
+
+ t=(vd->frameTime.tv_sec*1000.0)+(vd->frameTime.tv_usec/1000.0);
+ if (t>grabTime||t<grabTime-1000.0) t=grabTime;
+ d=t-st->frameStamp;
+ if (st->frameStamp>0&&d>0&&d<1000.0)
+ {
+  if (st->framePeriod==0) st->framePeriod=d;
+  else st->framePeriod+=LAT_RATE*(d-st->framePeriod);
+ }
+ st->frameStamp=t;
+}
+
+static void commandLatency(struct AI_data *st, double cmd0)
+{
+ // Called after the AI has run on the current frame. If it sent a motor command (BT_cmdTime
+ // moved on from cmd0), the time from the frame's capture to the command being acknowledged
+ // by the EV3 goes into the running average the AI uses to predict agent states, and into
+ // the stage timing histograms.
+ double l;
+
+ if (BT_cmdTime<=cmd0) return;
+ l=BT_cmdTime-st->frameStamp;
+ if (l<0) return;
+ stageRecordMs(STAGE_LATENCY,l);
+ if (l>LAT_MAX) l=LAT_MAX;
+ if (st->latency==0) st->latency=l;
+ else st->latency+=LAT_RATE*(l-st->latency);
+}
+
 void FrameGrabLoop(void)
 {
  ///////////////////////////////////////////////////////////////////
  //
- // This is the frame processing loop. It is called once per OpenGL
- // frame update, and does all the heavy lifting:
+ // This is the frame processing loop. It is called by the processing
+ // thread (see ProcessingLoop()) once for every new video frame, and
+ // does all the heavy lifting:
  //
- // - Obtains a video frame from the web cam
  // - Processes the video frame to extract the play field and 
  //   any blobs therein (see blobDetect()).
  // - Calls the main AI processing function to allow your bot to
  //   plan and execute its actions based on the video data.
- // - Refreshes the video display - what gets displayed depends
- //   on whether the game is on, or whether the image processing
- //   setup is being carried out.
+ // - Prepares the image for the video display - what gets displayed
+ //   depends on whether the game is on, or whether the image processing
+ //   setup is being carried out. The display itself is DisplayFrame().
  //
  ////////////////////////////////////////////////////////////////////
-  // OpenGL variables. Do not remove
-  static int frame=0;
   char line[1024];
   int ox,oy,i,j;
   double *tmpH;
   unsigned char *big, *tframe;
-  struct image *t1, *t2, *t3;
-  struct image *labIm, *blobIm;
+  struct image *t3;
+  struct timage *t1, *t2;
+  struct image *labIm;
   static int nblobs=0;
   FILE *f;
+  double t0,tb,cmd0;
 
   /***************************************************
-   Grab the current frame from the webcam
+   The current frame from the webcam is in webcam->framebuffer
   ***************************************************/
-  big=&bigIm[0];
-  im=getFrame(webcam,sx,sy);
+  frameTiming(&skynet.st,webcam);
+  arenaReset(&frameMem);		// Scratch memory from the last frame is free again
+  big=&bigIm[dispBack][0];
   ox=420;
   oy=1;
-  t3=imageFromBuffer(im,sx,sy,3);
-  
+
+  // The RGB frame is only needed while there is no homography, or while
+  // calibration is in progress. Once H is available fieldFromYUYV() reads
+  // the camera's YUYV data directly.
+  im=NULL;
+  if (H==NULL||toggleProc!=0)
+  {
+   t0=stageClock();
+   im=yuyv_to_rgb(webcam,rgbFrame);
+   stageRecord(STAGE_RGB,t0);
+  }
+
   /////////////////////////////////////////////////////////////////////////
   // What happens in this loop depends on a global variable that changes in
   // response to user keyboard commands. The variable 'toggleproc' has the
   // following values:
   // - 0 : Normal frame processing loop - Used during the game to get
   //                                      and update blob data.
-  // - 1 : Used to load field calibration data (the H matrix and the
-  //       background image)
+  // - 1 : Used to load field calibration data (the H matrix, the
+  //       background model, and the thresholds, see loadCalibration())
   // - 2 : Used while capturing the 4 corners of the field during the
   //       field calibration stage
   /////////////////////////////////////////////////////////////////////////
   if (toggleProc==1)
   {
-   // Load cached H matrix and background image
-   f=fopen("Homography.dat","r");
-   if (f!=NULL)
+   // Load the cached calibration, everything is ready for the next frame
+   if (loadCalibration()==0)
+   {
+    cornerIdx=4;
+    fprintf(stderr,"Successfully read calibration data from %s\n",CALIB_FILE);
+   }
+   // Or, if there is none, the H matrix and background image from the older
+   // calibration file, converted to the new format
+   else if (access(CALIB_FILE,F_OK)!=0&&(f=fopen(CALIB_LEGACY,"r"))!=NULL)
    {
     if (H!=NULL) free(H);
     H=(double *)calloc(9,sizeof(double));
     fread(H,9*sizeof(double),1,f);
     fread(&bgIm[0],1024*768*3*sizeof(unsigned char),1,f);
+    // Files written before the adaptive background model have no variance
+    if (fread(&bgVar[0],1024*768*sizeof(unsigned short),1,f)==1) seedBgModel(&bgVar[0]);
+    else seedBgModel(NULL);
     fclose(f);
+    buildUnwarpMap(H,sx,sy);
     gotbg=1;
     cornerIdx=4;
-    fprintf(stderr,"Successfully read background and H matrix from file\n");
+    fprintf(stderr,"Successfully read background and H matrix from %s\n",CALIB_LEGACY);
+    saveCalibration();
    }
    else
     fprintf(stderr,"No calibration data. Please use 'm' to capture corners\n");
@@ -243,112 +468,149 @@ void FrameGrabLoop(void)
     // matrix for future use.
     fprintf(stderr,"Computing homography and acquiring background image\n");
     H=getH();
+    buildUnwarpMap(H,sx,sy);
 
-    // Get background image
-    t2=newImage(t3->sx,t3->sy,3);
+    // Get background image - average of 25 frames
+    t2=newTImage(sx,sy,3,IM_F32,IM_PLANAR);
     for (i=0;i<25;i++)
     {
-     tframe=getFrame(webcam,sx,sy);
-     t1=imageFromBuffer(im,sx,sy,3);
-     pointwise_add(t2,t1);
-     deleteImage(t1);
-     free(tframe);
+     tframe=getFrame(webcam,rgbFrame);
+     t1=viewTImage(tframe,sx,sy,3,IM_U8,IM_INTERLEAVED,sx*3);
+     tpointwise_add(t2,t1);
+     deleteTImage(t1);
     }
-    image_scale(t2,1.0/25.0);
-    fieldUnwarp(H,t2);
-    deleteImage(t2);
+    timage_scale(t2,1.0/25.0);
+    t3=imageFromTImage(t2);
+    deleteTImage(t2);
+    fieldUnwarp(H,t3);
+    deleteImage(t3);
     for (j=0;j<1024*768*3;j++) bgIm[j]=fieldIm[j];
+    seedBgModel(NULL);
     gotbg=1;
     time(&time1);
     frameNo=0;
 
-    // Cache calibration data - Homography + background image
-    f=fopen("Homography.dat","w");
-    fwrite(H,9*sizeof(double),1,f);
-    fwrite(&bgIm[0],1024*768*3*sizeof(unsigned char),1,f);
-    fclose(f);
+    // Cache calibration data - Homography + background model
+    saveCalibration();
    }
   }
 
   ////////////////////////////////////////////////////////////////////
   // If we have a homography, detect blobs and call the AI routine
   ////////////////////////////////////////////////////////////////////
-  labIm=blobIm=NULL;
+  labIm=NULL;
   if (H!=NULL) 
   {
    ///////////////////////////////////////////////////////////////////
    //
    // If we have the H matrix, we must do the following:
-   // - Rectify the playfield into a rectangle
-   // - Perform background subtraction
+   // - Rectify the playfield into a rectangle and perform background
+   //   subtraction (both done in a single pass by fieldFromYUYV())
    // - Detect colour blobs
    // - Call the AI main function to do its work
    // - Display the blobs along with information passed back from
    //   the AI processing code.
    //////////////////////////////////////////////////////////////////
-   fieldUnwarp(H,t3);
-   bgSubtract2();
-//   labIm=blobDetect(fieldIm,1024,768,&blobs,&nblobs);
-   labIm=blobDetect2(fieldIm,1024,768,&blobs,&nblobs);
+   if (roiMode) labIm=roiDetect(&roi,&tracker,H,webcam,&blobs,&nblobs);
+   else
+   {
+    t0=stageClock();
+    fieldFromYUYV(H,webcam);
+    stageRecord(STAGE_FIELD,t0);
+    t0=stageClock();
+//    labIm=blobDetect(fieldIm,1024,768,&blobs,&nblobs);
+    labIm=blobDetect2(fieldIm,&fgMask[0],1024,768,&blobs,&nblobs);
+    stageRecord(STAGE_BLOBS,t0);
+   }
+   t0=stageClock();
+   trackBlobs(&tracker,&blobs);
+   stageRecord(STAGE_TRACK,t0);
    if (blobs)
    {
+    t0=stageClock();
+    cmd0=BT_cmdTime;
     if (doAI==1) skynet.runAI(&skynet,blobs,NULL);
     else if (doAI==2) skynet.calibrate(&skynet,blobs);
-    blobIm=renderBlobs(fieldIm,1024,768,labIm,blobs);
+    if (doAI) stageRecord(STAGE_AI,t0);
+    if (doAI==1) commandLatency(&skynet.st,cmd0);
+    offsetCalibration(blobs);
    }
-   deleteImage(labIm);
   }
   
   ////////////////////////////////////////////////////////////////////
   // Render whatever we are going to display onto the texture image
-  // buffer used by OpenGL
+  // buffer used by OpenGL. Boxes, cross-hairs, and heading vectors
+  // are drawn by DisplayFrame() on top of it, from the overlay list.
   //////////////////////////////////////////////////////////////////// 
-  if (H==NULL)
+  if (!headless)
   {
-   // We still have not computed H. Display the video frame directly
-   double ii,jj,dx,dy;
-   dx=(double)sx/1023.0;
-   dy=(double)sy/767.0;
+   t0=stageClock();
+   dispNOvl[dispBack]=0;
+   if (H==NULL)
+   {
+    // We still have not computed H. Display the video frame directly
+    double ii,jj,dx,dy;
+    dx=(double)sx/1023.0;
+    dy=(double)sy/767.0;
 #pragma omp parallel for schedule(dynamic,16) private(ii,jj,i,j)
-   for (j=0;j<768;j++)
-    for (i=0;i<1024;i++)
-    {
-     ii=i*dx;
-     jj=j*dy;
-     *(big+((i+((j+128)*1024))*3)+0)=*(im+(((int)ii+(((int)jj)*sx))*3)+0);
-     *(big+((i+((j+128)*1024))*3)+1)=*(im+(((int)ii+(((int)jj)*sx))*3)+1);
-     *(big+((i+((j+128)*1024))*3)+2)=*(im+(((int)ii+(((int)jj)*sx))*3)+2);
-    }
-  }
-  else if (blobIm==NULL)
-  {
-   // We have calibration from H but no blob image (possible if no
-   // agents are on the field at the moment or the image processing
-   // thresholds are improperly set.
-   // Copy the rectified, background subtracted field image for display
-#pragma omp parallel for schedule(dynamic,16) private(i,j)
     for (j=0;j<768;j++)
      for (i=0;i<1024;i++)
      {
-      *(big+(((i)+((j+128)*1024))*3)+0)=fieldIm[((i+(j*1024))*3)+0];
-      *(big+(((i)+((j+128)*1024))*3)+1)=fieldIm[((i+(j*1024))*3)+1];
-      *(big+(((i)+((j+128)*1024))*3)+2)=fieldIm[((i+(j*1024))*3)+2];
+      ii=i*dx;
+      jj=j*dy;
+      *(big+((i+(j*1024))*3)+0)=*(im+(((int)ii+(((int)jj)*sx))*3)+0);
+      *(big+((i+(j*1024))*3)+1)=*(im+(((int)ii+(((int)jj)*sx))*3)+1);
+      *(big+((i+(j*1024))*3)+2)=*(im+(((int)ii+(((int)jj)*sx))*3)+2);
      }
+   }
+   else if (labIm==NULL||blobs==NULL)
+   {
+    // We have calibration from H but no blobs (possible if no
+    // agents are on the field at the moment or the image processing
+    // thresholds are improperly set.
+    // Show the rectified, background subtracted field image
+    fieldToRGB(&fieldIm[0],1024,768,big);
+   }
+   else
+   {
+    // We have the H matrix and also detected blobs. Display the blobs
+    tb=stageClock();
+    renderBlobs(fieldIm,1024,768,labIm,blobs,big);
+    dispNOvl[dispBack]=overlayBlobs(blobs,&dispOvl[dispBack][0]);
+    stageRecord(STAGE_RENDER,tb);
+   }
+   publishDisplay();
+   stageRecord(STAGE_COMPOSE,t0);
   }
-  else
+
+  // Clean Up - Do all the image processing, AI, and planning before this code.
+  // Nothing to release: the frame, label image, scratch memory, and blobs are all reused.
+}
+
+void DisplayFrame(void)
+{
+ ///////////////////////////////////////////////////////////////////
+ //
+ // GLUT display callback. Shows the most recent image prepared by
+ // FrameGrabLoop(), at whatever rate the display runs - no image
+ // processing happens here.
+ //
+ ///////////////////////////////////////////////////////////////////
+  static int frame=0;
+  unsigned char *big, *pbo;
+  double t0;
+
+  if (dispMid&DISP_FRESH)
+   dispFront=__sync_lock_test_and_set(&dispMid,dispFront)&3;
+  else if (frame>0)
   {
-   // We have the H matrix and also detected blobs. Display the blob image
-#pragma omp parallel for schedule(dynamic,16) private(i,j)
-    for (j=0;j<768;j++)
-     for (i=0;i<1024;i++)
-     {
-      *(big+(((i)+((j+128)*1024))*3)+0)=(unsigned char)((*(blobIm->layers[0]+i+(j*blobIm->sx))));
-      *(big+(((i)+((j+128)*1024))*3)+1)=(unsigned char)((*(blobIm->layers[1]+i+(j*blobIm->sx))));
-      *(big+(((i)+((j+128)*1024))*3)+2)=(unsigned char)((*(blobIm->layers[2]+i+(j*blobIm->sx))));
-     }
-    deleteImage(blobIm);
+   // Nothing new yet
+   usleep(2000);
+   glutSetWindow(windowID);
+   glutPostRedisplay();
+   return;
   }
-  deleteImage(t3);	// Release the image obtained from the webcam for this round
+  big=&bigIm[dispFront][0];
 
   ///////////////////////////////////////////////////////////////////////////
   // Have OpenGL display our image for this frame
@@ -360,42 +622,78 @@ void FrameGrabLoop(void)
   glEnable(GL_TEXTURE_2D);
   glDisable(GL_LIGHTING);
 
+  t0=stageClock();
   if (frame==0)
   {
    glGenTextures( 1, &texture);
    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
    glBindTexture( GL_TEXTURE_2D, texture);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
    glTexEnvf( GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_DECAL);
-   glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, 1024, 1024, 0, GL_RGB, GL_UNSIGNED_BYTE, big);
+   glTexImage2D (GL_TEXTURE_2D, 0, GL_RGB, 1024, 768, 0, GL_RGB, GL_UNSIGNED_BYTE, big);
+
+   // Uploads go through a pixel buffer object where available, so the driver can
+   // copy to the texture asynchronously instead of stalling on client memory
+   if (strstr((const char *)glGetString(GL_EXTENSIONS),"GL_ARB_pixel_buffer_object")!=NULL)
+   {
+    glGenBuffers(1,&texturePBO);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER,texturePBO);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER,1024*768*3,NULL,GL_STREAM_DRAW);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER,0);
+   }
   }
   else
   {
    glBindTexture(GL_TEXTURE_2D, texture);
-   glTexSubImage2D(GL_TEXTURE_2D,0,0,0,1024,1024,GL_RGB,GL_UNSIGNED_BYTE,big);
+   if (texturePBO)
+   {
+    // Orphan the last frame's storage so mapping doesn't wait on its upload
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER,texturePBO);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER,1024*768*3,NULL,GL_STREAM_DRAW);
+    pbo=(unsigned char *)glMapBuffer(GL_PIXEL_UNPACK_BUFFER,GL_WRITE_ONLY);
+    if (pbo!=NULL)
+    {
+     memcpy(pbo,big,1024*768*3);
+     glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+     glTexSubImage2D(GL_TEXTURE_2D,0,0,0,1024,768,GL_RGB,GL_UNSIGNED_BYTE,0);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER,0);
+   }
+   else glTexSubImage2D(GL_TEXTURE_2D,0,0,0,1024,768,GL_RGB,GL_UNSIGNED_BYTE,big);
   }
-  // Draw box bounding the viewing area
+  // Draw the field image. The screen area is the same the field had in the old
+  // 1024x1024 texture layout.
   glBegin (GL_QUADS);
   glTexCoord2f (0.0, 0.0);
-  glVertex3f (0.0, 60.0, 0.0);
+  glVertex3f (0.0, 145.0, 0.0);
   glTexCoord2f (1.0, 0.0);
-  glVertex3f (800.0, 60.0, 0.0);
+  glVertex3f (800.0, 145.0, 0.0);
   glTexCoord2f (1.0, 1.0);
-  glVertex3f (800.0, 740.0, 0.0);
+  glVertex3f (800.0, 655.0, 0.0);
   glTexCoord2f (0.0, 1.0);
-  glVertex3f (0.0, 740.0, 0.0);
+  glVertex3f (0.0, 655.0, 0.0);
   glEnd ();
 
+  // Blob overlays, from field image coordinates onto the quad above
+  if (dispNOvl[dispFront]>0)
+  {
+   glPushMatrix();
+   glTranslatef(0.0,145.0,0.0);
+   glScalef(800.0/1024.0,510.0/768.0,1.0);
+   drawOverlays(&dispOvl[dispFront][0],dispNOvl[dispFront]);
+   glPopMatrix();
+  }
+  if (showStats) drawStats();
+
   // Make sure all OpenGL commands are executed
   glFlush();
   // Swap buffers to enable smooth animation
   glutSwapBuffers();
+  stageRecord(STAGE_UPLOAD,t0);
 
-  // Clean Up - Do all the image processing, AI, and planning before this code
-  free(im);				// Release memory used by the current frame
   frame++;
 
   // Tell glut window to update ls itself
@@ -403,12 +701,206 @@ void FrameGrabLoop(void)
   glutPostRedisplay();
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Per-stage timing
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+double stageClock(void)
+{
+ // Monotonic time in ms, for stage timing
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC,&t);
+ return((t.tv_sec*1000.0)+(t.tv_nsec/1000000.0));
+}
+
+void stageRecord(int stage, double t0)
+{
+ // Add the time since t0 (from stageClock()) to the histogram for stage
+ stageRecordMs(stage,stageClock()-t0);
+}
+
+void stageRecordMs(int stage, double ms)
+{
+ // Add a time of ms milliseconds to the histogram for stage
+ int b;
+
+ b=(int)((ms*1000.0)/STAT_BIN_US);
+ if (b<0) b=0;
+ if (b>STAT_BINS) b=STAT_BINS;
+ pthread_mutex_lock(&statLock);
+ stats.hist[stage][b]++;
+ stats.n[stage]++;
+ pthread_mutex_unlock(&statLock);
+}
+
+static double statPercentile(unsigned int *hist, unsigned int n, double p)
+{
+ // Upper edge (in ms) of the histogram bin holding the p-th percentile
+ unsigned int c,t;
+ int b;
+
+ t=(unsigned int)ceil(p*n);
+ if (t<1) t=1;
+ c=0;
+ for (b=0;b<STAT_BINS;b++)
+ {
+  c+=*(hist+b);
+  if (c>=t) break;
+ }
+ return(((b+1)*STAT_BIN_US)/1000.0);
+}
+
+void stageReport(void)
+{
+ ////////////////////////////////////////////////////////////////////////
+ //
+ // Called once per processed frame. Every STAT_PERIOD seconds, computes
+ // p50/p95/p99 for each stage from the histograms (these are what the
+ // 'p' overlay shows), appends them to STAT_FILE, and starts new
+ // histograms.
+ //
+ ////////////////////////////////////////////////////////////////////////
+ double t;
+ int s;
+ FILE *f;
+
+ t=stageClock();
+ if (stats.periodStart==0) stats.periodStart=t;
+ if (t-stats.periodStart<STAT_PERIOD*1000.0) return;
+
+ pthread_mutex_lock(&statLock);
+ for (s=0;s<NSTAGES;s++)
+ {
+  stats.count[s]=stats.n[s];
+  if (stats.n[s]==0) {stats.p[s][0]=stats.p[s][1]=stats.p[s][2]=0; continue;}
+  stats.p[s][0]=statPercentile(&stats.hist[s][0],stats.n[s],.5);
+  stats.p[s][1]=statPercentile(&stats.hist[s][0],stats.n[s],.95);
+  stats.p[s][2]=statPercentile(&stats.hist[s][0],stats.n[s],.99);
+ }
+ memset(&stats.hist[0][0],0,NSTAGES*(STAT_BINS+1)*sizeof(unsigned int));
+ memset(&stats.n[0],0,NSTAGES*sizeof(unsigned int));
+ pthread_mutex_unlock(&statLock);
+
+ f=fopen(STAT_FILE,"a");
+ if (f!=NULL)
+ {
+  if (ftell(f)==0) fprintf(f,"time,period,stage,count,p50_ms,p95_ms,p99_ms\n");
+  for (s=0;s<NSTAGES;s++)
+   fprintf(f,"%.3f,%.3f,%s,%u,%.3f,%.3f,%.3f\n",t/1000.0,(t-stats.periodStart)/1000.0,\
+           stageName[s],stats.count[s],stats.p[s][0],stats.p[s][1],stats.p[s][2]);
+  fclose(f);
+ }
+ if (showStats&&headless)
+ {
+  for (s=0;s<NSTAGES;s++)
+   fprintf(stderr,"%-8s n=%5u  p50=%7.2f  p95=%7.2f  p99=%7.2f ms\n",stageName[s],stats.count[s],\
+           stats.p[s][0],stats.p[s][1],stats.p[s][2]);
+ }
+ stats.periodStart=t;
+}
+
+void drawStats(void)
+{
+ // On-screen overlay with the stage timing percentiles from the last period
+ char line[128];
+ const char *c;
+ int s;
+
+ glDisable(GL_TEXTURE_2D);
+ glColor3f(1.0,1.0,0.0);
+ glRasterPos2f(10.0,75.0);
+ for (c="stage      p50    p95    p99 (ms)";*c;c++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13,*c);
+ pthread_mutex_lock(&statLock);
+ for (s=0;s<NSTAGES;s++)
+ {
+  sprintf(line,"%-8s %6.2f %6.2f %6.2f",stageName[s],stats.p[s][0],stats.p[s][1],stats.p[s][2]);
+  glRasterPos2f(10.0,75.0+(14.0*(s+1)));
+  for (c=line;*c;c++) glutBitmapCharacter(GLUT_BITMAP_8_BY_13,*c);
+ }
+ pthread_mutex_unlock(&statLock);
+ glColor3f(1.0,1.0,1.0);
+}
+
 /////////////////////////////////////////////////////////////////////////////////////
 // Field processing functions:
 //   - Field un-warping
 //   - Homography computation
 //   - Background subtraction
 /////////////////////////////////////////////////////////////////////////////////////
+static int unwarpMapAlloc(struct unwarpMap *m)
+{
+ // Allocates the remap table arrays. Returns 0, or -1 if out of memory.
+ m->src=(int *)calloc(1024*768,sizeof(int));
+ m->wx=(unsigned char *)calloc(1024*768,sizeof(unsigned char));
+ m->wy=(unsigned char *)calloc(1024*768,sizeof(unsigned char));
+ if (m->src==NULL||m->wx==NULL||m->wy==NULL)
+ {
+  fprintf(stderr,"buildUnwarpMap(): Out of memory!\n");
+  free(m->src);
+  free(m->wx);
+  free(m->wy);
+  m->src=NULL;
+  m->wx=m->wy=NULL;
+  return(-1);
+ }
+ return(0);
+}
+
+void buildUnwarpMap(double *H, int srcx, int srcy)
+{
+ ////////////////////////////////////////////////////////////////////////////
+ //
+ // Builds the remap table used by fieldUnwarp() and fieldFromYUYV() for
+ // the homography H and a source frame of size (srcx, srcy). This is the
+ // only place where the projective transform (and its divide) is evaluated
+ // for every field pixel, so it only runs when H changes.
+ //
+ ////////////////////////////////////////////////////////////////////////////
+ int i,j;
+ double px,py,pw;
+ struct unwarpMap *m;
+
+ m=&uwMap;
+ if (m->src==NULL&&unwarpMapAlloc(m)<0) return;
+
+#pragma omp parallel for schedule(dynamic,16) private(i,j,px,py,pw)
+ for (j=0;j<768;j++)
+  for (i=0;i<1024;i++)
+  {
+   *(m->src+i+(j*1024))=-1;
+   *(m->wx+i+(j*1024))=0;
+   *(m->wy+i+(j*1024))=0;
+   if (j<1||j>766||i<1||i>1022) continue;
+   px=((*(H+0))*i) + ((*(H+1))*j) + (*(H+2));
+   py=((*(H+3))*i) + ((*(H+4))*j) + (*(H+5));
+   pw=((*(H+6))*i) + ((*(H+7))*j) + (*(H+8));
+   px=px/pw;
+   py=py/pw;
+   if (px>0&&px<srcx-1&&py>0&&py<srcy-1)
+   {
+    *(m->src+i+(j*1024))=((int)px)+(((int)py)*srcx);
+    *(m->wx+i+(j*1024))=(unsigned char)((px-(int)px)*256.0);
+    *(m->wy+i+(j*1024))=(unsigned char)((py-(int)py)*256.0);
+   }
+  }
+
+ memcpy(&m->H[0],H,9*sizeof(double));
+ m->sx=srcx;
+ m->sy=srcy;
+}
+
+struct unwarpMap *getUnwarpMap(double *H, int srcx, int srcy)
+{
+ // Returns the remap table for H, rebuilding it if H or the frame size
+ // have changed since it was last built.
+ if (H==NULL) return(NULL);
+ if (uwMap.src==NULL||uwMap.sx!=srcx||uwMap.sy!=srcy||memcmp(&uwMap.H[0],H,9*sizeof(double))!=0)
+  buildUnwarpMap(H,srcx,srcy);
+ if (uwMap.src==NULL) return(NULL);
+ return(&uwMap);
+}
+
 void fieldUnwarp(double *H, struct image *im)
 {
  ////////////////////////////////////////////////////////////////////////////
@@ -424,111 +916,512 @@ void fieldUnwarp(double *H, struct image *im)
  // 3 - bottom-right
  // 4 - bottom-left
  //
- // This code uses bi-linear interpolation during rectification.
+ // This code uses bi-linear interpolation during rectification. Source
+ // locations and weights come from the cached remap table for H.
  ////////////////////////////////////////////////////////////////////////////
- int i,j;
- double px,py,pw;
- double dx,dy;
+ int i,k,o;
+ double wx,wy;
  unsigned char *fi;
- double r1,g1,b1,r2,g2,b2,r3,g3,b3,r4,g4,b4;
- double R,G,B;
- 
+ struct unwarpMap *m;
+ double *l0,*l1,*l2;
+
  if (H==NULL) return;
+ m=getUnwarpMap(H,im->sx,im->sy);
+ if (m==NULL) return;
 
  fi=&fieldIm[0];
- memset(fi,0,1024*768*3*sizeof(unsigned char));
+ l0=im->layers[0];
+ l1=im->layers[1];
+ l2=im->layers[2];
 
-#pragma omp parallel for schedule(dynamic,16) private(i,j,px,py,pw,dx,dy,R,G,B,r1,g1,b1,r2,g2,b2,r3,g3,b3,r4,g4,b4)
- for (j=1;j<767;j++)
-  for (i=1;i<1023;i++)
+#pragma omp parallel for schedule(dynamic,4096) private(i,k,o,wx,wy)
+ for (i=0;i<1024*768;i++)
+ {
+  o=*(m->src+i);
+  if (o<0)
   {
-   // Obtain coordinates for this pixel in the unwarped image
-   px=((*(H+0))*i) + ((*(H+1))*j) + (*(H+2));
-   py=((*(H+3))*i) + ((*(H+4))*j) + (*(H+5));
-   pw=((*(H+6))*i) + ((*(H+7))*j) + (*(H+8));
-   px=px/pw;
-   py=py/pw;
-   dx=px-(int)px;
-   dy=py-(int)py;
-   if (px>0&&px<im->sx-1&&py>0&&py<im->sy-1)
-   {
-    R=G=B=0;
-    r1=*(im->layers[0]+ ((int)px) + (((int)py) * im->sx));
-    g1=*(im->layers[1]+ ((int)px) + (((int)py) * im->sx));
-    b1=*(im->layers[2]+ ((int)px) + (((int)py) * im->sx));
-    r2=*(im->layers[0]+ ((int)px+1) + (((int)py) * im->sx));
-    g2=*(im->layers[1]+ ((int)px+1) + (((int)py) * im->sx));
-    b2=*(im->layers[2]+ ((int)px+1) + (((int)py) * im->sx));
-    r3=*(im->layers[0]+ ((int)px) + (((int)py+1) * im->sx));
-    g3=*(im->layers[1]+ ((int)px) + (((int)py+1) * im->sx));
-    b3=*(im->layers[2]+ ((int)px) + (((int)py+1) * im->sx));
-    r4=*(im->layers[0]+ ((int)px+1) + (((int)py+1) * im->sx));
-    g4=*(im->layers[1]+ ((int)px+1) + (((int)py+1) * im->sx));
-    b4=*(im->layers[2]+ ((int)px+1) + (((int)py+1) * im->sx));
-    r1=((1.0-dx)*r1)+(dx*r2);
-    g1=((1.0-dx)*g1)+(dx*g2);
-    b1=((1.0-dx)*b1)+(dx*b2);
-    r3=((1.0-dx)*r3)+(dx*r4);
-    g3=((1.0-dx)*g3)+(dx*g4);
-    b3=((1.0-dx)*b3)+(dx*b4);
-    R=((1.0-dy)*r1)+(dy*r3);
-    G=((1.0-dy)*g1)+(dy*g3);
-    B=((1.0-dy)*b1)+(dy*b3);
-    *(fi+((i+(j*1024))*3)+0)=(unsigned char)(R);
-    *(fi+((i+(j*1024))*3)+1)=(unsigned char)(G);
-    *(fi+((i+(j*1024))*3)+2)=(unsigned char)(B);  
-   }
+   *(fi+(i*3)+0)=0;
+   *(fi+(i*3)+1)=0;
+   *(fi+(i*3)+2)=0;
+   continue;
   }
+  wx=(*(m->wx+i))*(1.0/256.0);
+  wy=(*(m->wy+i))*(1.0/256.0);
+  k=o+im->sx;
+  *(fi+(i*3)+0)=(unsigned char)(((1.0-wy)*(((1.0-wx)*l0[o])+(wx*l0[o+1])))+(wy*(((1.0-wx)*l0[k])+(wx*l0[k+1]))));
+  *(fi+(i*3)+1)=(unsigned char)(((1.0-wy)*(((1.0-wx)*l1[o])+(wx*l1[o+1])))+(wy*(((1.0-wx)*l1[k])+(wx*l1[k+1]))));
+  *(fi+(i*3)+2)=(unsigned char)(((1.0-wy)*(((1.0-wx)*l2[o])+(wx*l2[o+1])))+(wy*(((1.0-wx)*l2[k])+(wx*l2[k+1]))));
+ }
 
 }
 
-double *getH(void)
+static inline void yuyvSample(unsigned char *yuyv, int idx, int *Y, int *U, int *V)
 {
- //////////////////////////////////////////////////////////////////////
+ // Returns the luma and chroma (U and V offset by 128) of pixel idx
+ // (=x+(y*width)) in a YUYV frame. Each pair of pixels shares its chroma.
+ unsigned char *p;
+
+ p=yuyv+((idx&~1)*2);
+ *Y=*(p+((idx&1)<<1));
+ *U=*(p+1);
+ *V=*(p+3);
+}
+
+static inline void yuvToRGB(int Y, int U, int V, unsigned char *rgb)
+{
+ // RGB colour of [Y U V] (U and V offset by 128). Uses the same integer
+ // conversion (and clamping) as yuyv_to_rgb() so results match.
+ int r,g,b;
+
+ Y<<=8;
+ U-=128;
+ V-=128;
+ r=(Y+(359*V))>>8;
+ g=(Y-(88*U)-(183*V))>>8;
+ b=(Y+(454*U))>>8;
+ *(rgb+0)=(r>255)?255:((r<0)?0:r);
+ *(rgb+1)=(g>255)?255:((g<0)?0:g);
+ *(rgb+2)=(b>255)?255:((b<0)?0:b);
+}
+
+static inline void rgbToYUV(int R, int G, int B, unsigned char *yuv)
+{
+ // Inverse of yuvToRGB(), up to rounding
+ int y,u,v;
+
+ y=((77*R)+(150*G)+(29*B)+128)>>8;
+ u=((((B-y)*144)+128)>>8)+128;
+ v=((((R-y)*183)+128)>>8)+128;
+ *(yuv+0)=y;
+ *(yuv+1)=(u>255)?255:((u<0)?0:u);
+ *(yuv+2)=(v>255)?255:((v<0)?0:v);
+}
+
+static inline int chromaIndex(int U, int V)
+{
+ // Index of the colour table entry for chroma [U V] (offset by 128)
+ return(((U>>(8-CHROMA_BITS))<<CHROMA_BITS)|(V>>(8-CHROMA_BITS)));
+}
+
+static inline int satTest(struct hueLUT *lut, int Y, int U, int V)
+{
+ // Returns 1 if the saturation of [Y U V] is at least colThresh. The
+ // chroma alone fixes the spread C=max-min of the RGB components, and how
+ // far the max. component is above luma (D), so S=C/(Y+D)>=colThresh
+ // becomes C-(colThresh*D)>=colThresh*Y, with the left side from the table.
+ return(lut->e[chromaIndex(U,V)].sat>=lut->satY*Y);
+}
+
+static inline int bgUpdate(int i, int y, int u, int v)
+{
+ // Background test for field pixel i with colour [y u v]. Returns 1 if the
+ // pixel is background. A pixel is background if its squared distance to
+ // the background mean is below bgThresh, or below BG_VAR_K times the
+ // pixel's own variance (for pixels that are noisy, e.g. flickering
+ // lights). Background pixels are blended into the model at a rate of
+ // 1/2^BG_RATE_SHIFT, so slow lighting changes are absorbed as they
+ // happen. Foreground pixels leave the model alone.
  //
- // This function estimates the homography matrix H from the 4 corner
- // coordinates input by the user. These 4 corners are made to 
- // correspond to the 4 corners of the displayed rectangular image.
+ // The distance is in YUV, weighted (3, 3.25, 2.5) so that it is close to
+ // the squared RGB distance bgThresh and the variance are measured in.
+ int dy,du,dv,dd,k;
+ unsigned short *m;
+
+ dy=y-bgYUV[(i*3)+0];
+ du=u-bgYUV[(i*3)+1];
+ dv=v-bgYUV[(i*3)+2];
+ dd=((12*dy*dy)+(13*du*du)+(10*dv*dv))>>2;
+ k=bgVar[i];
+ if (dd>=bgThresh&&dd*BG_VAR_ONE>=BG_VAR_K*k) return(0);
+ if (!bgAdapt) return(1);
+
+ m=&bgMean[i*3];
+ *(m+0)+=((y<<8)-*(m+0))>>BG_RATE_SHIFT;
+ *(m+1)+=((u<<8)-*(m+1))>>BG_RATE_SHIFT;
+ *(m+2)+=((v<<8)-*(m+2))>>BG_RATE_SHIFT;
+ bgYUV[(i*3)+0]=(*(m+0)+128)>>8;
+ bgYUV[(i*3)+1]=(*(m+1)+128)>>8;
+ bgYUV[(i*3)+2]=(*(m+2)+128)>>8;
+ k+=((dd*BG_VAR_ONE)-k)>>BG_RATE_SHIFT;
+ bgVar[i]=(k>65535)?65535:k;
+ return(1);
+}
+
+void seedBgModel(unsigned short *var)
+{
+ ////////////////////////////////////////////////////////////////////////
  //
- //////////////////////////////////////////////////////////////////////
- double cD[4],tcorners[4][2];
- double corners2[4][2]={1.0,1.0,1023.0,1.0,1023.0,767.0,1.0,767.0};
- double A[8][9],B[8][8],b[8],Binv[8][8];
- double *U,*s,*V,*rv1;
- double *H;
- int i,j;
+ // Initializes the running background model from bgIm. If var is NULL
+ // (no variance saved with the calibration data), the variance starts
+ // out so that the model's test matches the plain bgThresh test.
+ //
+ ////////////////////////////////////////////////////////////////////////
+ int i,v;
+
+ v=(int)(bgThresh*BG_VAR_ONE/BG_VAR_K);
+ if (v>65535) v=65535;
+ for (i=0;i<1024*768;i++) rgbToYUV(bgIm[(i*3)+0],bgIm[(i*3)+1],bgIm[(i*3)+2],&bgYUV[i*3]);
+ for (i=0;i<1024*768*3;i++) bgMean[i]=bgYUV[i]<<8;
+ if (var!=NULL) memcpy(&bgVar[0],var,1024*768*sizeof(unsigned short));
+ else for (i=0;i<1024*768;i++) bgVar[i]=v;
+}
 
- for (i=0;i<4;i++)
+static unsigned long long calibChecksum(const unsigned char *p, size_t n, unsigned long long h)
+{
+ // FNV-1a over 64-bit words (bytes for the tail). Start with h=0, pass the result
+ // back in to continue over another block.
+ unsigned long long w;
+ size_t i;
+
+ if (h==0) h=14695981039346656037ULL;
+ for (i=0;i+8<=n;i+=8)
  {
-  A[(2*i)+0][0]=0;
-  A[(2*i)+0][1]=0;
-  A[(2*i)+0][2]=0;
-  A[(2*i)+0][3]=-corners2[i][0];
-  A[(2*i)+0][4]=-corners2[i][1];
-  A[(2*i)+0][5]=-1;
-  A[(2*i)+0][6]=corners2[i][0]*Mcorners[i][1];
-  A[(2*i)+0][7]=corners2[i][1]*Mcorners[i][1];
-  A[(2*i)+0][8]=Mcorners[i][1];
-  A[(2*i)+1][0]=corners2[i][0];
-  A[(2*i)+1][1]=corners2[i][1];
-  A[(2*i)+1][2]=1;
-  A[(2*i)+1][3]=0;
-  A[(2*i)+1][4]=0;
-  A[(2*i)+1][5]=0;
-  A[(2*i)+1][6]=-corners2[i][0]*Mcorners[i][0];
-  A[(2*i)+1][7]=-corners2[i][1]*Mcorners[i][0];
-  A[(2*i)+1][8]=-Mcorners[i][0];
+  memcpy(&w,p+i,8);
+  h=(h^w)*1099511628211ULL;
  }
+ for (;i<n;i++) h=(h^*(p+i))*1099511628211ULL;
+ return(h);
+}
 
- // Allocate memory for the homography!
- H=(double *)calloc(9,sizeof(double));	// H should be the last row of U
+static void calibArrays(unsigned char **arr, unsigned long long *len)
+{
+ // The arrays stored in the calibration file, in file order
+ arr[0]=(unsigned char *)&bgMean[0];	len[0]=sizeof(bgMean);
+ arr[1]=&bgYUV[0];			len[1]=sizeof(bgYUV);
+ arr[2]=(unsigned char *)&bgVar[0];	len[2]=sizeof(bgVar);
+ arr[3]=&bgIm[0];			len[3]=sizeof(bgIm);
+ arr[4]=(unsigned char *)uwMap.src;	len[4]=1024*768*sizeof(int);
+ arr[5]=uwMap.wx;			len[5]=1024*768*sizeof(unsigned char);
+ arr[6]=uwMap.wy;			len[6]=1024*768*sizeof(unsigned char);
+}
 
- U=NULL;
- s=NULL;
- V=NULL;
- rv1=NULL;
+int saveCalibration(void)
+{
+ ////////////////////////////////////////////////////////////////////////
+ //
+ // Writes the calibration data to CALIB_FILE (see struct calibHeader):
+ // H, its remap table, the current background model, the colour
+ // thresholds, and the Y offsets if they have been captured. The file
+ // is put together in memory and written aside, then renamed over the
+ // old one, so a crash never leaves a partial file behind.
+ //
+ ////////////////////////////////////////////////////////////////////////
+ struct calibHeader hd;
+ struct unwarpMap *m;
+ unsigned char *arr[CALIB_ARRAYS], *buf;
+ unsigned long long o;
+ FILE *f;
+ int i;
+
+ if (H==NULL||!gotbg) return(-1);
+ m=getUnwarpMap(H,sx,sy);
+ if (m==NULL) return(-1);
+ for (i=0;i<1024*768;i++) yuvToRGB(bgYUV[(i*3)+0],bgYUV[(i*3)+1],bgYUV[(i*3)+2],&bgIm[i*3]);
+
+ memset(&hd,0,sizeof(struct calibHeader));
+ memcpy(&hd.magic[0],CALIB_MAGIC,sizeof(CALIB_MAGIC));
+ hd.version=CALIB_VERSION;
+ hd.headerSize=sizeof(struct calibHeader);
+ hd.sx=sx;
+ hd.sy=sy;
+ hd.fx=1024;
+ hd.fy=768;
+ memcpy(&hd.H[0],H,9*sizeof(double));
+ hd.bgThresh=bgThresh;
+ hd.colThresh=colThresh;
+ hd.colAngThresh=colAngThresh;
+ hd.gotY=(got_Y==3);
+ if (hd.gotY) memcpy(&hd.adj_Y[0][0],&adj_Y[0][0],4*sizeof(double));
+ hd.bgAdapt=bgAdapt;
+ calibArrays(&arr[0],&hd.len[0]);
+ o=sizeof(struct calibHeader);
+ for (i=0;i<CALIB_ARRAYS;i++)
+ {
+  o=(o+CALIB_ALIGN-1)&~((unsigned long long)CALIB_ALIGN-1);
+  hd.off[i]=o;
+  o+=hd.len[i];
+ }
+ hd.fileSize=o;
 
- SVD(&A[0][0],8,9,&U,&s,&V,&rv1);
+ buf=(unsigned char *)calloc(hd.fileSize,sizeof(unsigned char));
+ if (buf==NULL)
+ {
+  fprintf(stderr,"saveCalibration(): Out of memory!\n");
+  return(-1);
+ }
+ for (i=0;i<CALIB_ARRAYS;i++) memcpy(buf+hd.off[i],arr[i],hd.len[i]);
+ memcpy(buf,&hd,sizeof(struct calibHeader));
+ hd.checksum=calibChecksum(buf,hd.fileSize,0);
+ memcpy(buf,&hd,sizeof(struct calibHeader));
+
+ f=fopen(CALIB_FILE ".tmp","w");
+ if (f==NULL||fwrite(buf,hd.fileSize,1,f)!=1)
+ {
+  fprintf(stderr,"Unable to write calibration data to %s\n",CALIB_FILE);
+  if (f!=NULL) fclose(f);
+  free(buf);
+  return(-1);
+ }
+ free(buf);
+ if (fclose(f)!=0||rename(CALIB_FILE ".tmp",CALIB_FILE)<0)
+ {
+  fprintf(stderr,"Unable to write calibration data to %s\n",CALIB_FILE);
+  return(-1);
+ }
+ return(0);
+}
+
+int loadCalibration(void)
+{
+ ////////////////////////////////////////////////////////////////////////
+ //
+ // Restores the calibration saved by saveCalibration(). The file is
+ // mapped, checked (version, layout, checksum, and camera frame size),
+ // and copied into H, the remap table, the background model, and the
+ // thresholds, so nothing has to be rebuilt before the next frame.
+ // Returns 0 on success, -1 if there is no usable file (nothing is
+ // changed then).
+ //
+ ////////////////////////////////////////////////////////////////////////
+ struct calibHeader hd;
+ struct stat st;
+ unsigned char *arr[CALIB_ARRAYS], *p;
+ unsigned long long len[CALIB_ARRAYS], sum;
+ int fd,i,ok;
+
+ fd=open(CALIB_FILE,O_RDONLY);
+ if (fd<0) return(-1);
+ if (fstat(fd,&st)<0||st.st_size<(off_t)sizeof(struct calibHeader))
+ {
+  fprintf(stderr,"loadCalibration(): %s is not a calibration file\n",CALIB_FILE);
+  close(fd);
+  return(-1);
+ }
+ p=(unsigned char *)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+ close(fd);
+ if (p==MAP_FAILED)
+ {
+  fprintf(stderr,"loadCalibration(): Unable to map %s\n",CALIB_FILE);
+  return(-1);
+ }
+
+ // Layout checks first, so the offsets can be trusted
+ memcpy(&hd,p,sizeof(struct calibHeader));
+ ok=(!memcmp(&hd.magic[0],CALIB_MAGIC,sizeof(CALIB_MAGIC))&&hd.version==CALIB_VERSION&&
+     hd.headerSize==sizeof(struct calibHeader)&&hd.fileSize==(unsigned long long)st.st_size&&
+     hd.fx==1024&&hd.fy==768);
+ if (!ok) fprintf(stderr,"loadCalibration(): %s has an unknown format or version\n",CALIB_FILE);
+ if (ok)
+ {
+  calibArrays(&arr[0],&len[0]);
+  for (i=0;i<CALIB_ARRAYS;i++)
+   if (hd.len[i]!=len[i]||hd.off[i]<sizeof(struct calibHeader)||hd.off[i]+hd.len[i]>hd.fileSize) ok=0;
+  if (!ok) fprintf(stderr,"loadCalibration(): %s has a bad layout\n",CALIB_FILE);
+ }
+ if (ok)
+ {
+  sum=hd.checksum;
+  hd.checksum=0;
+  if (calibChecksum(p+sizeof(struct calibHeader),hd.fileSize-sizeof(struct calibHeader),
+                    calibChecksum((unsigned char *)&hd,sizeof(struct calibHeader),0))!=sum)
+  {
+   fprintf(stderr,"loadCalibration(): %s is corrupt (bad checksum)\n",CALIB_FILE);
+   ok=0;
+  }
+ }
+ if (ok&&(hd.sx!=sx||hd.sy!=sy))
+ {
+  fprintf(stderr,"loadCalibration(): %s is for %dx%d frames, the camera gives %dx%d. Please recalibrate\n",
+          CALIB_FILE,hd.sx,hd.sy,sx,sy);
+  ok=0;
+ }
+ if (ok&&uwMap.src==NULL&&unwarpMapAlloc(&uwMap)<0) ok=0;
+ if (!ok)
+ {
+  munmap(p,st.st_size);
+  return(-1);
+ }
+
+ if (H==NULL) H=(double *)calloc(9,sizeof(double));
+ memcpy(H,&hd.H[0],9*sizeof(double));
+ calibArrays(&arr[0],&len[0]);
+ for (i=0;i<CALIB_ARRAYS;i++) memcpy(arr[i],p+hd.off[i],len[i]);
+ memcpy(&uwMap.H[0],H,9*sizeof(double));
+ uwMap.sx=sx;
+ uwMap.sy=sy;
+ munmap(p,st.st_size);
+
+ bgThresh=hd.bgThresh;
+ colThresh=hd.colThresh;
+ colAngThresh=hd.colAngThresh;
+ bgAdapt=hd.bgAdapt;
+ if (hd.gotY)
+ {
+  memcpy(&adj_Y[0][0],&hd.adj_Y[0][0],4*sizeof(double));
+  got_Y=3;
+ }
+ getHueLUT();				// Colour table for the restored thresholds
+ roi.sinceFull=ROI_FULL_EVERY;		// Full scan on the next frame
+ gotbg=1;
+ return(0);
+}
+
+void fieldFromYUYV(double *H, struct vdIn *vd)
+{
+ ////////////////////////////////////////////////////////////////////////////
+ //
+ // Fused capture-to-field kernel. Does the work of yuyv_to_rgb(),
+ // imageFromBuffer(), fieldUnwarp(), and bgSubtract2() in a single pass:
+ //
+ // For each pixel in the rectified field it looks up the corresponding
+ // location in the camera frame in the remap table for H, interpolates the
+ // luma and chroma of the 4 YUYV neighbours bi-linearly (in fixed point),
+ // and applies the background and saturation tests. Only the final
+ // foreground is written to fieldIm, so the frame data crosses memory once
+ // instead of four or five times.
+ //
+ // Everything is done in YUV - the colour tests work on the chroma vector
+ // (see buildHueLUT()), and the foreground in fieldIm is YUV. RGB is only
+ // needed for display (see fieldToRGB()).
+ ////////////////////////////////////////////////////////////////////////////
+ int win[4];
+
+ win[0]=0;
+ win[1]=0;
+ win[2]=1023;
+ win[3]=767;
+ fieldFromYUYVWin(H,vd,&win,1);
+}
+
+void fieldFromYUYVWin(double *H, struct vdIn *vd, int (*win)[4], int nwin)
+{
+ ////////////////////////////////////////////////////////////////////////////
+ //
+ // Same as fieldFromYUYV(), but only for the field pixels inside the given
+ // windows [x1 y1 x2 y2]. The rest of fieldIm is left untouched, and the
+ // background model is only updated inside the windows.
+ //
+ // The foreground is also marked in fgMask, one bit per field pixel. The
+ // mask is cleared first, so it only holds the foreground inside the windows.
+ ////////////////////////////////////////////////////////////////////////////
+ int i,j,k,o,w,wx,wy;
+ unsigned char *fi, *yuyv;
+ int y1,u1,v1,y2,u2,v2,y3,u3,v3,y4,u4,v4;
+ int y,u,v;
+ int fg;
+ struct unwarpMap *m;
+ struct hueLUT *lut;
+
+ if (H==NULL) return;
+ m=getUnwarpMap(H,vd->width,vd->height);
+ if (m==NULL) return;
+ lut=getHueLUT();
+ if (lut==NULL) return;
+
+ fi=&fieldIm[0];
+ yuyv=vd->framebuffer;
+ w=vd->width;
+ memset(&fgMask[0],0,MASK_WORDS(1024)*768*sizeof(unsigned long long));
+
+ for (k=0;k<nwin;k++)
+ {
+#pragma omp parallel for schedule(dynamic,4) private(i,j,o,wx,wy,y1,u1,v1,y2,u2,v2,y3,u3,v3,y4,u4,v4,y,u,v,fg)
+  for (j=win[k][1];j<=win[k][3];j++)
+   for (i=(j*1024)+win[k][0];i<=(j*1024)+win[k][2];i++)
+   {
+    fg=0;
+    o=*(m->src+i);
+    if (o>=0)
+    {
+     wx=*(m->wx+i);
+     wy=*(m->wy+i);
+     yuyvSample(yuyv,o,&y1,&u1,&v1);
+     yuyvSample(yuyv,o+1,&y2,&u2,&v2);
+     yuyvSample(yuyv,o+w,&y3,&u3,&v3);
+     yuyvSample(yuyv,o+w+1,&y4,&u4,&v4);
+     y=(((((256-wx)*y1)+(wx*y2))*(256-wy))+((((256-wx)*y3)+(wx*y4))*wy))>>16;
+     if (o&1)
+     {
+      u=(((((256-wx)*u1)+(wx*u2))*(256-wy))+((((256-wx)*u3)+(wx*u4))*wy))>>16;
+      v=(((((256-wx)*v1)+(wx*v2))*(256-wy))+((((256-wx)*v3)+(wx*v4))*wy))>>16;
+     }
+     else
+     {
+      // Both columns are in the same YUYV pair, so share their chroma
+      u=(((256-wy)*u1)+(wy*u3))>>8;
+      v=(((256-wy)*v1)+(wy*v3))>>8;
+     }
+     fg=1;
+
+     // Background and saturation tests (updating the background model) -
+     // same as bgSubtract2()
+     if (gotbg)
+      if (bgUpdate(i,y,u,v)||!satTest(lut,y,u,v)) fg=0;
+    }
+    if (fg)
+    {
+     *(fi+(i*3)+0)=(unsigned char)(y);
+     *(fi+(i*3)+1)=(unsigned char)(u);
+     *(fi+(i*3)+2)=(unsigned char)(v);
+     fgMask[i>>6]|=1ULL<<(i&63);		// Rows are 16 words, so this is bit (i,j)
+    }
+    else
+    {
+     *(fi+(i*3)+0)=0;
+     *(fi+(i*3)+1)=0;
+     *(fi+(i*3)+2)=0;
+    }
+   }
+ }
+}
+
+double *getH(void)
+{
+ //////////////////////////////////////////////////////////////////////
+ //
+ // This function estimates the homography matrix H from the 4 corner
+ // coordinates input by the user. These 4 corners are made to 
+ // correspond to the 4 corners of the displayed rectangular image.
+ //
+ //////////////////////////////////////////////////////////////////////
+ double cD[4],tcorners[4][2];
+ double corners2[4][2]={1.0,1.0,1023.0,1.0,1023.0,767.0,1.0,767.0};
+ double A[8][9],B[8][8],b[8],Binv[8][8];
+ double *U,*s,*V,*rv1;
+ double *H;
+ int i,j;
+
+ for (i=0;i<4;i++)
+ {
+  A[(2*i)+0][0]=0;
+  A[(2*i)+0][1]=0;
+  A[(2*i)+0][2]=0;
+  A[(2*i)+0][3]=-corners2[i][0];
+  A[(2*i)+0][4]=-corners2[i][1];
+  A[(2*i)+0][5]=-1;
+  A[(2*i)+0][6]=corners2[i][0]*Mcorners[i][1];
+  A[(2*i)+0][7]=corners2[i][1]*Mcorners[i][1];
+  A[(2*i)+0][8]=Mcorners[i][1];
+  A[(2*i)+1][0]=corners2[i][0];
+  A[(2*i)+1][1]=corners2[i][1];
+  A[(2*i)+1][2]=1;
+  A[(2*i)+1][3]=0;
+  A[(2*i)+1][4]=0;
+  A[(2*i)+1][5]=0;
+  A[(2*i)+1][6]=-corners2[i][0]*Mcorners[i][0];
+  A[(2*i)+1][7]=-corners2[i][1]*Mcorners[i][0];
+  A[(2*i)+1][8]=-Mcorners[i][0];
+ }
+
+ // Allocate memory for the homography!
+ H=(double *)calloc(9,sizeof(double));	// H should be the last row of U
+
+ U=NULL;
+ s=NULL;
+ V=NULL;
+ rv1=NULL;
+
+ SVD(&A[0][0],8,9,&U,&s,&V,&rv1);
  // A note on sizes: A is 8x9, SVD should return U is 8x8, S is 8x9 
  // (or in this case a vector with 9 values), and V is 9x9. However,
  // Tom's code returns an 8x8 U, and a 9x8 V! missing last column
@@ -634,56 +1527,41 @@ void bgSubtract2(void)
  //
  // Pixels that are zeroed out include:
  //   - Any whose difference w.r.t. background is less than the specified bgThress (which is
- //     user controlled through the GUI)
+ //     user controlled through the GUI), or within the pixel's normal variation (see bgUpdate())
  //   - Any whose saturation value is less than a the specified threshold (colThresh, also
  //     controlled via the GUI)
  //
+ // Background pixels are also used to update the running background model.
+ // The pixels that are left are marked in the foreground mask fgMask, and
+ // converted to YUV (as fieldFromYUYV() leaves them).
+ //
  ///////////////////////////////////////////////////////////////////////////////
 
  int j,i;
- double r,g,b,R,G,B,dd,mg;
- double H,S,V;
- double imT[1024][768];
- char line[1024];
- FILE *f;
+ unsigned char *p;
+ struct hueLUT *lut;
  
  if (!gotbg) return;
-#pragma omp parallel for schedule(dynamic,16) private(i,j,r,g,b,R,G,B,dd,mg)
+ lut=getHueLUT();
+ if (lut==NULL) return;
+ memset(&fgMask[0],0,MASK_WORDS(1024)*768*sizeof(unsigned long long));
+#pragma omp parallel for schedule(dynamic,16) private(i,j,p)
  for (j=0;j<768;j++)
   for (i=0; i<1024; i++)
   {
-   r=fieldIm[((i+(j*1024))*3)+0];
-   g=fieldIm[((i+(j*1024))*3)+1];
-   b=fieldIm[((i+(j*1024))*3)+2];
-   R=bgIm[((i+(j*1024))*3)+0];
-   G=bgIm[((i+(j*1024))*3)+1];
-   B=bgIm[((i+(j*1024))*3)+2];
-   
-   // HSV conversion
-   if (r>g&&r>b) V=r; else if (g>b) V=g; else V=b;
-   if (V==0) S=0; else if (r<g&&r<b) S=(V-r)/V; else if (g<b) S=(V-g)/V; else S=(V-b)/V;
-   
-   imT[i][j]=S;
-   
-   // Compute magnitude of difference w.r.t. background image
-   dd=(r-R)*(r-R);
-   dd+=(g-G)*(g-G);
-   dd+=(b-B)*(b-B);
-   mg=(r+g+b)/3.0;
+   p=&fieldIm[(i+(j*1024))*3];
+   rgbToYUV(*(p+0),*(p+1),*(p+2),p);
 
    // Zero out background pixels and pixels that are not saturated (everything except uniforms/ball)
-   if (dd<bgThresh||S<colThresh)
+   // - saturation test is a table lookup, see getHueLUT()
+   if (bgUpdate(i+(j*1024),*(p+0),*(p+1),*(p+2))||!satTest(lut,*(p+0),*(p+1),*(p+2)))
    {  
     fieldIm[((i+(j*1024))*3)+0]=0;
     fieldIm[((i+(j*1024))*3)+1]=0;
     fieldIm[((i+(j*1024))*3)+2]=0;
    }
+   else fgMask[(j*MASK_WORDS(1024))+(i>>6)]|=1ULL<<(i&63);
   }
-  
-//  f=fopen("satdump.dat","w");
-//  fwrite(&imT[0][0],1024*768*sizeof(double),1,f);
-//  fclose(f);
-//  gets(&line[0]);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////////////////
@@ -732,14 +1610,24 @@ struct image *blobDetect(unsigned char *fgIm, int sx, int sy, struct blob **blob
  }
 
  // Assumed: Pixels in the input fgIm that have non-zero RGB values are foreground
- labIm=newImage(sx,sy,1);				// 1-layer labels image
+ labIm=labelImage(sx,sy);				// 1-layer labels image (see blobDetect2())
+ if (labIm==NULL) return(NULL);
+ for (j=0;j<sy;j++) {*(labSpan+(2*j))=0; *(labSpan+(2*j)+1)=sx-1;}	// Labels may be anywhere
  tmpIm=imageFromBuffer(fgIm,sx,sy,3);
  
  // Filter background subtracted, saturation thresholded map to make smoother blobs
- tmpIm2=convolve_x(tmpIm,kern);
+ tmpIm2=newImage(sx,sy,3);
+ if (kern==NULL||tmpIm==NULL||tmpIm2==NULL||convolve_sep(tmpIm,kern,kern,tmpIm2))
+ {
+  fprintf(stderr,"blobDetect(): Unable to filter the foreground image\n");
+  deleteImage(tmpIm);
+  deleteImage(tmpIm2);
+  deleteKernel(kern);
+  *(nblobs)=0;
+  return(NULL);
+ }
  deleteImage(tmpIm);
- tmpIm=convolve_y(tmpIm2,kern);
- deleteImage(tmpIm2);
+ tmpIm=tmpIm2;
  
  stack=&pixStack[0];
  lab=1;		
@@ -887,7 +1775,7 @@ struct image *blobDetect(unsigned char *fgIm, int sx, int sy, struct blob **blob
      Ba/=pixcnt;
      xc/=pixcnt;
      yc/=pixcnt;
-     bl=(struct blob *)calloc(1,sizeof(struct blob));
+     bl=newBlob();
      bl->label=lab;
      memset(&(bl->cx),0,5*sizeof(double));
      memset(&(bl->cy),0,5*sizeof(double));
@@ -978,19 +1866,143 @@ struct image *blobDetect(unsigned char *fgIm, int sx, int sy, struct blob **blob
  return(labIm);
 } 
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Frame memory - scratch arena, blob slab, and the label image, all reused from frame to frame
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+void *arenaAlloc(struct frameArena *a, size_t bytes)
+{
+ // Scratch memory from the arena, valid until the next arenaReset(). Sizes are rounded up to
+ // 64 bytes. If the arena is full the block is malloc'd instead, and the arena grows to fit
+ // at the next reset. The memory is not cleared. Returns NULL if out of memory.
+ unsigned char *p;
+
+ bytes=(bytes+63)&~((size_t)63);
+ a->need+=bytes;
+ if (a->used+bytes<=a->size)
+ {
+  p=a->base+a->used;
+  a->used+=bytes;
+  return((void *)p);
+ }
+ p=(unsigned char *)malloc(bytes+64);		// Overflow block, first 64 bytes link the list
+ if (p==NULL)
+ {
+  fprintf(stderr,"arenaAlloc(): Out of memory!\n");
+  return(NULL);
+ }
+ *((void **)p)=a->over;
+ a->over=(void *)p;
+ return((void *)(p+64));
+}
+
+void arenaReset(struct frameArena *a)
+{
+ // Recycles everything handed out since the last reset. Call at the start of a frame.
+ // If the last frame did not fit, the arena grows to what it asked for (plus a margin).
+ void *p,*q;
+
+ for (p=a->over;p!=NULL;p=q)
+ {
+  q=*((void **)p);
+  free(p);
+ }
+ a->over=NULL;
+ if (a->need>a->size)
+ {
+  free(a->base);
+  a->size=a->need+(a->need/4);
+  a->base=(unsigned char *)malloc(a->size);
+  if (a->base==NULL) a->size=0;
+ }
+ a->used=0;
+ a->need=0;
+}
+
+struct blob *newBlob(void)
+{
+ // A cleared blob node from the slab. Nodes are allocated BLOB_SLAB at a time and never
+ // freed, releaseBlobs() returns them to the free list. Returns NULL if out of memory.
+ struct blob *bl;
+ int i;
+
+ if (blobFree==NULL)
+ {
+  bl=(struct blob *)calloc(BLOB_SLAB,sizeof(struct blob));
+  if (bl==NULL)
+  {
+   fprintf(stderr,"newBlob(): Out of memory!\n");
+   return(NULL);
+  }
+  for (i=0;i<BLOB_SLAB-1;i++) (bl+i)->next=bl+i+1;
+  blobFree=bl;
+ }
+ bl=blobFree;
+ blobFree=bl->next;
+ memset(bl,0,sizeof(struct blob));
+ return(bl);
+}
+
 void releaseBlobs(struct blob *blobList)
 {
- // Deletes a linked list of blobs
+ // Returns a linked list of blobs to the slab (see newBlob())
  struct blob *p,*q;
  p=blobList;
  while(p)
  {
   q=p->next;
-  free(p);
+  p->next=blobFree;
+  blobFree=p;
   p=q;
  }
 }
 
+struct image *labelImage(int sx, int sy)
+{
+ // The label image for this frame, shared by the blob detectors. It is allocated once and
+ // handed out again every frame, so callers must not delete it. Only the pixels labeled
+ // since the last call (recorded in labSpan) are cleared. Returns NULL if out of memory.
+ int j;
+
+ if (labPool!=NULL&&(labPool->sx!=sx||labPool->sy!=sy))
+ {
+  deleteImage(labPool);
+  free(labSpan);
+  labPool=NULL;
+ }
+ if (labPool==NULL)
+ {
+  labPool=newImage(sx,sy,1);
+  labSpan=(int *)malloc(2*sy*sizeof(int));
+  if (labPool==NULL||labSpan==NULL)
+  {
+   fprintf(stderr,"labelImage(): Out of memory!\n");
+   if (labPool!=NULL) deleteImage(labPool);
+   free(labSpan);
+   labPool=NULL;
+   labSpan=NULL;
+   return(NULL);
+  }
+  for (j=0;j<sy;j++) {*(labSpan+(2*j))=sx; *(labSpan+(2*j)+1)=-1;}
+ }
+ for (j=0;j<sy;j++)
+  if (*(labSpan+(2*j)+1)>=0)
+  {
+   memset(labPool->layers[0]+(j*sx)+*(labSpan+(2*j)),0,(*(labSpan+(2*j)+1)-*(labSpan+(2*j))+1)*sizeof(double));
+   *(labSpan+(2*j))=sx;
+   *(labSpan+(2*j)+1)=-1;
+  }
+ return(labPool);
+}
+
+static inline void labelSpan(int y, int x1, int x2)
+{
+ // Record that pixels [x1,x2] of row y of the label image are labeled
+ if (*(labSpan+(2*y))>x1) *(labSpan+(2*y))=x1;
+ if (*(labSpan+(2*y)+1)<x2) *(labSpan+(2*y)+1)=x2;
+}
+
 void rgb2hsv(double R, double G, double B, double *H, double *S, double *V)
 {
   // Return the HSV components of the input RGB colour, R,G, and B in [0,1]
@@ -1009,7 +2021,479 @@ void rgb2hsv(double R, double G, double B, double *H, double *S, double *V)
   else *S=C/(*V);
 }
 
-struct image *blobDetect2(unsigned char *fgIm, int sx, int sy, struct blob **blob_list, int *nblobs)
+void buildHueLUT(void)
+{
+ //////////////////////////////////////////////////////////////////////////////
+ //
+ // Fills in the quantized chroma table used by the background subtraction
+ // and blob detection code. Each entry holds the unit vector of the chroma
+ // at the centre of its bin in fixed point, which does not depend on any
+ // thresholds, so it is computed only the first time. The saturation terms
+ // and the colour angle threshold are refreshed from the current colThresh
+ // and colAngThresh.
+ //
+ // For chroma [u v] the RGB components are luma plus [1.402v, -.344u-.714v,
+ // 1.772u], so the spread C and the height D of the max. component above
+ // luma follow from the chroma alone (see satTest()).
+ //////////////////////////////////////////////////////////////////////////////
+ int u,v,idx;
+ const int n=1<<CHROMA_BITS;
+ double U,V,r,g,b,c,d,a;
+
+ if (hueTab.e==NULL)
+ {
+  hueTab.e=(struct hueEntry *)calloc(n*n,sizeof(struct hueEntry));
+  if (hueTab.e==NULL)
+  {
+   fprintf(stderr,"buildHueLUT(): Out of memory!\n");
+   return;
+  }
+  for (u=0;u<n;u++)
+   for (v=0;v<n;v++)
+   {
+    idx=(u<<CHROMA_BITS)|v;
+    U=((u+.5)*(256/n))-128;
+    V=((v+.5)*(256/n))-128;
+    a=atan2(V,U);
+    hueTab.e[idx].hx=(short)floor((HUE_ONE*cos(a))+.5);
+    hueTab.e[idx].hy=(short)floor((HUE_ONE*sin(a))+.5);
+   }
+  hueTab.colThresh=-1;
+ }
+
+ if (hueTab.colThresh!=colThresh)
+ {
+  for (u=0;u<n;u++)
+   for (v=0;v<n;v++)
+   {
+    U=((u+.5)*(256/n))-128;
+    V=((v+.5)*(256/n))-128;
+    r=1.402*V;
+    g=(-.344*U)-(.714*V);
+    b=1.772*U;
+    if (r>g&&r>b) d=r; else if (g>b) d=g; else d=b;
+    if (r<g&&r<b) c=d-r; else if (g<b) c=d-g; else c=d-b;
+    hueTab.e[(u<<CHROMA_BITS)|v].sat=(int)floor(256*(c-(colThresh*d)));
+   }
+  hueTab.satY=(int)ceil(256*colThresh);
+  hueTab.colThresh=colThresh;
+ }
+
+ hueTab.angT=(int)(colAngThresh*HUE_ONE*HUE_ONE);
+ hueTab.colAngThresh=colAngThresh;
+}
+
+struct hueLUT *getHueLUT(void)
+{
+ // Return the colour table, rebuilding whatever part of it is stale
+ if (hueTab.e==NULL||hueTab.colThresh!=colThresh||hueTab.colAngThresh!=colAngThresh)
+  buildHueLUT();
+ if (hueTab.e==NULL) return(NULL);
+ return(&hueTab);
+}
+
+static inline int ufFind(int *parent, int l)
+{
+ // Union-find root lookup with path halving
+ while (*(parent+l)!=l)
+ {
+  *(parent+l)=*(parent+(*(parent+l)));
+  l=*(parent+l);
+ }
+ return(l);
+}
+
+static inline void ufUnion(int *parent, int a, int b)
+{
+ // Merge the sets containing labels a and b. The smaller label becomes the
+ // root so that each component's root is its first pixel in raster order.
+ a=ufFind(parent,a);
+ b=ufFind(parent,b);
+ if (a<b) *(parent+b)=a;
+ else if (b<a) *(parent+a)=b;
+}
+
+// Foreground masks for blob labeling (see blobDetectROI())
+static unsigned long long fgRaw[MASK_WORDS(1024)*768];		// Foreground mask built from fgIm, if none was given
+static unsigned long long fgSmooth[MASK_WORDS(1024)*768];	// Foreground mask after closing/opening
+static unsigned long long fgWork[MASK_WORK(1024,768)];		// Scratch space for the closing/opening
+
+static inline int nextRun(unsigned long long *row, int x, int xe, int *a, int *b)
+{
+ // Finds the first run of set bits in row that starts at or after x, clipped
+ // to xe. Whole words are skipped at a time. Returns 0 if there is none.
+ unsigned long long w;
+ int k;
+
+ k=x>>6;
+ w=*(row+k)&(~0ULL<<(x&63));
+ while (w==0)
+ {
+  k++;
+  if ((k<<6)>xe) return(0);
+  w=*(row+k);
+ }
+ *a=(k<<6)+__builtin_ctzll(w);
+ if (*a>xe) return(0);
+ w=~w&(~0ULL<<(*a&63));				// Now look for the first unset bit
+ while (w==0&&((k+1)<<6)<=xe)
+ {
+  k++;
+  w=~(*(row+k));
+ }
+ *b=(w==0)?xe:(k<<6)+__builtin_ctzll(w)-1;
+ if (*b>xe) *b=xe;
+ return(1);
+}
+
+static inline int hueSumAgree(double ax, double ay, double bx, double by, double cosT)
+{
+ // Colour agreement of two sums of hue vectors, by the angle between them
+ double d;
+
+ d=(ax*bx)+(ay*by);
+ return(fabs(d)>cosT*sqrt((ax*ax)+(ay*ay))*sqrt((bx*bx)+(by*by)));
+}
+
+static inline void runMerge(int *parent, double *chue, struct blobRun *runs, int p, int q, double cosT)
+{
+ // Joins the components of touching runs p and q if their colours agree. Coloured runs are
+ // compared by their own mean hue. A run with no coloured pixels (filled in by the closing)
+ // has no colour test of its own, it stands in with the colour of the component it belongs
+ // to. Only a component with no colour at all agrees with anything, so a filled gap between
+ // two patches of different colours joins one of them, never both. chue holds the number of
+ // coloured pixels and the sum of their hue vectors for each component, at its root.
+ int a,b;
+ double *ca,*cb;
+
+ a=ufFind(parent,p);
+ b=ufFind(parent,q);
+ if (a==b) return;
+ ca=chue+(3*a);
+ cb=chue+(3*b);
+ if (*(ca+0)>0&&*(cb+0)>0)
+ {
+  if (runs[p].ncol>0&&runs[q].ncol>0)
+  {
+   if (!hueSumAgree(runs[p].hx,runs[p].hy,runs[q].hx,runs[q].hy,cosT)) return;
+  }
+  else if (runs[p].ncol>0)
+  {
+   if (!hueSumAgree(runs[p].hx,runs[p].hy,*(cb+1),*(cb+2),cosT)) return;
+  }
+  else if (runs[q].ncol>0)
+  {
+   if (!hueSumAgree(*(ca+1),*(ca+2),runs[q].hx,runs[q].hy,cosT)) return;
+  }
+  else if (!hueSumAgree(*(ca+1),*(ca+2),*(cb+1),*(cb+2),cosT)) return;
+ }
+ ufUnion(parent,a,b);
+ if (a<b) {*(ca+0)+=*(cb+0); *(ca+1)+=*(cb+1); *(ca+2)+=*(cb+2);}
+ else {*(cb+0)+=*(ca+0); *(cb+1)+=*(ca+1); *(cb+2)+=*(ca+2);}
+}
+
+static int rowRuns(unsigned char *fgIm, unsigned long long *raw, unsigned long long *sm, int sx, int x1, int x2, int j,\
+                   struct hueLUT *lut, struct blobRun **runs, int *n, int *cap)
+{
+ // Appends the runs of row j (between x1 and x2) to runs. Each run of the smoothed mask is
+ // split wherever the hue of consecutive coloured pixels disagrees (the same test labeling
+ // used to do between neighbouring pixels). Colours (YUV) are read from fgIm only at pixels
+ // set in raw; pixels filled in by the closing belong to the run of the coloured pixels next
+ // to them. Returns -1 if out of memory.
+ int a,b,i,l,nw,Y,U,V,q,hx,hy,lx,ly,have;
+ struct blobRun *r, *tmp;
+
+ nw=MASK_WORDS(sx);
+ i=x1;
+ while (nextRun(sm+(j*nw),i,x2,&a,&b))
+ {
+  have=0;
+  lx=ly=0;
+  for (i=a;i<=b;i++)
+  {
+   if (*n>=*cap)					// Room for one more run
+   {
+    tmp=(struct blobRun *)realloc(*runs,2*(*cap)*sizeof(struct blobRun));
+    if (tmp==NULL) return(-1);
+    *runs=tmp;
+    *cap*=2;
+   }
+   if (i==a)
+   {
+    r=*runs+*n;
+    memset(r,0,sizeof(struct blobRun));
+    r->x1=a;
+    r->y=j;
+    (*n)++;
+   }
+   r=*runs+*n-1;
+   if ((*(raw+(j*nw)+(i>>6))>>(i&63))&1)
+   {
+    l=i+(j*sx);
+    Y=*(fgIm+(l*3)+0);
+    U=*(fgIm+(l*3)+1);
+    V=*(fgIm+(l*3)+2);
+    q=chromaIndex(U,V);
+    hx=lut->e[q].hx;
+    hy=lut->e[q].hy;
+    if (have&&abs((hx*lx)+(hy*ly))<=lut->angT)
+    {
+     // Colour changes - close this run and start a new one here
+     r->x2=i-1;
+     r=*runs+*n;
+     memset(r,0,sizeof(struct blobRun));
+     r->x1=i;
+     r->y=j;
+     (*n)++;
+    }
+    r->ncol++;
+    r->hx+=hx;
+    r->hy+=hy;
+    r->Y+=Y;
+    r->U+=U;
+    r->V+=V;
+    lx=hx;
+    ly=hy;
+    have=1;
+   }
+   r->x2=i;
+  }
+  i=b+1;
+  if (i>x2) break;
+ }
+ return(0);
+}
+
+static void blobAxis(struct blob *bl, double cxx, double cyy, double cxy)
+{
+ // Blob direction (long axis) from the covariance of its pixel coordinates, and
+ // the Y offset correction
+ double T,D,L1,L2;
+
+ T=cxx+cyy;
+ D=(cxx*cyy)-(cxy*cxy);
+ L1=(.5*T)+sqrt(((T*T)/4)-D);
+ L2=(.5*T)-sqrt(((T*T)/4)-D);
+ if (fabs(L1)>fabs(L2))
+ {
+  bl->dx=L1-cyy;
+  bl->dy=cxy;
+ }
+ else
+ {
+  bl->dx=L2-cyy;
+  bl->dy=cxy;
+ } 
+ T=sqrt((bl->dx*bl->dx)+(bl->dy*bl->dy));
+ bl->dx/=T;
+ bl->dy/=T;
+
+ // Finally, if we have offset correction data, store it in the blob
+ if (got_Y==3)
+  memcpy(&bl->adj_Y[0][0],&adj_Y[0][0],4*sizeof(double));
+ else
+  memset(&bl->adj_Y[0][0],0,4*sizeof(double));
+}
+
+static int labelWindow(unsigned char *fgIm, unsigned long long *raw, unsigned long long *sm, int sx, int x1, int y1,\
+                       int x2, int y2, struct hueLUT *lut, struct image *labIm, struct blob **blob_list, int nkeep)
+{
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Labels and measures the blobs inside window [x1,x2]x[y1,y2] of the smoothed foreground mask
+ // sm (see blobDetect2() for the details). Colours are read from fgIm, only at the pixels set
+ // in the original mask raw. Blobs found are added to blob_list numbered from nkeep+1, and
+ // their pixels are labeled in labIm. Blobs can not extend past the window, so windows
+ // processed in the same frame must not overlap.
+ //
+ // Returns the updated number of blobs, or -1 if out of memory.
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ int wy,nstrips,err;
+ int i,j,s,k,p,q,r,nlab,nruns;
+ int stripN[16];
+ int *rowStart,*parent,*compact;
+ double cosT,n,sumx,sumxx,y,cx,cy,u,v;
+ struct blobRun *runs, *ru;
+ struct blob *bl;
+ struct blob **blobIdx;
+ double *acc,*chue;
+
+ wy=y2-y1+1;
+ nstrips=wy/48;
+ if (nstrips<1) nstrips=1;
+ if (nstrips>16) nstrips=16;
+ cosT=(double)lut->angT/((double)HUE_ONE*HUE_ONE);
+
+ // Extract the runs of each strip of rows in parallel, each strip into its own array. The
+ // strip arrays (stripBuf) and all other scratch memory are kept from frame to frame.
+ rowStart=(int *)arenaAlloc(&frameMem,(wy+1)*sizeof(int));
+ if (!rowStart) return(-1);
+ rowStart[0]=0;
+ err=0;
+#pragma omp parallel for schedule(dynamic,1) private(s,j)
+ for (s=0;s<nstrips;s++)
+ {
+  stripN[s]=0;
+  if (stripBuf[s]==NULL)
+  {
+   stripBufCap[s]=256;
+   stripBuf[s]=(struct blobRun *)malloc(stripBufCap[s]*sizeof(struct blobRun));
+   if (stripBuf[s]==NULL) {err=1; continue;}
+  }
+  for (j=y1+((s*wy)/nstrips);j<y1+(((s+1)*wy)/nstrips);j++)
+  {
+   rowStart[j-y1+1]=stripN[s];				// Runs in row j, for now counted within the strip
+   if (rowRuns(fgIm,raw,sm,sx,x1,x2,j,lut,&stripBuf[s],&stripN[s],&stripBufCap[s])) {err=1; break;}
+   rowStart[j-y1+1]=stripN[s]-rowStart[j-y1+1];
+  }
+ }
+ if (err)
+ {
+  fprintf(stderr,"blobDetect2(): Out of memory!\n");
+  return(-1);
+ }
+
+ // Gather the runs in raster order
+ nruns=0;
+ for (s=0;s<nstrips;s++) nruns+=stripN[s];
+ runs=(struct blobRun *)arenaAlloc(&frameMem,(nruns+1)*sizeof(struct blobRun));
+ parent=(int *)arenaAlloc(&frameMem,(nruns+1)*sizeof(int));
+ compact=(int *)arenaAlloc(&frameMem,(nruns+1)*sizeof(int));
+ chue=(double *)arenaAlloc(&frameMem,3*(nruns+1)*sizeof(double));
+ if (!runs||!parent||!compact||!chue) return(-1);
+ k=0;
+ for (s=0;s<nstrips;s++)
+ {
+  memcpy(runs+k,stripBuf[s],stripN[s]*sizeof(struct blobRun));
+  k+=stripN[s];
+ }
+ for (j=1;j<=wy;j++) rowStart[j]+=rowStart[j-1];
+
+ // Merge touching runs of consecutive rows whose colours agree (see runMerge()). Runs in a row
+ // are sorted by x, so the overlapping pairs are found by walking both rows together.
+ for (k=0;k<nruns;k++)
+ {
+  parent[k]=k;
+  *(chue+(3*k)+0)=runs[k].ncol;
+  *(chue+(3*k)+1)=runs[k].hx;
+  *(chue+(3*k)+2)=runs[k].hy;
+ }
+ for (j=1;j<wy;j++)
+ {
+  p=rowStart[j-1];
+  q=rowStart[j];
+  while (p<rowStart[j]&&q<rowStart[j+1])
+  {
+   if (runs[p].x1<=runs[q].x2&&runs[q].x1<=runs[p].x2)
+    runMerge(parent,chue,runs,p,q,cosT);
+   if (runs[p].x2<runs[q].x2) p++; else q++;
+  }
+ }
+
+ // Number the components in raster order, and accumulate their statistics from the runs:
+ // [0]n [1]sum x [2]sum y [3]sum xx [4]sum yy [5]sum xy [6]coloured pixels [7..9]Y U V
+ // [10..13]bounding box
+ nlab=0;
+ for (k=0;k<nruns;k++)
+ {
+  parent[k]=parent[parent[k]];
+  if (parent[k]==k) compact[k]=nlab++;
+ }
+ acc=(double *)arenaAlloc(&frameMem,14*(nlab+1)*sizeof(double));
+ blobIdx=(struct blob **)arenaAlloc(&frameMem,(nlab+1)*sizeof(struct blob *));
+ if (!acc||!blobIdx) return(-1);
+ memset(acc,0,14*(nlab+1)*sizeof(double));
+ memset(blobIdx,0,(nlab+1)*sizeof(struct blob *));
+ for (r=0;r<nlab;r++)
+ {
+  *(acc+(14*r)+10)=10000;
+  *(acc+(14*r)+11)=10000;
+  *(acc+(14*r)+12)=-10000;
+  *(acc+(14*r)+13)=-10000;
+ }
+ for (k=0;k<nruns;k++)
+ {
+  ru=&runs[k];
+  r=compact[parent[k]];
+  n=ru->x2-ru->x1+1;
+  y=ru->y;
+  sumx=.5*n*(ru->x1+ru->x2);
+  sumxx=((ru->x2*(ru->x2+1.0)*((2.0*ru->x2)+1))-((ru->x1-1.0)*ru->x1*((2.0*ru->x1)-1)))/6.0;
+  *(acc+(14*r)+0)+=n;
+  *(acc+(14*r)+1)+=sumx;
+  *(acc+(14*r)+2)+=n*y;
+  *(acc+(14*r)+3)+=sumxx;
+  *(acc+(14*r)+4)+=n*y*y;
+  *(acc+(14*r)+5)+=y*sumx;
+  *(acc+(14*r)+6)+=ru->ncol;
+  *(acc+(14*r)+7)+=ru->Y;
+  *(acc+(14*r)+8)+=ru->U;
+  *(acc+(14*r)+9)+=ru->V;
+  if (*(acc+(14*r)+10)>ru->x1) *(acc+(14*r)+10)=ru->x1;
+  if (*(acc+(14*r)+11)>y) *(acc+(14*r)+11)=y;
+  if (*(acc+(14*r)+12)<ru->x2) *(acc+(14*r)+12)=ru->x2;
+  if (*(acc+(14*r)+13)<y) *(acc+(14*r)+13)=y;
+ }
+
+ // Blobs whose size is greater than a small threshold go into the blob list
+ for (r=0;r<nlab;r++)
+ {
+  n=*(acc+(14*r)+0);
+  if (n<=250) continue;
+  bl=newBlob();
+  if (bl==NULL) return(-1);
+  nkeep++;
+  bl->label=nkeep;
+  bl->mx=0;
+  bl->my=0;
+  cx=(*(acc+(14*r)+1))/n;
+  cy=(*(acc+(14*r)+2))/n;
+  bl->cx=cx;
+  bl->cy=cy;
+  bl->size=(int)n;
+  bl->x1=(int)(*(acc+(14*r)+10));
+  bl->y1=(int)(*(acc+(14*r)+11));
+  bl->x2=(int)(*(acc+(14*r)+12));
+  bl->y2=(int)(*(acc+(14*r)+13));
+  if (*(acc+(14*r)+6)>0)
+  {
+   // Average colour, back in RGB and HSV for the AI
+   y=(*(acc+(14*r)+7))/(*(acc+(14*r)+6));
+   u=((*(acc+(14*r)+8))/(*(acc+(14*r)+6)))-128;
+   v=((*(acc+(14*r)+9))/(*(acc+(14*r)+6)))-128;
+   bl->R=y+(1.402*v);
+   bl->G=y-(.344*u)-(.714*v);
+   bl->B=y+(1.772*u);
+   bl->R=(bl->R>255)?255:((bl->R<0)?0:bl->R);
+   bl->G=(bl->G>255)?255:((bl->G<0)?0:bl->G);
+   bl->B=(bl->B>255)?255:((bl->B<0)?0:bl->B);
+   rgb2hsv(bl->R/255.0,bl->G/255.0,bl->B/255.0,&bl->H,&bl->S,&bl->V);
+  }
+  blobAxis(bl,((*(acc+(14*r)+3))/n)-(cx*cx),((*(acc+(14*r)+4))/n)-(cy*cy),((*(acc+(14*r)+5))/n)-(cx*cy));
+  bl->age=0;
+  bl->next=NULL;
+  bl->idtype=0;
+  if (*(blob_list)==NULL) *(blob_list)=bl;
+  else {bl->next=(*(blob_list))->next; (*(blob_list))->next=bl;}
+  blobIdx[r]=bl;
+ }
+
+ // Label image - only pixels that belong to a listed blob get a (non-zero) label
+ for (k=0;k<nruns;k++)
+ {
+  bl=blobIdx[compact[parent[k]]];
+  if (bl!=NULL)
+  {
+   for (i=runs[k].x1;i<=runs[k].x2;i++)
+    *(labIm->layers[0]+i+(runs[k].y*sx))=bl->label;
+   labelSpan(runs[k].y,runs[k].x1,runs[k].x2);
+  }
+ }
+
+ return(nkeep);
+}
+
+struct image *blobDetect2(unsigned char *fgIm, unsigned long long *mask, int sx, int sy, struct blob **blob_list, int *nblobs)
 {
  /////////////////////////////////////////////////////////////////////////////////////////////////
  //
@@ -1020,33 +2504,66 @@ struct image *blobDetect2(unsigned char *fgIm, int sx, int sy, struct blob **blo
  //   the blob data values are filled-in by the AI code later on)
  // - The number of blobs found
  // 
+ // Labeling is done with a two-pass union-find over 4-connected neighbours. Two neighbouring
+ // foreground pixels belong to the same blob if their hue vectors agree to within colAngThresh.
+ // The first pass labels horizontal strips of the image independently (in parallel), the
+ // strips are then merged along their boundaries, and a second pass resolves labels and
+ // accumulates the blob statistics. Each pixel's colour is looked up once in the quantized
+ // colour table (see buildHueLUT()), and colour agreement is an integer dot product.
+ //
+ // Blobs are found in the foreground mask (one bit per pixel, see fieldFromYUYVWin()), after
+ // a closing of radius MASK_CLOSE_R (fills small holes and gaps) and an opening of radius
+ // MASK_OPEN_R (removes specks). Colours are read from fgIm, only where the original mask is
+ // set. If mask is NULL it is built from the non-zero pixels of fgIm. Pixels filled in by the
+ // closing have no colour of their own, they join the blob of one neighbouring colour but
+ // never bridge two different colours (see runMerge(), and the labeling check in
+ // imageProc_bench.c).
+ //
  // NOTE 1: This function will ignore tiny blobs
  // NOTE 2: The list of blobs is created from scratch for each frame - blobs do not persist
+ // NOTE 3: The label image is reused on the next call (see labelImage()), do not delete it.
+ //         Scratch memory comes from frameMem, and the blobs from the blob slab.
  /////////////////////////////////////////////////////////////////////////////////////////////////
+ int win[4];
 
- static int pixStack[1024*768*2];
- int i,j,x,y;
- int mix,miy,mx,my;
- int lab;
- double R,G,B;
- double H,S,V,C;
- double Hx,Hy;
- double tH,tS,tV,tC;
- double tHx,tHy;
- double Hacc,Sacc,Vacc;
- double Ra,Ga,Ba;
- double xc,yc, oy1, oy2;
- int pixcnt;
- int *stack;
- int stackPtr;
- struct image *labIm, *tmpIm, *tmpIm2;
- struct blob *bl;
- double cov[2][2],T,D,L1,L2;
- char line[1024];
- struct kernel *kern;
+ win[0]=0;
+ win[1]=0;
+ win[2]=sx-1;
+ win[3]=sy-1;
+ return(blobDetectROI(fgIm,mask,sx,sy,&win,1,blob_list,nblobs));
+}
+
+struct image *blobDetectROI(unsigned char *fgIm, unsigned long long *mask, int sx, int sy, int (*win)[4], int nwin,\
+                            struct blob **blob_list, int *nblobs)
+{
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Same as blobDetect2(), but only looks for blobs inside the given windows [x1 y1 x2 y2] of
+ // fgIm. Windows must not overlap. Pixels outside the windows are not read, and are unlabeled
+ // in the returned label image.
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ int k,nkeep;
+ struct image *labIm;
+ struct hueLUT *lut;
+
+ if (sx*sy>1024*768)
+ {
+  fprintf(stderr,"blobDetect2(): Image too large\n");
+  return(NULL);
+ }
+ lut=getHueLUT();
+ if (lut==NULL) return(NULL);
+
+ // Clean up the foreground mask
+ if (mask==NULL)
+ {
+  maskFromBuffer(fgIm,sx,sy,3,&fgRaw[0]);
+  mask=&fgRaw[0];
+ }
+ memcpy(&fgSmooth[0],mask,MASK_WORDS(sx)*sy*sizeof(unsigned long long));
+ maskClose(&fgSmooth[0],sx,sy,MASK_CLOSE_R,&fgWork[0]);
+ maskOpen(&fgSmooth[0],sx,sy,MASK_OPEN_R,&fgWork[0]);
 
- kern=GaussKernel(2);
- 
  // Clear any previous list of blobs
  if (*(blob_list)!=NULL)
  {
@@ -1054,420 +2571,502 @@ struct image *blobDetect2(unsigned char *fgIm, int sx, int sy, struct blob **blo
   *(blob_list)=NULL;
  }
 
- // Assumed: Pixels in the input fgIm that have non-zero RGB values are foreground
- labIm=newImage(sx,sy,1);				// 1-layer labels image
- tmpIm=imageFromBuffer(fgIm,sx,sy,3);
+ // Foreground pixels are those set in the mask
+ labIm=labelImage(sx,sy);				// 1-layer labels image
+ if (labIm==NULL)
+ {
+  *(nblobs)=0;
+  return(NULL);
+ }
 
- // Filter background subtracted, saturation thresholded map to make smoother blobs
- tmpIm2=convolve_x(tmpIm,kern);
- deleteImage(tmpIm);
- tmpIm=convolve_y(tmpIm2,kern);
- deleteImage(tmpIm2);
+ nkeep=0;
+ for (k=0;k<nwin;k++)
+ {
+  nkeep=labelWindow(fgIm,mask,&fgSmooth[0],sx,win[k][0],win[k][1],win[k][2],win[k][3],lut,labIm,blob_list,nkeep);
+  if (nkeep<0)
+  {
+   releaseBlobs(*(blob_list));
+   *(blob_list)=NULL;
+   *(nblobs)=0;
+   return(labIm);
+  }
+ }
+ *(nblobs)=nkeep;
 
- stack=&pixStack[0];
- lab=1;		
- memset(stack,0,1024*768*2*sizeof(int));
+ return(labIm);
+} 
 
- // Visit each pixel and try to grow a blob from it if it has a non-zero value - this uses simple floodfill
- for (j=0;j<sy;j++)
-  for (i=0;i<sx;i++)
-  {
-   R=*(tmpIm->layers[0]+i+(j*sx));
-   G=*(tmpIm->layers[1]+i+(j*sx));
-   B=*(tmpIm->layers[2]+i+(j*sx));
-   Hacc=0;
-   Sacc=0;
-   Vacc=0;
-      
-   if (R+G+B>0)    // Found unlabeled pixel
-   {       
-    // Obtain HSV components and color vector
-    rgb2hsv(R/255.0,G/255.0,B/255.0,&H,&S,&V);
-    Hx=cos(H);
-    Hy=sin(H);
-    
-    stackPtr=1;
-    *(stack+(2*stackPtr))=i;
-    *(stack+(2*stackPtr)+1)=j;
-    *(tmpIm->layers[0]+i+(j*sx)) = -(*(tmpIm->layers[0]+i+(j*sx)));
-    *(tmpIm->layers[1]+i+(j*sx)) = -(*(tmpIm->layers[1]+i+(j*sx)));
-    *(tmpIm->layers[2]+i+(j*sx)) = -(*(tmpIm->layers[2]+i+(j*sx)));
-    Ra=0;
-    Ga=0;
-    Ba=0;
-    xc=0;
-    yc=0;
-    mix=10000;
-    miy=10000;
-    mx=-10000;
-    my=-10000;
-    pixcnt=0;
-    while (stackPtr>0)
-    {
-     if (stackPtr>=1024*768) fprintf(stderr," *** Busted the stack!\n");
-     x=*(stack+(2*stackPtr));
-     y=*(stack+(2*stackPtr)+1);
-     stackPtr--;
-     *(labIm->layers[0]+x+(y*labIm->sx))=lab;
-     Ra-=*(tmpIm->layers[0]+x+(y*tmpIm->sx));
-     Ga-=*(tmpIm->layers[1]+x+(y*tmpIm->sx));
-     Ba-=*(tmpIm->layers[2]+x+(y*tmpIm->sx));
-     xc+=x;
-     yc+=y;
-     pixcnt++;
-     *(tmpIm->layers[0]+x+(y*sx)) = 0;
-     *(tmpIm->layers[1]+x+(y*sx)) = 0;
-     *(tmpIm->layers[2]+x+(y*sx)) = 0;
-     if (mix>x) mix=x;
-     if (miy>y) miy=y;
-     if (mx<x) mx=x;
-     if (my<y) my=y;
-     // Check neighbours
-     if (y>0)
-     {
-      R=*(tmpIm->layers[0]+x+((y-1)*sx)); 
-      G=*(tmpIm->layers[1]+x+((y-1)*sx)); 
-      B=*(tmpIm->layers[2]+x+((y-1)*sx)); 
-      if (R+G+B>0)
-      {
-       rgb2hsv(R/255.0,G/255.0,B/255.0,&tH,&tS,&tV);
-       tHx=cos(tH);
-       tHy=sin(tH);
-       Hacc+=tH;
-       Sacc+=tS;
-       Vacc+=tV;
-
-       if (fabs((tHx*Hx)+(tHy*Hy))>colAngThresh)
-       {
-        stackPtr++;
-        *(stack+(2*stackPtr))=x;
-        *(stack+(2*stackPtr)+1)=y-1;
-        *(tmpIm->layers[0]+x+((y-1)*sx)) *= -1.0;
-        *(tmpIm->layers[1]+x+((y-1)*sx)) *= -1.0;
-        *(tmpIm->layers[2]+x+((y-1)*sx)) *= -1.0;
-       }
-
-      }   
-     }
-     if (x<sx-1)
-     {
-      R=*(tmpIm->layers[0]+x+1+(y*sx)); 
-      G=*(tmpIm->layers[1]+x+1+(y*sx)); 
-      B=*(tmpIm->layers[2]+x+1+(y*sx)); 
-      if (R+G+B>0)
-      {
-       rgb2hsv(R/255.0,G/255.0,B/255.0,&tH,&tS,&tV);
-       tHx=cos(tH);
-       tHy=sin(tH);
-       Hacc+=tH;
-       Sacc+=tS;
-       Vacc+=tV;
-
-       if (fabs((tHx*Hx)+(tHy*Hy))>colAngThresh)
-       {
-        stackPtr++;
-        *(stack+(2*stackPtr))=x+1;
-        *(stack+(2*stackPtr)+1)=y;
-        *(tmpIm->layers[0]+x+1+(y*sx)) *= -1.0;
-        *(tmpIm->layers[1]+x+1+(y*sx)) *= -1.0;
-        *(tmpIm->layers[2]+x+1+(y*sx)) *= -1.0;
-       }
-      }
-     }
-     if (y<sy-1)
-     {
-      R=*(tmpIm->layers[0]+x+((y+1)*sx)); 
-      G=*(tmpIm->layers[1]+x+((y+1)*sx)); 
-      B=*(tmpIm->layers[2]+x+((y+1)*sx)); 
-      if (R+G+B>0)
-      {
-       rgb2hsv(R/255.0,G/255.0,B/255.0,&tH,&tS,&tV);
-       tHx=cos(tH);
-       tHy=sin(tH);
-       Hacc+=tH;
-       Sacc+=tS;
-       Vacc+=tV;
-
-       if (fabs((tHx*Hx)+(tHy*Hy))>colAngThresh)
-       {
-        stackPtr++;
-        *(stack+(2*stackPtr))=x;
-        *(stack+(2*stackPtr)+1)=y+1;
-        *(tmpIm->layers[0]+x+((y+1)*sx)) *= -1.0;
-        *(tmpIm->layers[1]+x+((y+1)*sx)) *= -1.0;
-        *(tmpIm->layers[2]+x+((y+1)*sx)) *= -1.0;
-       }
-      }
-     }
-     if (x>0)
-     {
-      R=*(tmpIm->layers[0]+x-1+(y*sx)); 
-      G=*(tmpIm->layers[1]+x-1+(y*sx)); 
-      B=*(tmpIm->layers[2]+x-1+(y*sx)); 
-      if (R+G+B>0)
-      {
-       rgb2hsv(R/255.0,G/255.0,B/255.0,&tH,&tS,&tV);
-       tHx=cos(tH);
-       tHy=sin(tH);
-       Hacc+=tH;
-       Sacc+=tS;
-       Vacc+=tV;
-
-       if (fabs((tHx*Hx)+(tHy*Hy))>colAngThresh)
-       {
-        stackPtr++;
-        *(stack+(2*stackPtr))=x-1;
-        *(stack+(2*stackPtr)+1)=y;
-        *(tmpIm->layers[0]+x-1+(y*sx)) *= -1.0;
-        *(tmpIm->layers[1]+x-1+(y*sx)) *= -1.0;
-        *(tmpIm->layers[2]+x-1+(y*sx)) *= -1.0;
-       }
-      }
-     }
-    }	// End while
-    if (pixcnt>250)
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Region of interest tracking
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static void roiPredict(struct track *t, int *w)
+{
+ // Window [x1 y1 x2 y2] where the track's blob should be in the next frame: the bounding box
+ // of its last blob moved to the predicted position, plus a margin that grows with speed, and
+ // with the number of frames the track has been coasting
+ int px,py;
+ double dx,dy;
+
+ dx=t->x+t->vx-t->last.cx;
+ dy=t->y+t->vy-t->last.cy;
+ px=(ROI_PAD*(1+t->missed))+(int)fabs(t->vx);
+ py=(ROI_PAD*(1+t->missed))+(int)fabs(t->vy);
+ *(w+0)=(int)(t->last.x1+dx)-px;
+ *(w+1)=(int)(t->last.y1+dy)-py;
+ *(w+2)=(int)(t->last.x2+dx)+px;
+ *(w+3)=(int)(t->last.y2+dy)+py;
+ if (*(w+0)<0) *(w+0)=0;
+ if (*(w+1)<0) *(w+1)=0;
+ if (*(w+2)>1023) *(w+2)=1023;
+ if (*(w+3)>767) *(w+3)=767;
+}
+
+static int roiWindows(struct tracker *tr, int (*win)[4])
+{
+ // Predicted windows for all tracks. Windows that overlap or touch are merged, so
+ // no blob is split between two windows. Returns the number of windows.
+ int a,b,n,merged;
+
+ n=tr->ntracks;
+ for (a=0;a<n;a++) roiPredict(&tr->t[a],&win[a][0]);
+ do
+ {
+  merged=0;
+  for (a=0;a<n&&!merged;a++)
+   for (b=a+1;b<n&&!merged;b++)
+    if (win[a][2]+1>=win[b][0]&&win[b][2]+1>=win[a][0]&&win[a][3]+1>=win[b][1]&&win[b][3]+1>=win[a][1])
     {
-     // If the size of the blob is greater than a small threshold, inset it in the
-     // blob list and fill-out the blob data structure.
-     Ra/=pixcnt;
-     Ga/=pixcnt;
-     Ba/=pixcnt;
-     xc/=pixcnt;
-     yc/=pixcnt;
-     Hacc/=pixcnt;
-     Sacc/=pixcnt;
-     Vacc/=pixcnt;
-     bl=(struct blob *)calloc(1,sizeof(struct blob));
-     bl->label=lab;
-     memset(&(bl->cx),0,5*sizeof(double));
-     memset(&(bl->cy),0,5*sizeof(double));
-     memset(&(bl->vx),0,5*sizeof(double));
-     memset(&(bl->vy),0,5*sizeof(double));
-     bl->mx=0;
-     bl->my=0;
-     bl->cx=xc;
-     bl->cy=yc;
-     bl->size=pixcnt;
-     bl->x1=mix;
-     bl->y1=miy;
-     bl->x2=mx;
-     bl->y2=my;
-     bl->R=Ra;
-     bl->G=Ga;
-     bl->B=Ba;
-     bl->H=Hacc;
-     bl->S=Sacc;
-     bl->V=Vacc;
-     bl->age=0;
-     bl->next=NULL;
-     bl->idtype=0;
-     if (*(blob_list)==NULL) *(blob_list)=bl;
-     else {bl->next=(*(blob_list))->next; (*(blob_list))->next=bl;}
+     if (win[b][0]<win[a][0]) win[a][0]=win[b][0];
+     if (win[b][1]<win[a][1]) win[a][1]=win[b][1];
+     if (win[b][2]>win[a][2]) win[a][2]=win[b][2];
+     if (win[b][3]>win[a][3]) win[a][3]=win[b][3];
+     memcpy(&win[b][0],&win[n-1][0],4*sizeof(int));
+     n--;
+     merged=1;
     }
-    lab++;
-   }    // End if
-  }   // End for i
+ } while (merged);
+ return(n);
+}
+
+static int roiFound(struct tracker *tr, struct blob *list)
+{
+ // After an ROI frame, check that every track seen in the last frame has a blob in its
+ // predicted window - the one nearest the predicted position, not taken by another track.
+ // Tracks that are coasting don't need one. The tracks themselves are updated by
+ // trackBlobs(). Returns 0 if any track was lost.
+ struct blob *bl,*best;
+ struct blob *taken[TRK_MAX];
+ int k,q,w[4];
+ double d,bd,px,py;
+
+ for (k=0;k<tr->ntracks;k++)
+ {
+  taken[k]=NULL;
+  if (tr->t[k].missed>0) continue;
+  roiPredict(&tr->t[k],&w[0]);
+  px=tr->t[k].x+tr->t[k].vx;
+  py=tr->t[k].y+tr->t[k].vy;
+  best=NULL;
+  bd=1e10;
+  for (bl=list;bl!=NULL;bl=bl->next)
+  {
+   if (bl->cx<w[0]||bl->cx>w[2]||bl->cy<w[1]||bl->cy>w[3]) continue;
+   for (q=0;q<k;q++) if (taken[q]==bl) break;
+   if (q<k) continue;
+   d=((bl->cx-px)*(bl->cx-px))+((bl->cy-py)*(bl->cy-py));
+   if (d<bd) {bd=d; best=bl;}
+  }
+  if (best==NULL) return(0);
+  taken[k]=best;
+ }
+ return(1);
+}
+
+struct image *roiDetect(struct roiState *st, struct tracker *tr, double *H, struct vdIn *vd, struct blob **blob_list, int *nblobs)
+{
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // ROI mode replacement for the fieldFromYUYV() + blobDetect2() steps of the frame loop.
+ //
+ // The field is only rectified, background subtracted and labeled inside a window around
+ // the predicted position of each of the blob tracks in tr (see trackBlobs(), which must
+ // run on the blobs found here so the tracks follow them). A full scan of the field is done
+ // every ROI_FULL_EVERY frames (to pick up new blobs), whenever a tracked blob is not found
+ // in its window (in the same frame), and while there are no tracks or too many of them.
+ //
+ // Returns the label image, as blobDetect2() does.
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ int win[TRK_MAX][4];
+ int j,k,nwin;
+ struct image *labIm;
+ double t0;
+
+ nwin=0;
+ if (tr->ntracks>0&&tr->ntracks<=ROI_MAX&&st->sinceFull<ROI_FULL_EVERY) nwin=roiWindows(tr,win);
+
+ if (nwin>0)
+ {
+  // Clear whatever the previous frame left in fieldIm, then fill in the new windows
+  t0=stageClock();
+  if (st->nwin==0) memset(&fieldIm[0],0,1024*768*3*sizeof(unsigned char));
+  else
+   for (k=0;k<st->nwin;k++)
+    for (j=st->win[k][1];j<=st->win[k][3];j++)
+     memset(&fieldIm[((j*1024)+st->win[k][0])*3],0,(st->win[k][2]-st->win[k][0]+1)*3*sizeof(unsigned char));
+  fieldFromYUYVWin(H,vd,win,nwin);
+  stageRecord(STAGE_FIELD,t0);
+  t0=stageClock();
+  labIm=blobDetectROI(fieldIm,&fgMask[0],1024,768,win,nwin,blob_list,nblobs);
+  stageRecord(STAGE_BLOBS,t0);
+  if (roiFound(tr,*blob_list)) st->sinceFull++;
+  else nwin=0;				// Lost a target, scan the whole field for it in this frame
+ }
+
+ if (nwin==0)
+ {
+  t0=stageClock();
+  fieldFromYUYV(H,vd);
+  stageRecord(STAGE_FIELD,t0);
+  t0=stageClock();
+  labIm=blobDetect2(fieldIm,&fgMask[0],1024,768,blob_list,nblobs);
+  stageRecord(STAGE_BLOBS,t0);
+  st->sinceFull=0;
+ }
+ st->nwin=nwin;
+ memcpy(&st->win[0][0],&win[0][0],nwin*4*sizeof(int));
+ return(labIm);
+}
+
+///////////////////////////////////////////////////////////////////////////////////////////////////
+//
+// Blob tracking
+//
+///////////////////////////////////////////////////////////////////////////////////////////////////
+static void trackUpdate(struct track *t, struct blob *bl)
+{
+ // Alpha-beta filter update of track t with the blob matched to it in this frame (t already
+ // holds the predicted position), and publish the filtered state in the blob
+ double rx,ry,sp;
+
+ rx=bl->cx-t->x;
+ ry=bl->cy-t->y;
+ t->x+=TRK_ALPHA*rx;
+ t->y+=TRK_ALPHA*ry;
+ t->vx+=TRK_BETA*rx;
+ t->vy+=TRK_BETA*ry;
+ sp=sqrt((t->vx*t->vx)+(t->vy*t->vy));
+ if (sp>TRK_MOVING)
+ {
+  t->mx=t->vx/sp;
+  t->my=t->vy/sp;
+ }
+ t->age++;
+ t->missed=0;
+
+ bl->blobId=t->id;
+ bl->age=t->age;
+ bl->cx=t->x;
+ bl->cy=t->y;
+ bl->vx=t->vx;
+ bl->vy=t->vy;
+ bl->mx=t->mx;
+ bl->my=t->my;
+ t->last=*(bl);
+ t->last.next=NULL;
+}
+
+void trackBlobs(struct tracker *tr, struct blob **blob_list)
+{
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Follows blobs from frame to frame. Every blob in blob_list gets the id of the track it
+ // belongs to (blobId, stable for as long as the track lives) and the number of frames the
+ // track has been followed (age). Each track runs a constant velocity alpha-beta filter, and
+ // matched blobs get the filtered position (cx,cy), velocity (vx,vy, in pixels per frame),
+ // and heading (mx,my - the last direction of significant motion).
+ //
+ // Blobs are matched to the predicted track positions within TRK_GATE pixels whose hue is
+ // within TRK_HUE_COS of the track's, closest pairs first. A track that gets no blob coasts
+ // on its prediction for up to TRK_COAST frames; meanwhile a copy of its last blob is added
+ // to blob_list at the predicted position, with age set to minus the number of frames missed
+ // (and label 0 - it has no pixels in the label image). Blobs left over start new tracks.
+ /////////////////////////////////////////////////////////////////////////////////////////////////
+ struct blob *bl, *cb;
+ struct blob *bb[TRK_MAX*4];
+ double d[TRK_MAX][TRK_MAX*4];
+ int tused[TRK_MAX],bused[TRK_MAX*4];
+ int i,k,nb,bi,bk;
+ double dx,dy,best;
+ struct track *t;
+
+ // Predict
+ for (k=0;k<tr->ntracks;k++)
+ {
+  tr->t[k].x+=tr->t[k].vx;
+  tr->t[k].y+=tr->t[k].vy;
+ }
 
- deleteImage(tmpIm);
+ // Distances from each prediction to each blob, -1 for pairs that can't match
+ nb=0;
+ for (bl=*(blob_list);bl!=NULL&&nb<TRK_MAX*4;bl=bl->next) bb[nb++]=bl;
+ for (k=0;k<tr->ntracks;k++)
+  for (i=0;i<nb;i++)
+  {
+   dx=bb[i]->cx-tr->t[k].x;
+   dy=bb[i]->cy-tr->t[k].y;
+   d[k][i]=sqrt((dx*dx)+(dy*dy));
+   if (d[k][i]>TRK_GATE||cos(bb[i]->H-tr->t[k].last.H)<TRK_HUE_COS) d[k][i]=-1;
+  }
 
- // Count number of blobs found
- bl=*blob_list;
- *(nblobs)=0;
- while (bl!=NULL)
+ // Greedy assignment, closest pair first
+ memset(&tused[0],0,TRK_MAX*sizeof(int));
+ memset(&bused[0],0,TRK_MAX*4*sizeof(int));
+ while (1)
  {
-  *nblobs=(*nblobs) + 1;  
-  bl=bl->next;
+  best=-1;
+  bk=bi=0;
+  for (k=0;k<tr->ntracks;k++)
+   if (!tused[k])
+    for (i=0;i<nb;i++)
+     if (!bused[i]&&d[k][i]>=0&&(best<0||d[k][i]<best))
+     {
+      best=d[k][i];
+      bk=k;
+      bi=i;
+     }
+  if (best<0) break;
+  tused[bk]=1;
+  bused[bi]=1;
+  trackUpdate(&tr->t[bk],bb[bi]);
  }
 
- // Compute blob direction for each blob
- bl=*blob_list;
- while (bl!=NULL)
+ // Tracks without a blob coast, or are dropped
+ for (k=tr->ntracks-1;k>=0;k--)
  {
-  memset(&cov[0][0],0,4*sizeof(double));
-  for (j=bl->y1;j<=bl->y2;j++)
-   for (i=bl->x1;i<=bl->x2;i++)
-    if (*(labIm->layers[0]+i+(j*labIm->sx))==bl->label)
-    {
-     xc=i-bl->cx;
-     yc=j-bl->cy;
-     cov[0][0]+=(xc*xc);
-     cov[1][1]+=(yc*yc);
-     cov[0][1]+=(yc*xc);
-     cov[1][0]+=(xc*yc);
-    }
-  cov[0][0]/=bl->size;
-  cov[0][1]/=bl->size;
-  cov[1][0]/=bl->size;
-  cov[1][1]/=bl->size;
-  T=cov[0][0]+cov[1][1];
-  D=(cov[0][0]*cov[1][1])-(cov[1][0]*cov[0][1]);
-  L1=(.5*T)+sqrt(((T*T)/4)-D);
-  L2=(.5*T)-sqrt(((T*T)/4)-D);
-  if (fabs(L1)>fabs(L2))
+  if (tused[k]) continue;
+  t=&tr->t[k];
+  t->missed++;
+  if (t->missed>TRK_COAST)
   {
-   bl->dx=L1-cov[1][1];
-   bl->dy=cov[1][0];
+   *(t)=tr->t[tr->ntracks-1];
+   tr->ntracks--;
+   continue;
   }
-  else
-  {
-   bl->dx=L2-cov[1][1];
-   bl->dy=cov[1][0];
-  } 
-  T=sqrt((bl->dx*bl->dx)+(bl->dy*bl->dy));
-  bl->dx/=T;
-  bl->dy/=T;
+  cb=newBlob();
+  if (cb==NULL) continue;
+  *(cb)=t->last;
+  cb->label=0;
+  cb->x1+=(int)(t->x-t->last.cx);
+  cb->x2+=(int)(t->x-t->last.cx);
+  cb->y1+=(int)(t->y-t->last.cy);
+  cb->y2+=(int)(t->y-t->last.cy);
+  cb->cx=t->x;
+  cb->cy=t->y;
+  cb->age=-t->missed;
+  cb->idtype=0;
+  if (*(blob_list)==NULL) *(blob_list)=cb;
+  else {cb->next=(*(blob_list))->next; (*(blob_list))->next=cb;}
+ }
 
-  // Finally, if we have offset correction data, store it in the blob
-  if (got_Y==3)
-   memcpy(&bl->adj_Y[0][0],&adj_Y[0][0],4*sizeof(double));
-  else
-   memset(&bl->adj_Y[0][0],0,4*sizeof(double));
+ // New tracks for the blobs left over
+ for (i=0;i<nb&&tr->ntracks<TRK_MAX;i++)
+ {
+  if (bused[i]) continue;
+  t=&tr->t[tr->ntracks++];
+  memset(t,0,sizeof(struct track));
+  t->id=++tr->nextId;
+  t->x=bb[i]->cx;
+  t->y=bb[i]->cy;
+  trackUpdate(t,bb[i]);
+ }
+}
 
-  bl=bl->next;
+static inline void fieldPixelRGB(unsigned char *yuv, unsigned char *rgb)
+{
+ // RGB colour of a field image pixel, background (all zero) stays black
+ if (*(yuv+0)==0&&*(yuv+1)==0&&*(yuv+2)==0)
+ {
+  *(rgb+0)=0;
+  *(rgb+1)=0;
+  *(rgb+2)=0;
  }
- 
- deleteKernel(kern);
- 
- return(labIm);
-} 
+ else yuvToRGB(*(yuv+0),*(yuv+1),*(yuv+2),rgb);
+}
 
-struct image *renderBlobs(unsigned char *fgIm, int sx, int sy, struct image *labels, struct blob *list)
+int renderBlobs(unsigned char *fgIm, int sx, int sy, struct image *labels, struct blob *list, unsigned char *dst)
 {
  //////////////////////////////////////////////////////////////////////////////////////////////
  //
- // This function renders an image with the blobs and geometric information provided by the
- // AI code (provided the AI is toggled-on and has estimated the corresponding values for
- // the blobs).
+ // This function renders the field image fgIm (sx x sy, YUV foreground, see fieldToRGB())
+ // into dst as RGB, with each blob painted as a uniform-colored region (the average colour
+ // of the blob's pixels).
  //
- // - It renders each blob as a uniform-colored region
- // - It draws bounding boxes
- // - It draws crosshairs at the centers of blobs (or perspective-corrected crosshairs
- //   indicating the estimated location of the bots)
- // - It draws heading and orientation vectors
+ // Bounding boxes, crosshairs, and heading and orientation vectors are not drawn here,
+ // DisplayFrame() draws them with OpenGL from the list made by overlayBlobs().
  //
- // NOTE: This function is also in charge of updating the calibration data for perspective
- //       projection error correction while the user is calibrating for Y offset error.
+ // Returns 0 on success, -1 if out of memory.
  //////////////////////////////////////////////////////////////////////////////////////////////
 
  int i,j;
  struct blob *p;
- struct image *blobIm;
- double cR,cG,cB;
- double *labRGB;
+ unsigned char *labRGB;
  int maxLab,lab;
- FILE *f;
-
- if (list==NULL) return(NULL);
 
  // Find maximum label for this round
- maxLab=-1;
+ maxLab=0;
  p=list;
  while (p!=NULL) {if (p->label>maxLab) maxLab=p->label; p=p->next;}
 
- labRGB=(double *)calloc(3*(maxLab+1),sizeof(double));
- if (labRGB==NULL) return(NULL);
+ labRGB=(unsigned char *)arenaAlloc(&frameMem,3*(maxLab+1)*sizeof(unsigned char));
+ if (labRGB==NULL) return(-1);
+ memset(labRGB,0,3*(maxLab+1)*sizeof(unsigned char));
  p=list;
  while (p!=NULL)
  {
-  if (*(labRGB+((p->label)*3)+0)==0)
+  if (p->label>0)
   {
-   *(labRGB+((p->label)*3)+0)=p->R;
-   *(labRGB+((p->label)*3)+1)=p->G;
-   *(labRGB+((p->label)*3)+2)=p->B;
+   *(labRGB+((p->label)*3)+0)=(unsigned char)p->R;
+   *(labRGB+((p->label)*3)+1)=(unsigned char)p->G;
+   *(labRGB+((p->label)*3)+2)=(unsigned char)p->B;
   }
   p=p->next;
  }
 
- blobIm=imageFromBuffer(fgIm,sx,sy,3);
  // Uniform coloured blobs - colour is average colour of the corresponding region in the image  
-#pragma omp parallel for schedule(dynamic,32) private(i,j)
+#pragma omp parallel for schedule(dynamic,32) private(i,j,lab)
  for (j=0;j<sy;j++)
   for (i=0;i<sx;i++)
   {
-   if (*(labels->layers[0]+i+(j*labels->sx))!=0)
+   lab=(int)*(labels->layers[0]+i+(j*labels->sx));
+   if (lab>0&&lab<=maxLab)
    {
-    lab=*(labels->layers[0]+i+(j*labels->sx));
-    *(blobIm->layers[0]+i+(j*blobIm->sx))=*(labRGB+(3*lab)+0);
-    *(blobIm->layers[1]+i+(j*blobIm->sx))=*(labRGB+(3*lab)+1);
-    *(blobIm->layers[2]+i+(j*blobIm->sx))=*(labRGB+(3*lab)+2);
+    *(dst+((i+(j*sx))*3)+0)=*(labRGB+(3*lab)+0);
+    *(dst+((i+(j*sx))*3)+1)=*(labRGB+(3*lab)+1);
+    *(dst+((i+(j*sx))*3)+2)=*(labRGB+(3*lab)+2);
    }
+   else fieldPixelRGB(fgIm+((i+(j*sx))*3),dst+((i+(j*sx))*3));
   }
 
- // Draw bounding boxes & cross-hairs 
- p=list;
- while (p!=NULL)
+ return(0);
+}
+
+void fieldToRGB(unsigned char *fgIm, int sx, int sy, unsigned char *dst)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Converts the field image fgIm (sx x sy) as left by fieldFromYUYV() - foreground pixels in
+ // YUV, background pixels zero - to RGB in dst, with the background black. This is the only
+ // colour conversion left once the field is processed in YUV, and it is only needed for
+ // display.
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ int i;
+
+#pragma omp parallel for schedule(dynamic,4096) private(i)
+ for (i=0;i<sx*sy;i++) fieldPixelRGB(fgIm+(i*3),dst+(i*3));
+}
+
+int overlayBlobs(struct blob *list, struct overlay *ov)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Copies what DisplayFrame() needs to draw the bounding box, crosshair, and vectors of each
+ // blob identified by the AI (idtype>0) into ov (up to OVL_MAX entries). The blob list is
+ // released by the next frame, the display may still be drawing this one.
+ //
+ // Returns the number of overlays.
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ struct blob *p;
+ int n;
+
+ n=0;
+ for (p=list;p!=NULL&&n<OVL_MAX;p=p->next)
+ {
+  if (p->idtype<=0) continue;
+  (ov+n)->idtype=p->idtype;
+  (ov+n)->x1=p->x1;
+  (ov+n)->y1=p->y1;
+  (ov+n)->x2=p->x2;
+  (ov+n)->y2=p->y2;
+  (ov+n)->cx=p->cx;
+  (ov+n)->cy=p->cy;
+  (ov+n)->dx=p->dx;
+  (ov+n)->dy=p->dy;
+  (ov+n)->mx=p->mx;
+  (ov+n)->my=p->my;
+  n++;
+ }
+ return(n);
+}
+
+void drawOverlays(struct overlay *ov, int n)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Draws the blob overlays with OpenGL, in field image coordinates (the caller sets up the
+ // transform onto the displayed field image).
+ //
+ // - Bounding boxes: blue for the ball, green for our bot, red for the opponent
+ // - Crosshairs at the blob centers (the perspective-corrected location for the bots)
+ // - Heading vector (yellow), and orientation vector from the blob shape (white)
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ int i;
+
+ glDisable(GL_TEXTURE_2D);
+ glLineWidth(3.0);
+ glBegin(GL_LINES);
+ for (i=0;i<n;i++,ov++)
+ {
+  if (ov->idtype==3) glColor3ub(32,32,255);		// This blob is the ball
+  else if (ov->idtype==1) glColor3ub(32,255,32);	// This blob is our own bot
+  else glColor3ub(255,32,32);				// This blob is the opponent
+  glVertex2f(ov->x1,ov->y1); glVertex2f(ov->x2,ov->y1);
+  glVertex2f(ov->x2,ov->y1); glVertex2f(ov->x2,ov->y2);
+  glVertex2f(ov->x2,ov->y2); glVertex2f(ov->x1,ov->y2);
+  glVertex2f(ov->x1,ov->y2); glVertex2f(ov->x1,ov->y1);
+
+  glColor3ub(255,255,255);
+  glVertex2f(ov->cx-15,ov->cy); glVertex2f(ov->cx+15,ov->cy);
+  glVertex2f(ov->cx,ov->cy-15); glVertex2f(ov->cx,ov->cy+15);
+  glVertex2f(ov->cx,ov->cy); glVertex2f(ov->cx+(55*ov->dx),ov->cy+(55*ov->dy));
+
+  glColor3ub(255,255,32);
+  glVertex2f(ov->cx,ov->cy); glVertex2f(ov->cx+(55*ov->mx),ov->cy+(55*ov->my));
+ }
+ glEnd();
+ glLineWidth(1.0);
+ glColor3f(1.0,1.0,1.0);
+}
+
+void offsetCalibration(struct blob *list)
+{
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ //
+ // Updates the calibration data for perspective projection error correction while the user
+ // is calibrating for Y offset error, from the bot blobs identified by the AI. Once both
+ // offsets are known they are stored in offsets.dat and the calibration loop ends.
+ //////////////////////////////////////////////////////////////////////////////////////////////
+ struct blob *p;
+ FILE *f;
+
+ if (got_Y!=1&&got_Y!=2) return;
+ for (p=list;p!=NULL;p=p->next)
  {
-  if (p->idtype>0)
+  if (p->idtype==1)		// Our own bot
   {
-   if (p->idtype==3)		// This blob is the ball
-   {
-    cR=255.0;
-    cG=255.0;
-    cB=32.0;
-    drawLine(p->cx-1,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy-1,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx+1,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy+1,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    cR=32.0;
-    cG=32.0;
-    cB=255.0;
-   }
-   else if (p->idtype==1)	// This blob is our own bot
-   {
-    cR=255.0;
-    cG=255.0;
-    cB=32.0;
-    drawLine(p->cx-1,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy-1,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx+1,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy+1,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    cR=32.0;
-    cG=255.0;
-    cB=32.0;
-    if (got_Y==1&&fabs(adj_Y[0][0])<.1)
-     adj_Y[0][0]=p->cy;
-    if (got_Y==2&&fabs(adj_Y[1][0])<.1)
-     adj_Y[1][0]=p->cy;
-   }
-   else if (p->idtype==2)	// This blob is the opponent
-   {
-    cR=255.0;
-    cG=255.0;
-    cB=32.0;
-    drawLine(p->cx-1,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy-1,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx+1,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy+1,p->mx,p->my,55,cR,cG,cB,blobIm);
-    drawLine(p->cx,p->cy,p->mx,p->my,55,cR,cG,cB,blobIm);
-    cR=255.0;
-    cG=32.0;
-    cB=32.0;
-    if (got_Y==1&&fabs(adj_Y[0][1])<.1)
-     adj_Y[0][1]=p->cy;
-    if (got_Y==2&&fabs(adj_Y[1][1])<.1)
-     adj_Y[1][1]=p->cy;
-   }
-   drawBox(p->x1-1,p->y1,p->x2-1,p->y2,cR,cG,cB,blobIm);
-   drawBox(p->x1+1,p->y1,p->x2+1,p->y2,cR,cG,cB,blobIm);
-   drawBox(p->x1,p->y1-1,p->x2,p->y2-1,cR,cG,cB,blobIm);
-   drawBox(p->x1,p->y1+1,p->x2,p->y2+1,cR,cG,cB,blobIm);
-   drawBox(p->x1,p->y1,p->x2,p->y2,cR,cG,cB,blobIm);
-
-   drawCross(p->cx-1,p->cy,64,64,64,15,blobIm);
-   drawCross(p->cx+1,p->cy,64,64,64,15,blobIm);
-   drawCross(p->cx,p->cy-1,128,128,128,15,blobIm);
-   drawCross(p->cx,p->cy+1,128,128,128,15,blobIm);
-   drawCross(p->cx,p->cy,255,255,255,15,blobIm);
-
-   drawLine(p->cx-1,p->cy,p->dx,p->dy,55,255,255,255,blobIm);
-   drawLine(p->cx,p->cy-1,p->dx,p->dy,55,255,255,255,blobIm);
-   drawLine(p->cx+1,p->cy,p->dx,p->dy,55,255,255,255,blobIm);
-   drawLine(p->cx,p->cy+1,p->dx,p->dy,55,255,255,255,blobIm);
-   drawLine(p->cx,p->cy,p->dx,p->dy,55,255,255,255,blobIm);
+   if (got_Y==1&&fabs(adj_Y[0][0])<.1)
+    adj_Y[0][0]=p->cy;
+   if (got_Y==2&&fabs(adj_Y[1][0])<.1)
+    adj_Y[1][0]=p->cy;
+  }
+  else if (p->idtype==2)	// The opponent
+  {
+   if (got_Y==1&&fabs(adj_Y[0][1])<.1)
+    adj_Y[0][1]=p->cy;
+   if (got_Y==2&&fabs(adj_Y[1][1])<.1)
+    adj_Y[1][1]=p->cy;
   }
-  p=p->next;
  }
 
  if (got_Y==2)
@@ -1477,11 +3076,9 @@ struct image *renderBlobs(unsigned char *fgIm, int sx, int sy, struct image *lab
   fwrite(&adj_Y[0][0],4*sizeof(double),1,f);
   fclose(f);
   got_Y=3;				// Complete! we have offset calibration data
+  saveCalibration();			// Keep them with the rest of the calibration
   doAI=0;				// End calibration loop
  }
-
- free(labRGB);
- return(blobIm);
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1630,7 +3227,7 @@ void initGlut(char* winName)
  // to call when the image needs to be refreshed, and when the
  // image window is being resized.
  glutReshapeFunc(WindowReshape);   // Call WindowReshape whenever window resized
- glutDisplayFunc(FrameGrabLoop);   // Main display function is also the main loop
+ glutDisplayFunc(DisplayFrame);    // Show the latest processed frame
  glutKeyboardFunc(kbHandler);
 }
 
@@ -1649,14 +3246,19 @@ void kbHandler(unsigned char key, int x, int y)
  // Exit!
  if (key=='q') 
  {
+  stopProcessing();
   BT_all_stop(0);
   releaseBlobs(blobs);
   deleteImage(proc_im);
-  glDeleteTextures(1,&texture);
+  if (!headless) glDeleteTextures(1,&texture);
   closeCam(webcam);
   exit(0);
  }
 
+ // Everything else changes state used by the processing thread, so
+ // it is applied between frames.
+ pthread_mutex_lock(&procLock);
+
  // Toggle AI processing on/off
  if (key=='t') if (doAI==1) doAI=0; else if (doAI==0) doAI=1;		// Ignores doAI=2 (calibration)
  if (key=='r') {setupAI(AIMode,botCol,&skynet); doAI=0;}		// Resets the state of the AI (may need full reset)
@@ -1721,6 +3323,10 @@ void kbHandler(unsigned char key, int x, int y)
  }
 
  // Image processing controls
+ if (key=='p') {showStats=1-showStats;}
+ if (key=='v') {roiMode=1-roiMode;roi.sinceFull=ROI_FULL_EVERY;fprintf(stderr,"ROI tracking mode %s\n",roiMode?"on":"off");}
+ if (key=='b') {if (saveCalibration()==0) fprintf(stderr,"Saved current background model to %s\n",CALIB_FILE);}
+ if (key=='B') {bgAdapt=1-bgAdapt;fprintf(stderr,"Background adaptation %s\n",bgAdapt?"on":"off");}
  if (key=='<') {bgThresh-=50;fprintf(stderr,"BG subtract threshold now at %f\n",bgThresh);}
  if (key=='>') {bgThresh+=50;fprintf(stderr,"BG subtract threshold now at %f\n",bgThresh);}
  if (key=='{'&&colAngThresh>.5) {colAngThresh-=.01;fprintf(stderr,"Colour Angle Threshold now at %f\n",colAngThresh);}
@@ -1735,6 +3341,8 @@ void kbHandler(unsigned char key, int x, int y)
  if (key=='l') {if (DIR_R==0) {DIR_R=1; DIR_L=0; DIR_FWD=0; DIR_BACK=0; BT_turn(LEFT_MOTOR, -50, RIGHT_MOTOR, 50);} else {DIR_R=0; BT_all_stop(0);}}
  if (key=='k') {if (DIR_BACK==0) {DIR_BACK=1; DIR_L=0; DIR_R=0; DIR_FWD=0; BT_drive(LEFT_MOTOR, RIGHT_MOTOR, -75);} else {DIR_BACK=0; BT_all_stop(0);}}
  if (key=='o') {BT_all_stop(0);doAI=0;}	// <-- Important!
+
+ pthread_mutex_unlock(&procLock);
 }
 
 void WindowReshape(int w, int h)
@@ -1759,7 +3367,7 @@ End of OpenGL display setup
 /*********************************************************************
 Camera initialization, frame grab, and frame conversion. 
 *********************************************************************/
-unsigned char *yuyv_to_rgb (struct vdIn *vd, int sx, int sy)
+unsigned char *yuyv_to_rgb (struct vdIn *vd, unsigned char *dst)
 {
   ///////////////////////////////////////////////////////////////////
   // The camera's video frame comes in a format called yuyv, this
@@ -1768,130 +3376,630 @@ unsigned char *yuyv_to_rgb (struct vdIn *vd, int sx, int sy)
   // To use the frame, we have to convert each set of 4 yuyv samples
   // into two RGB triplets. 
   //
-  // The input is a video frame data structure, and the size of the
-  // image (sx,sy).
-  //
-  // Returns a pointer to the newly allocated RGB image buffer, if
-  // something goes wrong it returns NULL.
+  // The input is a video frame data structure, and a buffer of
+  // vd->width*vd->height*3 bytes owned by the caller, where the RGB
+  // frame is written (so nothing is allocated per frame). The
+  // conversion itself is yuyvToRGB() in imageProc.c, which uses
+  // SSE2/AVX2 when available and gives the same results as the
+  // integer formula from compress_yuyv_to_jpeg() in uvccapture.c
   //
-  // Derived from compress_yuyv_to_jpeg() in uvccapture.c
+  // Returns dst, or NULL if something goes wrong.
   ///////////////////////////////////////////////////////////////////
-  unsigned char *frame_buffer, *yuyv;
-  int ii;
-  unsigned char *ptr;
-
-  frame_buffer = (unsigned char *)calloc (vd->height*vd->width * 3, sizeof(unsigned char));
-  if (!frame_buffer)
+  if (yuyvToRGB(vd->framebuffer,vd->width,vd->height,dst,IM_INTERLEAVED)<0)
   {
-   fprintf(stderr,"yuyv_to_rgb(): Can not allocate memory for frame buffer.\n");
+   fprintf(stderr,"yuyv_to_rgb(): Unable to convert frame.\n");
    return(NULL);
   }
-
-#pragma omp parallel for schedule(dynamic,32) private(ii,ptr,yuyv)
-  for (ii=0;ii<vd->height;ii++)
-  {
-   int x;
-   ptr=frame_buffer+((ii*vd->width)*3);
-   yuyv=vd->framebuffer+((ii*vd->width)*2);
-   for (x = 0; x < vd->width; x+=2) 
-   {
-    int r, g, b;
-    int y, u, v;
-    y = yuyv[0] << 8;
-    u = yuyv[1] - 128;
-    v = yuyv[3] - 128;
-
-    r = (y + (359 * v)) >> 8;
-    g = (y - (88 * u) - (183 * v)) >> 8;
-    b = (y + (454 * u)) >> 8;
-
-    *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-    *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-    *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-
-    y = yuyv[2] << 8;
-    r = (y + (359 * v)) >> 8;
-    g = (y - (88 * u) - (183 * v)) >> 8;
-    b = (y + (454 * u)) >> 8;
-
-    *(ptr++) = (r > 255) ? 255 : ((r < 0) ? 0 : r);
-    *(ptr++) = (g > 255) ? 255 : ((g < 0) ? 0 : g);
-    *(ptr++) = (b > 255) ? 255 : ((b < 0) ? 0 : b);
-    yuyv += 4;
-   }   // End for x  
-  }  
-  return (frame_buffer);
+  return(dst);
 }
     
 struct vdIn *initCam(const char *videodevice, int width, int height)
 {
- /* 
+ /*
     Camera initialization - sets up the camera communication, image
     format, fps, and other camera parmeters. Derived from uvccapture.c
     Derived from the uvccapture code.
  */
-	int status;
-	unsigned char *p = NULL;
-	int hwaccel = 0;
-	const char *mode = NULL;
 	int format = V4L2_PIX_FMT_YUYV;
-	int i;					
-	int grabmethod = 1;
 	int fps = 30;
-	unsigned char frmrate = 0;
-	char *avifilename = NULL;
-	int queryformats = 0;
-	int querycontrols = 0;
-	int readconfigfile = 0;
-	char *separateur;
-	char *sizestring = NULL;
-	char *fpsstring  = NULL;
-	int enableRawStreamCapture = 0;
-	int enableRawFrameCapture = 0;
-	struct vdIn *videoIn;
-	FILE *file;
 
 	printf("roboSoccer 1.0.2015\n\n");
 
-	if (avifilename == NULL || *avifilename == 0) {
-		avifilename = "video.avi";
+	// MJPEG takes far less USB bandwidth than YUYV, so the camera can
+	// deliver its full frame rate at high resolutions
+	if (mjpegScale>0) {
+		format = V4L2_PIX_FMT_MJPEG;
+		fps = 60;
 	}
+	return(initCamMode(videodevice, width, height, format, fps, mjpegScale));
+}
+
+struct vdIn *initCamMode(const char *videodevice, int width, int height, int format, int fps, int scale)
+{
+ /*
+   Open the camera in the given mode (format is V4L2_PIX_FMT_YUYV or
+   V4L2_PIX_FMT_MJPEG, MJPEG frames are decoded at 1/scale size) and start
+   the capture thread. The driver may adjust the frame size, the size
+   actually used is in the returned vdIn. Returns NULL on failure.
+ */
+	int grabmethod = 1;
+	char *avifilename = "video.avi";
+	struct vdIn *videoIn;
+
 	videoIn = (struct vdIn *) calloc(1, sizeof(struct vdIn));
+	if (videoIn == NULL)
+		return(NULL);
+	if (format == V4L2_PIX_FMT_MJPEG)
+		videoIn->scale = scale;
 
 	if (init_videoIn
 			(videoIn, (char *) videodevice, width, height, fps, format,
-			 grabmethod, avifilename) < 0)
+			 grabmethod, avifilename) < 0) {
+		free(videoIn);
 		return(NULL);
+	}
+
+	// Camera I/O runs on its own thread from here on, grabFrame() just
+	// picks up the most recent frame. YUYV frames are processed in the
+	// driver's buffers, without copying them (see uvcBorrow()).
+	videoIn->zerocopy = (format == V4L2_PIX_FMT_YUYV);
+	if (uvcStartCapture(videoIn, capturePolicy) < 0)
+		fprintf(stderr,"initCam(): Unable to start capture thread, frames will be grabbed synchronously\n");
 	return(videoIn);		// Successfully opened a video device
 }
 
-unsigned char *getFrame(struct vdIn *videoIn, int sx, int sy)
+/*********************************************************************
+Capture mode autotuning - the camera mode is picked by running the
+frame pipeline in each candidate mode, the choice is cached per camera
+*********************************************************************/
+static void fourccName(__u32 f, char *name)
+{
+	name[0] = f&0xff;
+	name[1] = (f>>8)&0xff;
+	name[2] = (f>>16)&0xff;
+	name[3] = (f>>24)&0xff;
+	name[4] = 0;
+}
+
+static void tuneKey(int fd, int rx, int ry, int minWidth, char *key, int len)
+{
+ /*
+   Cache key for the camera open on fd and the requested frame geometry:
+   card@bus/rxXry/minWidth, with anything but printable non-blank
+   characters replaced by '_' so the key is one word.
+ */
+	struct v4l2_capability cap;
+	char *c;
+
+	memset(&cap, 0, sizeof(struct v4l2_capability));
+	if (ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0)
+		strcpy((char *) cap.card, "unknown");
+	snprintf(key, len, "%.32s@%.32s/%dx%d/%d", cap.card, cap.bus_info, rx, ry, minWidth);
+	for (c = key; *c; c++)
+		if (*c <= ' ' || *c > '~') *c = '_';
+}
+
+static int tuneCacheRead(const char *key, struct tuneResult *r)
+{
+ /*
+   Look up key in TUNE_CACHE. Each line is: key fourcc width height fps scale
+   Returns 0 and fills in r->mode and r->scale if found, -1 otherwise.
+ */
+	FILE *f;
+	char line[1024], k[256], fcc[8];
+	int w, h, fps, scale;
+
+	f = fopen(TUNE_CACHE, "r");
+	if (f == NULL)
+		return(-1);
+	while (fgets(line, 1024, f) != NULL) {
+		if (sscanf(line, "%255s %4s %d %d %d %d", k, fcc, &w, &h, &fps, &scale) != 6) continue;
+		if (strcmp(k, key)) continue;
+		r->mode.format = v4l2_fourcc(fcc[0], fcc[1], fcc[2], fcc[3]);
+		r->mode.width = w;
+		r->mode.height = h;
+		r->mode.fps = fps;
+		r->scale = scale;
+		fclose(f);
+		return(0);
+	}
+	fclose(f);
+	return(-1);
+}
+
+static void tuneCacheWrite(const char *key, struct tuneResult *r)
+{
+ /*
+   Store the mode for key in TUNE_CACHE, keeping the entries for other
+   cameras. The new file is written aside and renamed over the old one.
+ */
+	FILE *f, *o;
+	char line[1024], k[256], fcc[8];
+
+	o = fopen(TUNE_CACHE ".tmp", "w");
+	if (o == NULL) {
+		fprintf(stderr,"autotuneCam(): Unable to write %s\n",TUNE_CACHE);
+		return;
+	}
+	f = fopen(TUNE_CACHE, "r");
+	if (f != NULL) {
+		while (fgets(line, 1024, f) != NULL)
+			if (sscanf(line, "%255s", k) == 1 && strcmp(k, key))
+				fputs(line, o);
+		fclose(f);
+	}
+	fourccName(r->mode.format, fcc);
+	fprintf(o, "%s %s %d %d %d %d\n", key, fcc, r->mode.width, r->mode.height, r->mode.fps, r->scale);
+	fclose(o);
+	if (rename(TUNE_CACHE ".tmp", TUNE_CACHE) < 0)
+		fprintf(stderr,"autotuneCam(): Unable to write %s\n",TUNE_CACHE);
+}
+
+static int tuneOrder(const void *a, const void *b)
+{
+	// Probe order - fastest nominal frame rate first, then largest processed frames
+	const struct tuneResult *p = (const struct tuneResult *) a;
+	const struct tuneResult *q = (const struct tuneResult *) b;
+
+	if (p->mode.fps != q->mode.fps) return(q->mode.fps - p->mode.fps);
+	return((q->mode.width/q->scale) - (p->mode.width/p->scale));
+}
+
+static int tuneBetter(struct tuneResult *a, struct tuneResult *b)
+{
+	// Is mode a better than mode b? Throughput decides unless it is within 5%,
+	// then latency unless it is within 10%, then the larger frames win.
+	if (b->fps <= 0) return(1);
+	if (a->fps > b->fps*1.05) return(1);
+	if (a->fps*1.05 < b->fps) return(0);
+	if (a->latency < b->latency*.9) return(1);
+	if (a->latency*.9 > b->latency) return(0);
+	return((a->mode.width/a->scale) > (b->mode.width/b->scale));
+}
+
+static int tuneCmp(const void *a, const void *b)
+{
+	double d = *(const double *) a - *(const double *) b;
+
+	return((d > 0) - (d < 0));
+}
+
+static int tuneGrab(struct vdIn *vd, double deadline)
+{
+	// Wait for a new frame from the capture thread, but not past deadline
+	// (stageClock() ms), so a mode that delivers nothing can't hang the probe.
+	int s;
+
+	while (stageClock() < deadline) {
+		s = uvcGrabLatest(vd, 0);
+		if (s < 0) return(-1);
+		if (s > 0) return(0);
+		usleep(1000);
+	}
+	return(-1);
+}
+
+static int tuneMeasure(const char *videodevice, struct tuneResult *r)
+{
+ /*
+   Run the frame pipeline - fieldFromYUYV() and blobDetect2(), as in
+   FrameGrabLoop() - on the camera in mode r for TUNE_MS, and fill in
+   r->fps (frames processed per second) and r->latency (median time from
+   the frame's capture to the end of blob detection). The field is just
+   the whole frame scaled to 1024x768, with the first frame measured as
+   the background. The background, field, and blob state are cleared
+   again afterwards. Returns 0, or -1 if the mode did not deliver frames.
+ */
+	struct vdIn *vd;
+	struct image *t1;
+	struct blob *bl = NULL;
+	unsigned char *rgb;
+	double P[9], lat[1024];
+	double t, t0, now;
+	int i, n, nb = 0;
+
+	vd = initCamMode(videodevice, r->mode.width, r->mode.height, r->mode.format, r->mode.fps, r->scale);
+	if (vd == NULL)
+		return(-1);
+	memset(&P[0], 0, 9*sizeof(double));
+	P[0] = (vd->width-1)/1024.0;
+	P[4] = (vd->height-1)/768.0;
+	P[8] = 1.0;
+	rgb = (unsigned char *) calloc(vd->width*vd->height*3, sizeof(unsigned char));
+
+	// Let the camera settle, and take the background from the last warm-up frame
+	n = 0;
+	t0 = 0;
+	for (i = 0; rgb != NULL && vd->capturing && i < TUNE_WARMUP; i++) {
+		if (tuneGrab(vd, stageClock()+1000.0) < 0) break;
+		if (i < TUNE_WARMUP-1) releaseFrame(vd);
+	}
+	if (i == TUNE_WARMUP && yuyv_to_rgb(vd, rgb) != NULL) {
+		releaseFrame(vd);
+		t1 = imageFromBuffer(rgb, vd->width, vd->height, 3);
+		if (t1 != NULL) {
+			fieldUnwarp(&P[0], t1);
+			deleteImage(t1);
+			memcpy(&bgIm[0], &fieldIm[0], 1024*768*3*sizeof(unsigned char));
+			seedBgModel(NULL);
+			gotbg = 1;
+
+			t0 = stageClock();
+			while (stageClock() < t0+TUNE_MS) {
+				if (tuneGrab(vd, t0+TUNE_MS) < 0) break;
+				// Capture time as in frameTiming()
+				now = stageClock();
+				t = (vd->frameTime.tv_sec*1000.0)+(vd->frameTime.tv_usec/1000.0);
+				if (t > now || t < now-1000.0) t = now;
+				arenaReset(&frameMem);
+				fieldFromYUYV(&P[0], vd);
+				blobDetect2(fieldIm, &fgMask[0], 1024, 768, &bl, &nb);
+				releaseFrame(vd);
+				if (n < 1024) lat[n] = stageClock()-t;
+				n++;
+			}
+			t0 = stageClock()-t0;
+		}
+	} else
+		releaseFrame(vd);
+
+	releaseBlobs(bl);
+	free(rgb);
+	closeCam(vd);
+	memset(&bgIm[0], 0, 1024*768*3*sizeof(unsigned char));
+	memset(&fieldIm[0], 0, 1024*768*3*sizeof(unsigned char));
+	gotbg = 0;
+	if (n < 2)
+		return(-1);
+
+	r->fps = n*1000.0/t0;
+	if (n > 1024) n = 1024;
+	qsort(&lat[0], n, sizeof(double), tuneCmp);
+	r->latency = lat[n/2];
+	return(0);
+}
+
+struct vdIn *autotuneCam(const char *videodevice, int rx, int ry, int minWidth)
+{
+ /*
+   Open the camera in the best mode for the frame pipeline. The candidates
+   are the YUYV and MJPEG modes the camera offers (MJPEG decoded at full,
+   1/2, and 1/4 size) that have the aspect ratio of rx x ry, so they see
+   the same field of view, and give frames at least minWidth wide. Each is
+   run through the pipeline (see tuneMeasure()), fastest nominal frame rate
+   first, skipping modes that can't beat the best throughput measured so
+   far. The fastest mode wins, ties go to lower latency, then to larger
+   frames (see tuneBetter()).
+
+   The choice is cached in TUNE_CACHE per camera and requested geometry,
+   and reused without probing as long as the camera still offers it. A
+   different mode changes the field geometry, so the homography must be
+   recalibrated. Falls back to initCam() if no mode can be measured.
+ */
+	static struct tuneResult cand[TUNE_MAX_MODES*3];
+	struct uvcMode modes[TUNE_MAX_MODES];
+	struct tuneResult best, cached;
+	struct vdIn *videoIn;
+	char key[256], fcc[8];
+	int fd, n, nc, i, s, probes;
+
+	fd = open(videodevice, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr,"autotuneCam(): Unable to open %s\n",videodevice);
+		return(NULL);
+	}
+	n = enum_modes(fd, &modes[0], TUNE_MAX_MODES);
+	tuneKey(fd, rx, ry, minWidth, key, 256);
+	close(fd);
+
+	nc = 0;
+	for (i = 0; i < n; i++)
+		for (s = 1; s <= 4; s *= 2) {
+			if (modes[i].format == V4L2_PIX_FMT_YUYV && s > 1) break;
+			if (fabs(((double) modes[i].width*ry)/((double) modes[i].height*rx)-1.0) > TUNE_ASPECT) break;
+			if (modes[i].width/s < minWidth) break;
+			memset(&cand[nc], 0, sizeof(struct tuneResult));
+			cand[nc].mode = modes[i];
+			cand[nc].scale = s;
+			nc++;
+		}
+	if (nc == 0) {
+		fprintf(stderr,"autotuneCam(): No %dx%d mode at least %d wide, using the default mode\n",rx,ry,minWidth);
+		return(initCam(videodevice, rx, ry));
+	}
+
+	// Use the cached choice if the camera still offers it
+	if (tuneCacheRead(key, &cached) == 0)
+		for (i = 0; i < nc; i++)
+			if (cand[i].mode.format == cached.mode.format && cand[i].mode.width == cached.mode.width &&
+			    cand[i].mode.height == cached.mode.height && cand[i].scale == cached.scale) {
+				fourccName(cand[i].mode.format, fcc);
+				fprintf(stderr,"Using cached camera mode %s %dx%d @ %d fps, 1/%d size\n",
+					fcc,cand[i].mode.width,cand[i].mode.height,cand[i].mode.fps,cand[i].scale);
+				videoIn = initCamMode(videodevice, cand[i].mode.width, cand[i].mode.height,
+						      cand[i].mode.format, cand[i].mode.fps, cand[i].scale);
+				if (videoIn != NULL)
+					return(videoIn);
+				break;
+			}
+
+	fprintf(stderr,"Measuring %d camera modes...\n",nc);
+	qsort(&cand[0], nc, sizeof(struct tuneResult), tuneOrder);
+	memset(&best, 0, sizeof(struct tuneResult));
+	for (i = 0, probes = 0; i < nc && probes < TUNE_PROBES; i++) {
+		// Sorted by nominal frame rate, none of the rest can be faster
+		if (best.fps > 0 && cand[i].mode.fps < .95*best.fps) break;
+		probes++;
+		fourccName(cand[i].mode.format, fcc);
+		if (tuneMeasure(videodevice, &cand[i]) < 0) {
+			fprintf(stderr,"  %s %dx%d @ %d fps, 1/%d size: no frames\n",
+				fcc,cand[i].mode.width,cand[i].mode.height,cand[i].mode.fps,cand[i].scale);
+			continue;
+		}
+		fprintf(stderr,"  %s %dx%d @ %d fps, 1/%d size: %.1f fps, latency %.1f ms\n",
+			fcc,cand[i].mode.width,cand[i].mode.height,cand[i].mode.fps,cand[i].scale,cand[i].fps,cand[i].latency);
+		if (tuneBetter(&cand[i], &best)) best = cand[i];
+	}
+	if (best.fps <= 0) {
+		fprintf(stderr,"autotuneCam(): No mode could be measured, using the default mode\n");
+		return(initCam(videodevice, rx, ry));
+	}
+
+	fourccName(best.mode.format, fcc);
+	fprintf(stderr,"Picked camera mode %s %dx%d @ %d fps, 1/%d size\n",
+		fcc,best.mode.width,best.mode.height,best.mode.fps,best.scale);
+	tuneCacheWrite(key, &best);
+	return(initCamMode(videodevice, best.mode.width, best.mode.height, best.mode.format, best.mode.fps, best.scale));
+}
+
+void captureOptions(char *record, int replay, int paced, int mjpeg, int tune)
+{
+ // Set up recording and replay before imageCaptureStartup():
+ //  - record: AVI file to record the processed frames to, NULL for none
+ //  - replay: if set, the video device passed to imageCaptureStartup() is
+ //    an AVI file recorded earlier, and frames come from there
+ //  - paced: replay at the recorded frame timing (otherwise, as fast as
+ //    the frames can be processed)
+ //  - mjpeg: if 1, 2 or 4, capture MJPEG instead of YUYV and decode it at
+ //    1/mjpeg the requested size. The smaller frames change the
+ //    field geometry, so the homography must be recalibrated.
+ //  - tune: if > 0, pick the camera mode with autotuneCam(), for frames
+ //    at least tune pixels wide (overrides mjpeg)
+ recordFile=record;
+ replayMode=replay;
+ replayPaced=paced;
+ mjpegScale=(mjpeg==1||mjpeg==2||mjpeg==4)?mjpeg:0;
+ tuneWidth=(tune>0)?tune:0;
+}
+
+int startRecording(struct vdIn *videoIn, char *name)
+{
+ /*
+   Record every frame passed on by grabFrame() to the AVI file 'name', as
+   raw YUYV. The V4L2 sequence number and timestamp of each frame go to
+   a text sidecar file 'name'.ts, one frame per line: seq sec usec
+   Returns 0 on success, -1 on failure.
+ */
+	char *tsName;
+	char fcc[] = "YUY2";
+
+	recAvi = AVI_open_output_file(name);
+	if (recAvi == NULL) {
+		fprintf(stderr,"startRecording(): Unable to open %s\n",name);
+		return(-1);
+	}
+	AVI_set_video(recAvi, videoIn->width, videoIn->height, (videoIn->fps>0)?videoIn->fps:30, fcc);
+	tsName = (char *) malloc(strlen(name)+4);
+	sprintf(tsName,"%s.ts",name);
+	recStamps = fopen(tsName,"w");
+	if (recStamps == NULL)
+		fprintf(stderr,"startRecording(): Unable to open %s, no timestamps will be saved\n",tsName);
+	free(tsName);
+	fprintf(stderr,"Recording frames to %s\n",name);
+	return(0);
+}
+
+void stopRecording(void)
+{
+	if (recAvi != NULL) AVI_close(recAvi);
+	if (recStamps != NULL) fclose(recStamps);
+	recAvi = NULL;
+	recStamps = NULL;
+}
+
+static void recordFrame(struct vdIn *videoIn)
+{
+	if (AVI_write_frame(recAvi, (char *) videoIn->framebuffer, videoIn->width*videoIn->height*2, 1) < 0) {
+		fprintf(stderr,"Unable to write frame, recording stopped\n");
+		stopRecording();
+		return;
+	}
+	if (recStamps != NULL)
+		fprintf(recStamps,"%u %ld %ld\n",videoIn->frameSeq,(long)videoIn->frameTime.tv_sec,(long)videoIn->frameTime.tv_usec);
+}
+
+struct vdIn *initReplay(const char *name)
+{
+ /*
+   Open an AVI file made with startRecording() as the video source. The
+   returned vdIn can be used with grabFrame() and the rest of the
+   pipeline as if it were a camera.
+ */
+	struct vdIn *videoIn;
+	char *tsName;
+	int i;
+
+	playAvi = AVI_open_input_file(name, 1);
+	if (playAvi == NULL) {
+		fprintf(stderr,"initReplay(): Unable to open %s\n",name);
+		return(NULL);
+	}
+	if (strncmp(AVI_video_compressor(playAvi),"YUY2",4)) {
+		fprintf(stderr,"initReplay(): %s is not a raw YUYV recording\n",name);
+		AVI_close(playAvi);
+		playAvi = NULL;
+		return(NULL);
+	}
+	videoIn = (struct vdIn *) calloc(1, sizeof(struct vdIn));
+	videoIn->fd = -1;
+	videoIn->borrowed = -1;
+	videoIn->framefd = -1;
+	for (i = 0; i < NB_BUFFER; i++) videoIn->dmafd[i] = -1;
+	videoIn->width = AVI_video_width(playAvi);
+	videoIn->height = AVI_video_height(playAvi);
+	videoIn->fps = (int)(AVI_frame_rate(playAvi)+.5);
+	videoIn->formatIn = V4L2_PIX_FMT_YUYV;
+	videoIn->framesizeIn = videoIn->width*videoIn->height*2;
+	videoIn->framebuffer = (unsigned char *) calloc(videoIn->framesizeIn, 1);
+	if (videoIn->framebuffer == NULL) {
+		AVI_close(playAvi);
+		playAvi = NULL;
+		free(videoIn);
+		return(NULL);
+	}
+
+	tsName = (char *) malloc(strlen(name)+4);
+	sprintf(tsName,"%s.ts",name);
+	playFrame = 0;
+	playStart = stageClock();
+	playStamps = fopen(tsName,"r");
+	if (playStamps == NULL)
+		fprintf(stderr,"initReplay(): No timestamps in %s, assuming %d fps\n",tsName,videoIn->fps);
+	free(tsName);
+	fprintf(stderr,"Replaying %ld frames from %s %s\n",AVI_video_frames(playAvi),name,
+		replayPaced?"at the recorded frame rate":"as fast as possible");
+	return(videoIn);
+}
+
+static void replayFinished(void)
+{
+	double t;
+
+	if (playFrame < 0) return;
+	t = (stageClock()-playStart)/1000.0;
+	fprintf(stderr,"Replay finished: %ld frames in %.2f s (%.1f fps)\n",playFrame,t,(t>0)?playFrame/t:0.0);
+	playFrame = -1;
+	if (headless) {
+		// Nothing else to do. This runs on the processing thread, so just
+		// ask headlessLoop() to shut down as if 'q' was pressed.
+		quitRequested = 1;
+	}
+}
+
+static int replayFrame(struct vdIn *videoIn)
+{
+ /*
+   Read the next recorded frame into videoIn->framebuffer, along with its
+   timestamp, waiting until it is due if replay is paced.
+   Returns 0 on success, -1 at the end of the recording.
+ */
+	long bytes, sec, usec;
+	unsigned int seq;
+	int key;
+	double t;
+
+	if (playFrame < 0) return(-1);
+	if (playFrame >= AVI_video_frames(playAvi) || AVI_frame_size(playAvi, playFrame) > videoIn->framesizeIn) {
+		replayFinished();
+		return(-1);
+	}
+	bytes = AVI_read_frame(playAvi, (char *) videoIn->framebuffer, &key);
+	if (bytes <= 0) {
+		replayFinished();
+		return(-1);
+	}
+	if (playStamps != NULL && fscanf(playStamps,"%u %ld %ld",&seq,&sec,&usec) == 3) {
+		videoIn->frameSeq = seq;
+		videoIn->frameTime.tv_sec = sec;
+		videoIn->frameTime.tv_usec = usec;
+	} else {
+		videoIn->frameSeq = playFrame;
+		videoIn->frameTime.tv_sec = playFrame/videoIn->fps;
+		videoIn->frameTime.tv_usec = ((playFrame%videoIn->fps)*1000000)/videoIn->fps;
+	}
+
+	// Recording time of this frame, in ms since the first one
+	t = (videoIn->frameTime.tv_sec*1000.0)+(videoIn->frameTime.tv_usec/1000.0);
+	if (playFrame == 0) {
+		playStart = stageClock();
+		playFirst = t;
+	}
+	if (replayPaced && t-playFirst > stageClock()-playStart)
+		usleep((useconds_t)((t-playFirst-(stageClock()-playStart))*1000.0));
+	playFrame++;
+	return(0);
+}
+
+int grabFrame(struct vdIn *videoIn)
 {
  /*
-   Grab a single frame from the camera. Derived from uvccapture.c
+   Grab a single frame from the camera and leave it (in YUYV format) in
+   videoIn->framebuffer. Derived from uvccapture.c
+   With zero-copy capture framebuffer is the driver's buffer, which is
+   lent to us until releaseFrame() (or the next grabFrame()).
+   Returns 0 on success, -1 on failure.
  */
-	unsigned char *frame;
         double dtime;
 
-	// Grab a frame from the video device
-	if (uvcGrab(videoIn) < 0) {
+	// Get the latest frame from the capture thread. This only waits if
+	// no new frame has arrived since the last call.
+	if (playAvi != NULL) {
+		if (replayFrame(videoIn) < 0) return(-1);
+	}
+	else if (videoIn->zerocopy) {
+		if (uvcBorrow(videoIn,1) < 0) {
+			printf("Error grabbing\n");
+			return(-1);
+		}
+	}
+	else if (videoIn->capturing) {
+		if (uvcGrabLatest(videoIn,1) < 0) {
+			printf("Error grabbing\n");
+			return(-1);
+		}
+	}
+	else if (uvcGrab(videoIn) < 0) {
 		printf("Error grabbing\n");
-		return(NULL);
+		return(-1);
 	}
-        frame=yuyv_to_rgb(videoIn, sx, sy); 
         videoIn->getPict = 0;
+	if (recAvi != NULL) recordFrame(videoIn);
 
 	// Print FPS if needed.
         frameNo++;
         time(&time2);
         dtime=difftime(time2,time1);
-        if (printFPS) fprintf(stderr,"FPS= %f\n",(double)frameNo/dtime);
-         
-        return(frame);
+        if (printFPS) fprintf(stderr,"FPS= %f (camera frames dropped: %u)\n",(double)frameNo/dtime,videoIn->framesDropped);
+
+        return(0);
+}
+
+void releaseFrame(struct vdIn *videoIn)
+{
+ /*
+   Done with the frame from grabFrame(). With zero-copy capture this gives
+   the buffer back to the driver, so framebuffer must not be read after it.
+ */
+	if (playAvi == NULL) uvcReturn(videoIn);
+}
+
+unsigned char *getFrame(struct vdIn *videoIn, unsigned char *dst)
+{
+ /*
+   Grab a single frame from the camera and convert it to RGB into dst
+   (videoIn->width*videoIn->height*3 bytes). Returns dst, or NULL.
+ */
+	if (grabFrame(videoIn) < 0) return(NULL);
+        return(yuyv_to_rgb(videoIn, dst));
 }
 
 void closeCam(struct vdIn *videoIn)
 {
+	stopRecording();
+	if (playAvi != NULL) AVI_close(playAvi);
+	if (playStamps != NULL) fclose(playStamps);
+	playAvi = NULL;
+	playStamps = NULL;
 	close_v4l2(videoIn);
 	free(videoIn);
 }
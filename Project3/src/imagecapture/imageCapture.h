@@ -25,7 +25,8 @@
 // Image processing library from time-lapse fusion code
 #include"imageProc.h"
 
-// Open GL libs
+// Open GL libs (with prototypes for the buffer object calls used for texture uploads)
+#define GL_GLEXT_PROTOTYPES
 #include <GL/gl.h>
 #include <GL/glu.h>
 #include <GL/glut.h>
@@ -48,6 +49,8 @@
 #include <time.h>
 #include <sys/time.h>
 #include <signal.h>
+#include <termios.h>
+#include <poll.h>
 #include <X11/Xlib.h>
 #include "v4l2uvc.h"
 //#include "utils.h"
@@ -83,32 +86,278 @@ struct blob{
 	double adj_Y[2][2];	// Y offset adjustment from image capture calibration process
 };
 
+// Cached remap table for field rectification. Built once per H (see
+// buildUnwarpMap()), so the per-frame warp is just a gather plus a blend.
+// For each of the 1024x768 field pixels:
+//  src - index (y*sx + x) of the top-left source neighbour, -1 if outside the frame
+//  wx, wy - bi-linear weights of the right and bottom neighbours, in 1/256ths
+struct unwarpMap{
+	int *src;
+	unsigned char *wx, *wy;
+	double H[9];		// Homography the table was built from
+	int sx,sy;		// Size of the source frame
+};
+
+// Chroma lookup table for the colour tests, replaces per-pixel trig. The
+// field is processed in YUV, and the chroma vector (U,V) stands in for hue
+// and saturation: its angle is the colour (compared with colAngThresh), its
+// length against luma gives the saturation. Indexed by U and V quantized to
+// CHROMA_BITS each (see chromaIndex()). The saturation terms depend on
+// colThresh, and are refreshed by getHueLUT() when it changes.
+#define CHROMA_BITS 7
+#define HUE_ONE 16384		// Fixed point 1.0 for hue vector components
+
+struct hueEntry{
+	short hx,hy;		// Chroma unit vector [cos sin] * HUE_ONE
+	int sat;		// Saturation test term, see satTest()
+};
+
+struct hueLUT{
+	struct hueEntry *e;
+	int satY;		// colThresh * 256, multiplies luma in satTest()
+	double colThresh;	// Threshold the sat terms were built for
+	double colAngThresh;	// Threshold angT was built for
+	int angT;		// colAngThresh * HUE_ONE^2, compare against hue dot products
+};
+
+// Display hand-off between the processing thread and DisplayFrame(). The
+// index of the latest finished display buffer is or'ed with DISP_FRESH
+// until the display picks it up.
+#define DISP_FRESH 4
+
+// Bounding box, crosshair, and vectors for a blob identified by the AI, drawn
+// by DisplayFrame() over the displayed field image (see overlayBlobs()).
+#define OVL_MAX 16		// Max. overlays per frame
+
+struct overlay{
+	int idtype;		// As in struct blob
+	int x1,y1,x2,y2;	// Bounding box
+	float cx,cy;		// Center
+	float dx,dy;		// Orientation from blob shape
+	float mx,my;		// Heading
+};
+
+// Per-stage timing for the frame loop (see stageRecord()). Times go into
+// histograms of STAT_BIN_US wide bins, the last bin collects everything
+// slower. Every STAT_PERIOD seconds the p50/p95/p99 of each stage are
+// appended to STAT_FILE.
+#define STAGE_GRAB 0		// Waiting for/grabbing the camera frame
+#define STAGE_RGB 1		// yuyv_to_rgb() (only during calibration)
+#define STAGE_FIELD 2		// Field rectification + background subtraction
+#define STAGE_BLOBS 3		// Blob detection
+#define STAGE_TRACK 4		// Blob tracking
+#define STAGE_AI 5		// AI / calibration callback
+#define STAGE_RENDER 6		// renderBlobs()
+#define STAGE_COMPOSE 7		// Composing the display image
+#define STAGE_UPLOAD 8		// Texture upload and draw (display thread)
+#define STAGE_FRAME 9		// All of FrameGrabLoop()
+#define STAGE_LATENCY 10	// Camera frame to motor command acknowledged by the EV3
+#define NSTAGES 11
+#define STAT_BIN_US 20
+#define STAT_BINS 5000
+#define STAT_PERIOD 5
+#define STAT_FILE "stageTimes.csv"
+
+// End-to-end latency estimate, handed to the AI to predict agent states at the
+// time its commands take effect (see frameTiming() and commandLatency()).
+#define LAT_RATE .1		// Update rate of the running averages
+#define LAT_MAX 250.0		// Longest latency (ms) we extrapolate over
+
+struct stageStats{
+	unsigned int hist[NSTAGES][STAT_BINS+1];	// Current period's histograms
+	unsigned int n[NSTAGES];			// Current period's sample counts
+	unsigned int count[NSTAGES];			// Last period's sample counts
+	double p[NSTAGES][3];				// Last period's p50, p95, p99 in ms
+	double periodStart;				// stageClock() at the start of the period
+};
+
+// Clean-up of the foreground mask before blob labeling (see blobDetect2())
+#define MASK_CLOSE_R 2		// Closing radius, fills holes up to 4 pixels across
+#define MASK_OPEN_R 1		// Opening radius (after the closing), removes specks up to 2 pixels across
+
+// Run of foreground pixels in one row, with the sums blob statistics are built
+// from (see labelWindow()). Colour sums only include the pixels that have a
+// colour of their own, not those filled in by the mask closing.
+struct blobRun{
+	int x1,x2,y;		// Pixels [x1,x2] of row y
+	int ncol;		// Number of pixels with a colour of their own
+	int hx,hy;		// Sum of their hue vectors
+	int Y,U,V;		// Sums of their colours, in YUV
+};
+
+// Region of interest tracking (see roiDetect()). Only windows around the predicted
+// positions of the blob tracks (see trackBlobs()) are processed.
+#define ROI_MAX 8		// Max. number of tracks followed with windows
+#define ROI_PAD 24		// Margin around a predicted blob window, in pixels
+#define ROI_FULL_EVERY 15	// Full field scan every so many frames
+
+struct roiState{
+	int win[ROI_MAX][4];	// Windows processed in the last frame [x1 y1 x2 y2]
+	int nwin;		// 0 if the last frame was a full scan
+	int sinceFull;		// Frames since the last full scan, ROI_FULL_EVERY forces one
+};
+
+// Blob tracks (see trackBlobs()). Each track runs an alpha-beta filter on the
+// blob position, and gives the blobs matched to it a stable blobId.
+#define TRK_MAX 16		// Max. number of tracks
+#define TRK_ALPHA .5		// Position gain
+#define TRK_BETA .15		// Velocity gain
+#define TRK_GATE 80		// Max. distance from the predicted position to a matching blob, in pixels
+#define TRK_HUE_COS .8		// Min. cosine of the hue difference for a matching blob
+#define TRK_COAST 10		// Frames a track survives without a matching blob
+#define TRK_MOVING 1.0		// Speed (pixels per frame) above which the heading is updated
+
+struct track{
+	int id;			// blobId of the blobs matched to this track
+	double x,y;		// Filtered position
+	double vx,vy;		// Filtered velocity, in pixels per frame
+	double mx,my;		// Heading - last direction of significant motion, unit vector
+	int age;		// Frames the track has been followed
+	int missed;		// Consecutive frames without a matching blob
+	struct blob last;	// Last blob matched to the track
+};
+
+struct tracker{
+	struct track t[TRK_MAX];
+	int ntracks;
+	int nextId;		// Last blobId handed out
+};
+
+// Scratch memory for one frame (see arenaAlloc()). Everything handed out
+// during a frame is recycled at the start of the next one by arenaReset(),
+// and the arena grows between frames to what the last frame asked for, so
+// a steady-state frame does not allocate.
+struct frameArena{
+	unsigned char *base;
+	size_t size;		// Bytes in base
+	size_t used;		// Bytes of base handed out since the last reset
+	size_t need;		// Bytes asked for since the last reset, including overflow
+	void *over;		// Blocks malloc'd while base was full, freed by arenaReset()
+};
+
+#define BLOB_SLAB 64		// Blob nodes allocated at a time (see newBlob())
+
+// Running background model (see bgUpdate()). Per pixel mean in 8.8 fixed
+// point and variance of the squared colour distance, updated only on
+// background pixels. The model is kept in YUV, with the distance weighted
+// to approximate the RGB distance bgThresh is set in.
+#define BG_RATE_SHIFT 5		// Update rate is 1/2^BG_RATE_SHIFT per frame
+#define BG_VAR_ONE 16		// Fixed point 1.0 for the variance
+#define BG_VAR_K 4		// Pixels further than BG_VAR_K*variance from the mean are foreground
+
+// Calibration file (see saveCalibration() and loadCalibration()). Holds everything the
+// frame loop needs to start processing: H and the remap table built from it, the
+// background model, the colour thresholds, and the Y offsets. Arrays start at
+// CALIB_ALIGN aligned offsets given in the header, so the file can be mapped and
+// used as is. The checksum covers the whole file (with the checksum field zeroed),
+// and a file for a different camera frame size is rejected as stale.
+#define CALIB_FILE "Calibration.dat"
+#define CALIB_LEGACY "Homography.dat"	// Older format: H, then bgIm, then (optionally) bgVar
+#define CALIB_MAGIC "RSCALIB"
+#define CALIB_VERSION 1
+#define CALIB_ALIGN 4096
+#define CALIB_ARRAYS 7			// bgMean, bgYUV, bgVar, bgIm, remap src, wx, wy
+
+struct calibHeader{
+	char magic[8];			// CALIB_MAGIC
+	unsigned int version;		// CALIB_VERSION
+	unsigned int headerSize;	// sizeof(struct calibHeader)
+	unsigned long long fileSize;	// Total size of the file, in bytes
+	unsigned long long checksum;	// See calibChecksum()
+	int sx,sy;			// Camera frame size H and the remap table are for
+	int fx,fy;			// Field size (1024x768)
+	double H[9];			// Homography, field to camera frame
+	double bgThresh;		// Thresholds in use when the file was saved
+	double colThresh;
+	double colAngThresh;
+	double adj_Y[2][2];		// Y offsets (see offsetCalibration()), valid if gotY is set
+	int gotY;
+	int bgAdapt;			// Background adaptation on/off
+	unsigned long long off[CALIB_ARRAYS];	// File offset of each array
+	unsigned long long len[CALIB_ARRAYS];	// and its size in bytes
+};
+
+// Capture mode autotuning (see autotuneCam()). Each candidate mode is run
+// through the frame pipeline for TUNE_MS after TUNE_WARMUP frames, and the
+// winner is cached per camera in TUNE_CACHE.
+#define TUNE_WARMUP 10		// Frames skipped before measuring (exposure, USB start-up)
+#define TUNE_MS 1500		// Measuring time per mode, in ms
+#define TUNE_PROBES 12		// Max. modes measured
+#define TUNE_MAX_MODES 64	// Max. modes enumerated
+#define TUNE_ASPECT .01		// Max. relative aspect ratio difference from the requested size
+#define TUNE_CACHE "CameraModes.dat"
+
+struct tuneResult{
+	struct uvcMode mode;	// Camera mode
+	int scale;		// MJPEG decode scale (1 for YUYV)
+	double fps;		// Frames processed per second
+	double latency;		// Median capture to end of blob detection, in ms
+};
+
 // Startup
-int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int ai_mode);
+int imageCaptureStartup(char *devName, int rx, int ry, int own_col, int ai_mode, int no_display);
 
 // OpenGL, GLUT, and main loop
 void initGlut(char* winName);
 void kbHandler(unsigned char key, int x, int y);
 void kbUpHandler(unsigned char key, int x, int y);
 void WindowReshape(int w, int h);
+void DisplayFrame(void);
+void drawStats(void);
 void FrameGrabLoop(void);
+void *ProcessingLoop(void *arg);
+void stopProcessing(void);
+void headlessLoop(void);
+double stageClock(void);
+void stageRecord(int stage, double t0);
+void stageRecordMs(int stage, double ms);
+void stageReport(void);
 
 // Webcam setup and frame capture
-unsigned char *yuyv_to_rgb (struct vdIn *vd, int sx, int sy);
+unsigned char *yuyv_to_rgb (struct vdIn *vd, unsigned char *dst);
 struct vdIn *initCam(const char *videodevice, int width, int height);
-unsigned char *getFrame(struct vdIn *videoIn, int sx, int sy);
+struct vdIn *initCamMode(const char *videodevice, int width, int height, int format, int fps, int scale);
+struct vdIn *autotuneCam(const char *videodevice, int rx, int ry, int minWidth);
+int grabFrame(struct vdIn *videoIn);
+void releaseFrame(struct vdIn *videoIn);
+void captureOptions(char *record, int replay, int paced, int mjpeg, int tune);
+int startRecording(struct vdIn *videoIn, char *name);
+void stopRecording(void);
+struct vdIn *initReplay(const char *name);
+unsigned char *getFrame(struct vdIn *videoIn, unsigned char *dst);
 void closeCam(struct vdIn *videoIn);
 
 // Frame processing
 double *getH(void);
+void buildUnwarpMap(double *H, int srcx, int srcy);
+struct unwarpMap *getUnwarpMap(double *H, int srcx, int srcy);
 void fieldUnwarp(double *H, struct image *im);
+void fieldFromYUYV(double *H, struct vdIn *vd);
+void fieldFromYUYVWin(double *H, struct vdIn *vd, int (*win)[4], int nwin);
 void bgSubtract(void);
 void bgSubtract2(void);
+void fieldToRGB(unsigned char *fgIm, int sx, int sy, unsigned char *dst);
+void seedBgModel(unsigned short *var);
+int saveCalibration(void);
+int loadCalibration(void);
+void *arenaAlloc(struct frameArena *a, size_t bytes);
+void arenaReset(struct frameArena *a);
+struct blob *newBlob(void);
 void releaseBlobs(struct blob *blobList);
+struct image *labelImage(int sx, int sy);
 void rgb2hsv(double R, double G, double B, double *H, double *S, double *V);
+void buildHueLUT(void);
+struct hueLUT *getHueLUT(void);
 struct image *blobDetect(unsigned char *fgIm, int sx, int sy, struct blob **blob_list, int *nblobs);
-struct image *blobDetect2(unsigned char *fgIm, int sx, int sy, struct blob **blob_list, int *nblobs);
-struct image *renderBlobs(unsigned char *fgIm, int sx, int sy, struct image *labels, struct blob *list);
+struct image *blobDetect2(unsigned char *fgIm, unsigned long long *mask, int sx, int sy, struct blob **blob_list, int *nblobs);
+struct image *blobDetectROI(unsigned char *fgIm, unsigned long long *mask, int sx, int sy, int (*win)[4], int nwin,
+                            struct blob **blob_list, int *nblobs);
+struct image *roiDetect(struct roiState *st, struct tracker *tr, double *H, struct vdIn *vd, struct blob **blob_list, int *nblobs);
+void trackBlobs(struct tracker *tr, struct blob **blob_list);
+int renderBlobs(unsigned char *fgIm, int sx, int sy, struct image *labels, struct blob *list, unsigned char *dst);
+int overlayBlobs(struct blob *list, struct overlay *ov);
+void drawOverlays(struct overlay *ov, int n);
+void offsetCalibration(struct blob *list);
 void drawLine(int x1, int y1, double vx, double vy, double scale, double R, double G, double B, struct image *dst);
 void drawBox(int x1, int y1, int x2, int y2, double R, double G, double B, struct image *dst);
 void drawCross(int mcx, int mcy, double R, double G, double B, int len, struct image *dst);
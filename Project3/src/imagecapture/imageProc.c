@@ -19,6 +19,18 @@
 //////////////////////////////////////////////////////////////////////////
 
 #include"imageProc.h"
+#ifdef _OPENMP
+#include<omp.h>
+#endif
+#ifdef __SSE2__
+#include<emmintrin.h>
+#endif
+// The AVX2 converter is built with GCC's target attribute and picked at
+// run time, so the rest of the code does not need -mavx2
+#if defined(__SSE2__)&&defined(__GNUC__)&&(defined(__x86_64__)||defined(__i386__))
+#include<immintrin.h>
+#define HAVE_AVX2_TARGET
+#endif
 
 //////////////////////////////////////////////////////////////////////////
 // Filter kernels and simple filtering
@@ -88,55 +100,144 @@ void deleteKernel(struct kernel *k)
  return;
 }
 
+static inline void rowFilter(double *out, double **src, double *taps, int ntaps, int n)
+{
+ // Weighted sum of rows, out[i]=sum_l taps[l]*src[l][i]. This is the tap
+ // loop for both directions of convolve_sep() (for the x direction the
+ // rows are shifted views of the same padded row). The taps are summed
+ // in order, so results match the scalar code exactly.
+ int i,l;
+ double acc;
+#ifdef __SSE2__
+ __m128d k,a0,a1,a2,a3;
+
+ for (i=0;i+8<=n;i+=8)				// 8 pixels per iteration, in 4 registers
+ {
+  a0=a1=a2=a3=_mm_setzero_pd();
+  for (l=0;l<ntaps;l++)
+  {
+   k=_mm_set1_pd(*(taps+l));
+   a0=_mm_add_pd(a0,_mm_mul_pd(k,_mm_loadu_pd(*(src+l)+i)));
+   a1=_mm_add_pd(a1,_mm_mul_pd(k,_mm_loadu_pd(*(src+l)+i+2)));
+   a2=_mm_add_pd(a2,_mm_mul_pd(k,_mm_loadu_pd(*(src+l)+i+4)));
+   a3=_mm_add_pd(a3,_mm_mul_pd(k,_mm_loadu_pd(*(src+l)+i+6)));
+  }
+  _mm_storeu_pd(out+i,a0);
+  _mm_storeu_pd(out+i+2,a1);
+  _mm_storeu_pd(out+i+4,a2);
+  _mm_storeu_pd(out+i+6,a3);
+ }
+#else
+ i=0;
+#endif
+ for (;i<n;i++)
+ {
+  acc=0;
+  for (l=0;l<ntaps;l++)
+   acc+=(*(taps+l))*(*(*(src+l)+i));
+  *(out+i)=acc;
+ }
+}
+
+int convolve_sep(struct image *im, struct kernel *kx, struct kernel *ky, struct image *dst)
+{
+ // Separable convolution with kx along x, then ky along y, in a single
+ // sweep over the image. Each thread takes a band of rows; input rows are
+ // filtered along x into a ring of ky->size rows, and each output row is
+ // the weighted sum of the rows in the ring, so the y pass also walks
+ // memory along rows and the intermediate image is never stored.
+ // Either kernel can be NULL to filter in one direction only. Boundaries
+ // are replicated, the result is the same as convolve_y(convolve_x(im,kx),ky).
+ //
+ // The output goes into dst, which must be the same size as im (and can
+ // not be im). Returns 0 on success, -1 on error.
+ static double one=1.0;
+ struct kernel id={&one,1,0};		// Identity kernel for a NULL kx or ky
+ double *pad, *ring, **src;
+ int sx,sy,hx,hy,nb,b,j0,j1,i,j,l,ly,y,o,err;
+
+ if (kx==NULL) kx=&id;
+ if (ky==NULL) ky=&id;
+ if (dst->sx!=im->sx||dst->sy!=im->sy||dst->nlayers!=im->nlayers)
+ {
+  fprintf(stderr,"convolve_sep(): Output image must be the same size as the input\n");
+  return(-1);
+ }
+ for (ly=0;ly<im->nlayers;ly++)
+  if (dst->layers[ly]==im->layers[ly])
+  {
+   fprintf(stderr,"convolve_sep(): Can not filter an image in place\n");
+   return(-1);
+  }
+ sx=im->sx;
+ sy=im->sy;
+ hx=kx->halfsize;
+ hy=ky->halfsize;
+ err=0;
+
+#pragma omp parallel private(pad,ring,src,nb,b,j0,j1,i,j,l,ly,y,o)
+ {
+  nb=1;
+  b=0;
+#ifdef _OPENMP
+  nb=omp_get_num_threads();
+  b=omp_get_thread_num();
+#endif
+  j0=(b*sy)/nb;				// This thread's band is rows [j0,j1)
+  j1=((b+1)*sy)/nb;
+  pad=(double *)calloc(sx+(2*hx),sizeof(double));
+  ring=(double *)calloc(ky->size*sx,sizeof(double));
+  src=(double **)calloc(kx->size+ky->size,sizeof(double *));
+  if (!pad||!ring||!src)
+  {
+#pragma omp atomic
+   err++;
+  }
+  else
+   for (ly=0;ly<im->nlayers;ly++)
+    for (j=j0-hy;j<j1+hy;j++)
+    {
+     // Filter input row j (replicated past the boundaries) along x into
+     // the ring. Rows are kept at index (j-j0+hy) mod ky->size.
+     y=(j<0)?0:((j>=sy)?sy-1:j);
+     memcpy(pad+hx,im->layers[ly]+(y*sx),sx*sizeof(double));
+     for (i=0;i<hx;i++)
+     {
+      *(pad+i)=*(pad+hx);
+      *(pad+hx+sx+i)=*(pad+hx+sx-1);
+     }
+     for (l=0;l<kx->size;l++) *(src+l)=pad+l;
+     rowFilter(ring+(((j-j0+hy)%ky->size)*sx),src,kx->taps,kx->size,sx);
+
+     // Once rows o-hy to o+hy are in the ring, output row o
+     o=j-hy;
+     if (o>=j0)
+     {
+      for (l=0;l<ky->size;l++) *(src+l)=ring+(((o-j0+l)%ky->size)*sx);
+      rowFilter(dst->layers[ly]+(o*sx),src,ky->taps,ky->size,sx);
+     }
+    }
+  free(pad);
+  free(ring);
+  free(src);
+ }
+
+ if (err){fprintf(stderr,"convolve_sep(): Out of memory!\n"); return(-1);}
+ return(0);
+}
+
 struct image *convolve_x(struct image *im, struct kernel *k)
 {
  // Convolve (actually, correlate, but since the kernel is symmetric...) the
  // input image with the specified kernel along x. Boundary data is handled by
  // replicating the boundary values.
  // For multi-layer images, convolution is applied on each layer.
-
- double ksum,bnd;
- int i,j,l,ly;
+ // See convolve_sep() to filter into an existing image.
  struct image *tmp;
 
  tmp=newImage(im->sx,im->sy,im->nlayers);
  if (!tmp){fprintf(stderr,"convolve_x(): Can not allocate memory for image data\n"); return(NULL);}
-
- for (ly=0; ly<im->nlayers; ly++)
-#pragma omp parallel for schedule(dynamic,32) private(i,j,l,ksum,bnd)
-  for (j=0; j<im->sy; j++)
-  {
-   for (i=k->halfsize; i < (im->sx)-(k->halfsize); i++)	// Away from boundaries
-   {
-    ksum=0;
-    for (l=-k->halfsize;l<=k->halfsize;l++)
-     ksum+=(*(im->layers[ly]+i+l+(j*im->sx)))*(*(k->taps+k->halfsize+l));
-    *(tmp->layers[ly]+i+(j*im->sx))=ksum;
-   }
-   for (i=0;i<k->halfsize;i++)				// Left boundary
-   {
-    ksum=0;
-    bnd=*(im->layers[ly]+(j*im->sx));
-    for (l=-k->halfsize;l<=k->halfsize;l++)
-     if (i+l>=0)
-      ksum+=(*(im->layers[ly]+i+l+(j*im->sx)))*(*(k->taps+k->halfsize+l));
-     else
-      ksum+=bnd*(*(k->taps+k->halfsize+l));
-    *(tmp->layers[ly]+i+(j*im->sx))=ksum;
-   }
-   for (i=(im->sx)-(k->halfsize);i<im->sx;i++)		// Right boundary
-   {
-    ksum=0;
-    bnd=*(im->layers[ly]+im->sx-1+(j*im->sx));
-    for (l=-k->halfsize;l<=k->halfsize;l++)
-     if (i+l<im->sx)
-      ksum+=(*(im->layers[ly]+i+l+(j*im->sx)))*(*(k->taps+k->halfsize+l));
-     else
-      ksum+=bnd*(*(k->taps+k->halfsize+l));
-    *(tmp->layers[ly]+i+(j*im->sx))=ksum;
-   }
-  }
-
+ if (convolve_sep(im,k,NULL,tmp)){deleteImage(tmp); return(NULL);}
  return(tmp);
 }
 
@@ -146,49 +247,147 @@ struct image *convolve_y(struct image *im, struct kernel *k)
  // input image with the specified kernel along the y direction.
  // Like convolve_x(), this applies the convolution operation to each layer
  // of multi-layer images.
- double ksum,bnd;
- int i,j,l,ly;
  struct image *tmp;
 
  tmp=newImage(im->sx,im->sy,im->nlayers);
  if (!tmp){fprintf(stderr,"convolve_y(): Can not allocate memory for image data\n"); return(NULL);}
+ if (convolve_sep(im,NULL,k,tmp)){deleteImage(tmp); return(NULL);}
+ return(tmp);
+}
 
- for (ly=0; ly<im->nlayers; ly++)
-#pragma omp parallel for schedule(dynamic,32) private(i,j,l,ksum,bnd)
-  for (i=0; i<im->sx; i++)
+//////////////////////////////////////////////////////////////////////////
+// Bit-packed binary masks
+//////////////////////////////////////////////////////////////////////////
+static void maskPadClear(unsigned long long *mask, int sx, int sy)
+{
+ // Zero the bits past the right edge of the image in the last word of each row
+ int j,nw;
+
+ nw=MASK_WORDS(sx);
+ if (sx&63)
+  for (j=0;j<sy;j++)
+   *(mask+(j*nw)+nw-1)&=(1ULL<<(sx&63))-1;
+}
+
+void maskFromBuffer(unsigned char *buf, int sx, int sy, int nlayers, unsigned long long *mask)
+{
+ // Builds the mask of the pixels in buf (interleaved, nlayers per pixel,
+ // e.g. a frame buffer) that are not all zero
+ int i,j,l,nw;
+ unsigned long long w;
+
+ nw=MASK_WORDS(sx);
+ memset(mask,0,nw*sy*sizeof(unsigned long long));
+ for (j=0;j<sy;j++)
+  for (i=0;i<sx;i++)
   {
-   for (j=k->halfsize; j<(im->sy)-(k->halfsize); j++)	// Away from boundaries
-   {
-    ksum=0;
-    for (l=-k->halfsize;l<=k->halfsize;l++)
-     ksum+=(*(im->layers[ly]+i+((j+l)*im->sx)))*(*(k->taps+k->halfsize+l));
-    *(tmp->layers[ly]+i+(j*im->sx))=ksum;
-   }
-   for (j=0;j<k->halfsize;j++)				// Top boundary
-   {
-    ksum=0;
-    bnd=*(im->layers[ly]+i);
-    for (l=-k->halfsize;l<=k->halfsize;l++)
-     if (j+l>=0)
-      ksum+=(*(im->layers[ly]+i+((j+l)*im->sx)))*(*(k->taps+k->halfsize+l));
-     else
-      ksum+=bnd*(*(k->taps+k->halfsize+l));
-    *(tmp->layers[ly]+i+(j*im->sx))=ksum;
-   }
-   for (j=(im->sy)-(k->halfsize);j<im->sy;j++)		// Bottom boundary
+   w=0;
+   for (l=0;l<nlayers;l++) w|=*(buf+(((j*sx)+i)*nlayers)+l);
+   if (w) *(mask+(j*nw)+(i>>6))|=1ULL<<(i&63);
+  }
+}
+
+int maskDilate(unsigned long long *src, unsigned long long *dst, int sx, int sy, int r, unsigned long long *work)
+{
+ // Dilation with a (2r+1)x(2r+1) square, 0<=r<64. Pixels outside the
+ // image count as unset. Horizontal pass first, shifting whole words
+ // (with the carry from the neighbouring word), then the vertical pass
+ // ors together 2r+1 rows. dst must not be src. work is NULL, or
+ // MASK_WORK(sx,sy) words of scratch space (the same for all the
+ // morphology functions below).
+ // Returns 0 on success, -1 if out of memory.
+ unsigned long long *tmp, *row, *out;
+ int i,j,k,s,nw,y0,y1;
+
+ nw=MASK_WORDS(sx);
+ if (work!=NULL) tmp=work;
+ else tmp=(unsigned long long *)calloc(nw*sy,sizeof(unsigned long long));
+ if (!tmp){fprintf(stderr,"maskDilate(): Out of memory!\n"); return(-1);}
+
+ for (j=0;j<sy;j++)
+ {
+  row=src+(j*nw);
+  out=tmp+(j*nw);
+  for (k=0;k<nw;k++)
+  {
+   *(out+k)=*(row+k);
+   for (s=1;s<=r;s++)
    {
-    ksum=0;
-    bnd=*(im->layers[ly]+i+((im->sy-1)*im->sx));
-    for (l=-k->halfsize;l<=k->halfsize;l++)
-     if (j+l<im->sy)
-      ksum+=(*(im->layers[ly]+i+((j+l)*im->sx)))*(*(k->taps+k->halfsize+l));
-     else
-      ksum+=bnd*(*(k->taps+k->halfsize+l));
-    *(tmp->layers[ly]+i+(j*im->sx))=ksum;
+    *(out+k)|=(*(row+k))<<s;			// From the left: pixel x-s
+    if (k>0) *(out+k)|=(*(row+k-1))>>(64-s);
+    *(out+k)|=(*(row+k))>>s;			// From the right: pixel x+s
+    if (k<nw-1) *(out+k)|=(*(row+k+1))<<(64-s);
    }
   }
+ }
+ maskPadClear(tmp,sx,sy);
 
- return(tmp);
+ for (j=0;j<sy;j++)
+ {
+  y0=(j-r<0)?0:j-r;
+  y1=(j+r>=sy)?sy-1:j+r;
+  out=dst+(j*nw);
+  memset(out,0,nw*sizeof(unsigned long long));
+  for (i=y0;i<=y1;i++)
+   for (k=0;k<nw;k++)
+    *(out+k)|=*(tmp+(i*nw)+k);
+ }
+
+ if (work==NULL) free(tmp);
+ return(0);
+}
+
+int maskErode(unsigned long long *src, unsigned long long *dst, int sx, int sy, int r, unsigned long long *work)
+{
+ // Erosion with a (2r+1)x(2r+1) square, done as the complement of the
+ // dilation of the complement. Pixels outside the image count as set,
+ // so the mask does not shrink away from the image edges.
+ unsigned long long *inv;
+ int k,nw;
+
+ nw=MASK_WORDS(sx);
+ if (work!=NULL) inv=work+(nw*sy);
+ else inv=(unsigned long long *)calloc(nw*sy,sizeof(unsigned long long));
+ if (!inv){fprintf(stderr,"maskErode(): Out of memory!\n"); return(-1);}
+ for (k=0;k<nw*sy;k++) *(inv+k)=~(*(src+k));
+ maskPadClear(inv,sx,sy);
+ if (maskDilate(inv,dst,sx,sy,r,work)){if (work==NULL) free(inv); return(-1);}
+ for (k=0;k<nw*sy;k++) *(dst+k)=~(*(dst+k));
+ maskPadClear(dst,sx,sy);
+ if (work==NULL) free(inv);
+ return(0);
+}
+
+int maskOpen(unsigned long long *mask, int sx, int sy, int r, unsigned long long *work)
+{
+ // Morphological opening (erode, then dilate) in place. Removes specks
+ // and thin spurs smaller than the (2r+1)x(2r+1) square.
+ unsigned long long *tmp;
+ int err;
+
+ if (work!=NULL) tmp=work+(2*MASK_WORDS(sx)*sy);
+ else tmp=(unsigned long long *)calloc(MASK_WORDS(sx)*sy,sizeof(unsigned long long));
+ if (!tmp){fprintf(stderr,"maskOpen(): Out of memory!\n"); return(-1);}
+ err=maskErode(mask,tmp,sx,sy,r,work);
+ if (!err) err=maskDilate(tmp,mask,sx,sy,r,work);
+ if (work==NULL) free(tmp);
+ return(err);
+}
+
+int maskClose(unsigned long long *mask, int sx, int sy, int r, unsigned long long *work)
+{
+ // Morphological closing (dilate, then erode) in place. Fills holes and
+ // gaps narrower than the (2r+1)x(2r+1) square.
+ unsigned long long *tmp;
+ int err;
+
+ if (work!=NULL) tmp=work+(2*MASK_WORDS(sx)*sy);
+ else tmp=(unsigned long long *)calloc(MASK_WORDS(sx)*sy,sizeof(unsigned long long));
+ if (!tmp){fprintf(stderr,"maskClose(): Out of memory!\n"); return(-1);}
+ err=maskDilate(mask,tmp,sx,sy,r,work);
+ if (!err) err=maskErode(tmp,mask,sx,sy,r,work);
+ if (work==NULL) free(tmp);
+ return(err);
 }
 
 //////////////////////////////////////////////////////////////////////////
@@ -218,21 +417,24 @@ struct image *gradient(struct image *im, double sigma1)
  k2=GaussKernel(sigma1);
  mag=newImage(im->sx,im->sy,1);
  grad=newImage(im->sx,im->sy,3);
- ix=convolve_x(im,k1);
- iy=convolve_y(im,k1);
- if (!k1 || !ix || !iy || !mag || !grad)
+ ix=newImage(im->sx,im->sy,1);
+ iy=newImage(im->sx,im->sy,1);
+ t1=newImage(im->sx,im->sy,1);
+ if (!k1 || !k2 || !ix || !iy || !t1 || !mag || !grad)
  {
   fprintf(stderr,"gradient(): Out of memory!\n");
+  deleteImage(ix); deleteImage(iy); deleteImage(t1); deleteImage(mag); deleteImage(grad);
+  deleteKernel(k1); deleteKernel(k2);
+  return(NULL);
+ }
+ // Derivatives, then smooth them with a single separable pass each
+ if (convolve_sep(im,k1,NULL,t1) || convolve_sep(t1,k2,k2,ix) ||
+     convolve_sep(im,NULL,k1,t1) || convolve_sep(t1,k2,k2,iy))
+ {
+  deleteImage(ix); deleteImage(iy); deleteImage(t1); deleteImage(mag); deleteImage(grad);
+  deleteKernel(k1); deleteKernel(k2);
   return(NULL);
  }
- // Smooth derivatives
- t1=convolve_x(ix,k2);
- deleteImage(ix);
- ix=convolve_y(t1,k2);
- deleteImage(t1);
- t1=convolve_x(iy,k2);
- deleteImage(iy);
- iy=convolve_y(t1,k2);
  deleteImage(t1);
 
  // Gradient magnitude 
@@ -1075,6 +1277,932 @@ void deletePyramid(struct pyramid *pyr)
  free(pyr);
 }
 
+//////////////////////////////////////////////////////////////////////////
+// Typed images
+//////////////////////////////////////////////////////////////////////////
+static int elemSize(int type)
+{
+ // Size in bytes of one element of the given type
+ if (type==IM_U8) return(sizeof(unsigned char));
+ if (type==IM_S16) return(sizeof(short));
+ return(sizeof(float));
+}
+
+struct timage *newTImage(int sx, int sy, int nlayers, int type, int layout)
+{
+ // Create and return an empty (all zeroes) typed image with the
+ // specified dimensions, element type, and layout. Rows are not
+ // padded, so stride is sx (planar) or sx*nlayers (interleaved).
+ struct timage *im;
+
+ if (nlayers<1||nlayers>4)
+ {
+  fprintf(stderr,"newTImage(): Image must have 1 to 4 layers\n");
+  return(NULL);
+ }
+ if (type!=IM_U8&&type!=IM_S16&&type!=IM_F32)
+ {
+  fprintf(stderr,"newTImage(): Unknown element type %d\n",type);
+  return(NULL);
+ }
+
+ im=(struct timage *)calloc(1,sizeof(struct timage));
+ if (!im) return(NULL);
+ im->data=calloc(sx*sy*nlayers,elemSize(type));
+ if (!im->data){free(im); return(NULL);}
+
+ im->type=type;
+ im->layout=layout;
+ im->sx=sx;
+ im->sy=sy;
+ im->nlayers=nlayers;
+ im->stride=(layout==IM_INTERLEAVED)?sx*nlayers:sx;
+ im->plane=(layout==IM_INTERLEAVED)?0:sx*sy;
+ im->owner=1;
+
+ return(im);
+}
+
+struct timage *viewTImage(void *data, int sx, int sy, int nlayers, int type, int layout, int stride)
+{
+ // Wrap existing data in a typed image structure without copying it.
+ // The stride is in elements; for planar data the layers are expected
+ // to follow one another, each stride*sy elements long.
+ // e.g. viewTImage(fieldIm,1024,768,3,IM_U8,IM_INTERLEAVED,1024*3)
+ // deleteTImage() will release the structure but not the data.
+ struct timage *im;
+
+ im=(struct timage *)calloc(1,sizeof(struct timage));
+ if (!im) return(NULL);
+
+ im->data=data;
+ im->type=type;
+ im->layout=layout;
+ im->sx=sx;
+ im->sy=sy;
+ im->nlayers=nlayers;
+ im->stride=stride;
+ im->plane=(layout==IM_INTERLEAVED)?0:stride*sy;
+ im->owner=0;
+
+ return(im);
+}
+
+struct timage *subTImage(struct timage *im, int x, int y, int sx, int sy)
+{
+ // Returns a non-owning view on the sx x sy rectangle of im whose
+ // top-left corner is at (x,y). Writes to the view change im.
+ struct timage *sub;
+ int off;
+
+ if (x<0||y<0||x+sx>im->sx||y+sy>im->sy)
+ {
+  fprintf(stderr,"subTImage(): Rectangle is outside the image\n");
+  return(NULL);
+ }
+ sub=(struct timage *)calloc(1,sizeof(struct timage));
+ if (!sub) return(NULL);
+
+ *(sub)=*(im);
+ off=(y*im->stride)+((im->layout==IM_INTERLEAVED)?x*im->nlayers:x);
+ sub->data=(void *)((char *)im->data+(off*elemSize(im->type)));
+ sub->sx=sx;
+ sub->sy=sy;
+ sub->owner=0;
+
+ return(sub);
+}
+
+void deleteTImage(struct timage *im)
+{
+ // Free a typed image. Data is only released if the image owns it
+ if (!im) return;
+ if (im->owner&&im->data!=NULL) free(im->data);
+ free(im);
+}
+
+void getRowTImage(struct timage *im, int ly, int y, float *row)
+{
+ // Read row y of layer ly into row[0..sx-1] as float. This (and
+ // putRowTImage()) is the only place that needs to know about element
+ // types and layouts, everything else works on float rows.
+ int i,st,off;
+ unsigned char *pc;
+ short *ps;
+ float *pf;
+
+ st=(im->layout==IM_INTERLEAVED)?im->nlayers:1;
+ off=(y*im->stride)+((im->layout==IM_INTERLEAVED)?ly:ly*im->plane);
+ if (im->type==IM_U8)
+ {
+  pc=(unsigned char *)im->data+off;
+  for (i=0;i<im->sx;i++) *(row+i)=*(pc+(i*st));
+ }
+ else if (im->type==IM_S16)
+ {
+  ps=(short *)im->data+off;
+  for (i=0;i<im->sx;i++) *(row+i)=*(ps+(i*st));
+ }
+ else
+ {
+  pf=(float *)im->data+off;
+  if (st==1) memcpy(row,pf,im->sx*sizeof(float));
+  else for (i=0;i<im->sx;i++) *(row+i)=*(pf+(i*st));
+ }
+}
+
+void putRowTImage(struct timage *im, int ly, int y, float *row)
+{
+ // Write row[0..sx-1] into row y of layer ly. Values are rounded to
+ // nearest and clamped to the range of integer element types.
+ int i,st,off;
+ float v;
+ unsigned char *pc;
+ short *ps;
+ float *pf;
+
+ st=(im->layout==IM_INTERLEAVED)?im->nlayers:1;
+ off=(y*im->stride)+((im->layout==IM_INTERLEAVED)?ly:ly*im->plane);
+ if (im->type==IM_U8)
+ {
+  pc=(unsigned char *)im->data+off;
+  for (i=0;i<im->sx;i++)
+  {
+   v=*(row+i);
+   *(pc+(i*st))=(v<=0)?0:((v>=255)?255:(unsigned char)(v+.5f));
+  }
+ }
+ else if (im->type==IM_S16)
+ {
+  ps=(short *)im->data+off;
+  for (i=0;i<im->sx;i++)
+  {
+   v=*(row+i);
+   *(ps+(i*st))=(v<=-32768)?-32768:((v>=32767)?32767:(short)floorf(v+.5f));
+  }
+ }
+ else
+ {
+  pf=(float *)im->data+off;
+  if (st==1) memcpy(pf,row,im->sx*sizeof(float));
+  else for (i=0;i<im->sx;i++) *(pf+(i*st))=*(row+i);
+ }
+}
+
+static float *rowPtrTImage(struct timage *im, int ly, int y, float *row)
+{
+ // Pointer to row y of layer ly as float. Planar float rows are used in
+ // place, anything else is converted into row.
+ if (im->type==IM_F32&&im->layout==IM_PLANAR)
+  return((float *)im->data+(ly*im->plane)+(y*im->stride));
+ getRowTImage(im,ly,y,row);
+ return(row);
+}
+
+struct timage *copyTImage(struct timage *im, int type, int layout)
+{
+ // Make a copy of the input image with the specified element type
+ // and layout. The copy owns its data.
+ struct timage *imR;
+ float *row;
+ int j,ly;
+
+ imR=newTImage(im->sx,im->sy,im->nlayers,type,layout);
+ row=(float *)calloc(im->sx,sizeof(float));
+ if (!imR||!row){fprintf(stderr,"copyTImage(): Out of memory!\n");deleteTImage(imR);free(row);return(NULL);}
+
+ for (ly=0;ly<im->nlayers;ly++)
+  for (j=0;j<im->sy;j++)
+  {
+   getRowTImage(im,ly,j,row);
+   putRowTImage(imR,ly,j,row);
+  }
+
+ free(row);
+ return(imR);
+}
+
+struct timage *timageFromImage(struct image *im, int type, int layout)
+{
+ // Convert a double-precision image into a typed image
+ struct timage *imR;
+ float *row;
+ int i,j,ly;
+
+ imR=newTImage(im->sx,im->sy,im->nlayers,type,layout);
+ row=(float *)calloc(im->sx,sizeof(float));
+ if (!imR||!row){fprintf(stderr,"timageFromImage(): Out of memory!\n");deleteTImage(imR);free(row);return(NULL);}
+
+ for (ly=0;ly<im->nlayers;ly++)
+  for (j=0;j<im->sy;j++)
+  {
+   for (i=0;i<im->sx;i++) *(row+i)=(float)(*(im->layers[ly]+i+(j*im->sx)));
+   putRowTImage(imR,ly,j,row);
+  }
+
+ free(row);
+ return(imR);
+}
+
+struct image *imageFromTImage(struct timage *im)
+{
+ // Convert a typed image into a double-precision image. Only 1 and 3
+ // layer images can be converted (see newImage())
+ struct image *imR;
+ float *row;
+ int i,j,ly;
+
+ imR=newImage(im->sx,im->sy,im->nlayers);
+ row=(float *)calloc(im->sx,sizeof(float));
+ if (!imR||!row){fprintf(stderr,"imageFromTImage(): Out of memory!\n");deleteImage(imR);free(row);return(NULL);}
+
+ for (ly=0;ly<im->nlayers;ly++)
+  for (j=0;j<im->sy;j++)
+  {
+   getRowTImage(im,ly,j,row);
+   for (i=0;i<im->sx;i++) *(imR->layers[ly]+i+(j*im->sx))=*(row+i);
+  }
+
+ free(row);
+ return(imR);
+}
+
+static inline void trowFilter(float *out, float **src, float *taps, int ntaps, int n)
+{
+ // Single precision version of rowFilter()
+ int i,l;
+ float acc;
+#ifdef __SSE2__
+ __m128 k,a0,a1,a2,a3;
+
+ for (i=0;i+16<=n;i+=16)			// 16 pixels per iteration, in 4 registers
+ {
+  a0=a1=a2=a3=_mm_setzero_ps();
+  for (l=0;l<ntaps;l++)
+  {
+   k=_mm_set1_ps(*(taps+l));
+   a0=_mm_add_ps(a0,_mm_mul_ps(k,_mm_loadu_ps(*(src+l)+i)));
+   a1=_mm_add_ps(a1,_mm_mul_ps(k,_mm_loadu_ps(*(src+l)+i+4)));
+   a2=_mm_add_ps(a2,_mm_mul_ps(k,_mm_loadu_ps(*(src+l)+i+8)));
+   a3=_mm_add_ps(a3,_mm_mul_ps(k,_mm_loadu_ps(*(src+l)+i+12)));
+  }
+  _mm_storeu_ps(out+i,a0);
+  _mm_storeu_ps(out+i+4,a1);
+  _mm_storeu_ps(out+i+8,a2);
+  _mm_storeu_ps(out+i+12,a3);
+ }
+#else
+ i=0;
+#endif
+ for (;i<n;i++)
+ {
+  acc=0;
+  for (l=0;l<ntaps;l++)
+   acc+=(*(taps+l))*(*(*(src+l)+i));
+  *(out+i)=acc;
+ }
+}
+
+int tconvolve_sep(struct timage *im, struct kernel *kx, struct kernel *ky, struct timage *dst)
+{
+ // Typed version of convolve_sep(), single sweep separable convolution
+ // with kx along x then ky along y (either may be NULL), replicated
+ // boundaries. dst can have any element type and layout, but must be
+ // the same size as im and must not share its data. It can be a view,
+ // so the output can go straight into a caller's buffer.
+ // Returns 0 on success, -1 on error.
+ static double one=1.0;
+ struct kernel id={&one,1,0};
+ float *tx, *ty, *pad, *ring, *out, **src;
+ int sx,sy,hx,hy,nb,b,j0,j1,i,j,l,ly,y,o,err;
+
+ if (kx==NULL) kx=&id;
+ if (ky==NULL) ky=&id;
+ if (dst->sx!=im->sx||dst->sy!=im->sy||dst->nlayers!=im->nlayers)
+ {
+  fprintf(stderr,"tconvolve_sep(): Output image must be the same size as the input\n");
+  return(-1);
+ }
+ if (dst->data==im->data)
+ {
+  fprintf(stderr,"tconvolve_sep(): Can not filter an image in place\n");
+  return(-1);
+ }
+ sx=im->sx;
+ sy=im->sy;
+ hx=kx->halfsize;
+ hy=ky->halfsize;
+ tx=(float *)calloc(kx->size+ky->size,sizeof(float));
+ if (!tx){fprintf(stderr,"tconvolve_sep(): Out of memory!\n"); return(-1);}
+ ty=tx+kx->size;
+ for (l=0;l<kx->size;l++) *(tx+l)=(float)(*(kx->taps+l));
+ for (l=0;l<ky->size;l++) *(ty+l)=(float)(*(ky->taps+l));
+ err=0;
+
+#pragma omp parallel private(pad,ring,out,src,nb,b,j0,j1,i,j,l,ly,y,o)
+ {
+  nb=1;
+  b=0;
+#ifdef _OPENMP
+  nb=omp_get_num_threads();
+  b=omp_get_thread_num();
+#endif
+  j0=(b*sy)/nb;
+  j1=((b+1)*sy)/nb;
+  pad=(float *)calloc(sx+(2*hx),sizeof(float));
+  ring=(float *)calloc(ky->size*sx,sizeof(float));
+  out=(float *)calloc(sx,sizeof(float));
+  src=(float **)calloc(kx->size+ky->size,sizeof(float *));
+  if (!pad||!ring||!out||!src)
+  {
+#pragma omp atomic
+   err++;
+  }
+  else
+   for (ly=0;ly<im->nlayers;ly++)
+    for (j=j0-hy;j<j1+hy;j++)
+    {
+     y=(j<0)?0:((j>=sy)?sy-1:j);
+     getRowTImage(im,ly,y,pad+hx);
+     for (i=0;i<hx;i++)
+     {
+      *(pad+i)=*(pad+hx);
+      *(pad+hx+sx+i)=*(pad+hx+sx-1);
+     }
+     for (l=0;l<kx->size;l++) *(src+l)=pad+l;
+     trowFilter(ring+(((j-j0+hy)%ky->size)*sx),src,tx,kx->size,sx);
+
+     o=j-hy;
+     if (o>=j0)
+     {
+      for (l=0;l<ky->size;l++) *(src+l)=ring+(((o-j0+l)%ky->size)*sx);
+      trowFilter(out,src,ty,ky->size,sx);
+      putRowTImage(dst,ly,o,out);
+     }
+    }
+  free(pad);
+  free(ring);
+  free(out);
+  free(src);
+ }
+
+ free(tx);
+ if (err){fprintf(stderr,"tconvolve_sep(): Out of memory!\n"); return(-1);}
+ return(0);
+}
+
+struct timage *tconvolve_x(struct timage *im, struct kernel *k, int type)
+{
+ // Typed version of convolve_x(). The output has the requested element
+ // type and the same layout as the input.
+ struct timage *tmp;
+
+ tmp=newTImage(im->sx,im->sy,im->nlayers,type,im->layout);
+ if (!tmp){fprintf(stderr,"tconvolve_x(): Can not allocate memory for image data\n");return(NULL);}
+ if (tconvolve_sep(im,k,NULL,tmp)){deleteTImage(tmp);return(NULL);}
+ return(tmp);
+}
+
+struct timage *tconvolve_y(struct timage *im, struct kernel *k, int type)
+{
+ // Typed version of convolve_y(), output of the requested element type
+ struct timage *tmp;
+
+ tmp=newTImage(im->sx,im->sy,im->nlayers,type,im->layout);
+ if (!tmp){fprintf(stderr,"tconvolve_y(): Can not allocate memory for image data\n");return(NULL);}
+ if (tconvolve_sep(im,NULL,k,tmp)){deleteTImage(tmp);return(NULL);}
+ return(tmp);
+}
+
+struct timage *tresize(struct timage *im, int sx, int sy)
+{
+ // Typed version of resize(), bilinear interpolation. The output has the
+ // same element type and layout as the input.
+ struct timage *dst;
+ double step_x,step_y;
+ float *r1, *r2, *out;
+ float *p1, *p2;
+ double fx,fy,dx,dy;
+ int x,y,flx,fly,ly;
+
+ dst=newTImage(sx,sy,im->nlayers,im->type,im->layout);
+ if (!dst){fprintf(stderr,"tresize(): Unable to allocate memory for image\n");return(NULL);}
+
+ // Step sizes for interpolation - Make sure we never exceed input image bounds!
+ step_x=(double)((im->sx)-1)/(double)(sx-1);
+ step_y=(double)((im->sy)-1)/(double)(sy-1);
+ step_x*=.9999;
+ step_y*=.9999;
+
+#pragma omp parallel private(x,y,ly,fx,fy,dx,dy,flx,fly,r1,r2,out,p1,p2)
+ {
+  r1=(float *)calloc(im->sx,sizeof(float));
+  r2=(float *)calloc(im->sx,sizeof(float));
+  out=(float *)calloc(sx,sizeof(float));
+#pragma omp for schedule(dynamic,32)
+  for (y=0;y<sy;y++)
+  {
+   fy=(y*step_y);
+   fly=(int)fy;
+   dy=fy-fly;
+   for (ly=0;ly<im->nlayers;ly++)
+   {
+    p1=rowPtrTImage(im,ly,fly,r1);
+    p2=rowPtrTImage(im,ly,fly+1,r2);
+    fx=0;
+    flx=-1;
+    for (x=0;x<sx-1;x++)
+    {
+     flx=(int)fx;
+     dx=fx-flx;
+     *(out+x)=(float)((((1.0-dx)*(*(p1+flx)))+(dx*(*(p1+flx+1))))*(1.0-dy)+\
+                      (((1.0-dx)*(*(p2+flx)))+(dx*(*(p2+flx+1))))*dy);
+     fx+=step_x;
+    }
+    *(out+sx-1)=(float)(((1.0-dy)*(*(p1+flx+1)))+(dy*(*(p2+flx+1))));	// Last scanline pixel, as in resize()
+    putRowTImage(dst,ly,y,out);
+   }
+  }
+  free(r1);
+  free(r2);
+  free(out);
+ }
+
+ return(dst);
+}
+
+static void tpointwise_op(struct timage *im1, struct timage *im2, int op, const char *name)
+{
+ // Element-wise op of two images (0: add, 1: sub, 2: mul, 3: div),
+ // result is left in im1. Checks that the dimensions are identical.
+ float *r1, *r2;
+ int i,j,ly;
+
+ if (im1->sx!=im2->sx || im1->sy!=im2->sy || im1->nlayers!=im2->nlayers)
+ {
+  fprintf(stderr,"%s(): Images have different sizes!\n",name);
+  return;
+ }
+
+#pragma omp parallel private(i,j,ly,r1,r2)
+ {
+  r1=(float *)calloc(im1->sx,sizeof(float));
+  r2=(float *)calloc(im1->sx,sizeof(float));
+#pragma omp for schedule(dynamic,32)
+  for (j=0;j<im1->sy;j++)
+   for (ly=0;ly<im1->nlayers;ly++)
+   {
+    getRowTImage(im1,ly,j,r1);
+    getRowTImage(im2,ly,j,r2);
+    if (op==0) for (i=0;i<im1->sx;i++) *(r1+i)+=*(r2+i);
+    else if (op==1) for (i=0;i<im1->sx;i++) *(r1+i)-=*(r2+i);
+    else if (op==2) for (i=0;i<im1->sx;i++) *(r1+i)*=*(r2+i);
+    else for (i=0;i<im1->sx;i++) *(r1+i)/=*(r2+i);
+    putRowTImage(im1,ly,j,r1);
+   }
+  free(r1);
+  free(r2);
+ }
+}
+
+void tpointwise_add(struct timage *im1, struct timage *im2)
+{
+ // im1=im1+im2
+ tpointwise_op(im1,im2,0,"tpointwise_add");
+}
+
+void tpointwise_sub(struct timage *im1, struct timage *im2)
+{
+ // im1=im1-im2
+ tpointwise_op(im1,im2,1,"tpointwise_sub");
+}
+
+void tpointwise_mul(struct timage *im1, struct timage *im2)
+{
+ // im1=im1.*im2
+ tpointwise_op(im1,im2,2,"tpointwise_mul");
+}
+
+void tpointwise_div(struct timage *im1, struct timage *im2)
+{
+ // im1=im1./im2
+ tpointwise_op(im1,im2,3,"tpointwise_div");
+}
+
+void tpointwise_pow(struct timage *im1, double p)
+{
+ // Element-wise power of input image:
+ //
+ // im1=im1.^p
+ float *r1;
+ int i,j,ly;
+
+#pragma omp parallel private(i,j,ly,r1)
+ {
+  r1=(float *)calloc(im1->sx,sizeof(float));
+#pragma omp for schedule(dynamic,32)
+  for (j=0;j<im1->sy;j++)
+   for (ly=0;ly<im1->nlayers;ly++)
+   {
+    getRowTImage(im1,ly,j,r1);
+    for (i=0;i<im1->sx;i++) *(r1+i)=powf(*(r1+i),(float)p);
+    putRowTImage(im1,ly,j,r1);
+   }
+  free(r1);
+ }
+}
+
+void timage_scale(struct timage *im, double k)
+{
+ // Scalar multiply an image by k
+ float *r1;
+ int i,j,ly;
+
+#pragma omp parallel private(i,j,ly,r1)
+ {
+  r1=(float *)calloc(im->sx,sizeof(float));
+#pragma omp for schedule(dynamic,32)
+  for (j=0;j<im->sy;j++)
+   for (ly=0;ly<im->nlayers;ly++)
+   {
+    getRowTImage(im,ly,j,r1);
+    for (i=0;i<im->sx;i++) *(r1+i)*=(float)k;
+    putRowTImage(im,ly,j,r1);
+   }
+  free(r1);
+ }
+}
+
+struct tpyramid *tLaplacianPyr(struct timage *im, int levels)
+{
+ // Typed version of LaplacianPyr(). Levels are planar. DoG levels need
+ // signed values, so uint8 input gives int16 levels; other types keep
+ // the input's type.
+ struct kernel *k;
+ double sig=1.0;
+ int lv,type;
+ struct tpyramid *pyr;
+ struct timage *t1, *t2, *t3;
+
+ pyr=(struct tpyramid *)calloc(1,sizeof(struct tpyramid));
+ if (!pyr){fprintf(stderr,"tLaplacianPyr(): Unable to allocate pyramid data structure\n");return(NULL);}
+ pyr->images=(struct timage **)calloc(levels,sizeof(struct timage *));
+ k=GaussKernel(sig);
+ if (!k || !pyr->images){fprintf(stderr,"tLaplacianPyr(): Can not allocate pyramid data or filter kernel\n");free(pyr);return(NULL);}
+
+ type=(im->type==IM_U8)?IM_S16:im->type;
+ t1=copyTImage(im,type,IM_PLANAR);
+
+ for(lv=0;lv<levels-1;lv++)
+ {
+  t2=tconvolve_x(t1,k,type);
+  t3=tconvolve_y(t2,k,type);
+  deleteTImage(t2);
+  tpointwise_sub(t1,t3);			// DoG at this scale is now in t1
+  *(pyr->images+lv)=t1;
+  t1=tresize(t3,t3->sx/2,t3->sy/2);
+  deleteTImage(t3);
+  if (t1->sx<=10 || t1->sy<=10){lv++;break;}
+ }
+ *(pyr->images+lv)=t1;
+ pyr->levels=++lv;
+
+ deleteKernel(k);
+ return(pyr);
+}
+
+struct tpyramid *tGaussianPyr(struct timage *im, int levels)
+{
+ // Typed version of GaussianPyr(). Levels are planar, of the input's type.
+ struct kernel *k;
+ double sig=1;
+ int lv;
+ struct tpyramid *pyr;
+ struct timage *t1, *t2, *t3;
+
+ pyr=(struct tpyramid *)calloc(1,sizeof(struct tpyramid));
+ if (!pyr){fprintf(stderr,"tGaussianPyr(): Unable to allocate pyramid data structure\n");return(NULL);}
+ pyr->images=(struct timage **)calloc(levels,sizeof(struct timage *));
+ k=GaussKernel(sig);
+ if (!k || !pyr->images){fprintf(stderr,"tGaussianPyr(): Can not allocate pyramid data or filter kernel\n");free(pyr);return(NULL);}
+
+ t1=copyTImage(im,im->type,IM_PLANAR);
+
+ for(lv=0;lv<levels;lv++)
+ {
+  *(pyr->images+lv)=t1;
+  t2=tconvolve_x(t1,k,im->type);
+  t3=tconvolve_y(t2,k,im->type);
+  deleteTImage(t2);
+  t1=tresize(t3,t3->sx/2,t3->sy/2);
+  deleteTImage(t3);
+  if (t1->sx<=10 || t1->sy<=10){lv++;break;}
+ }
+ deleteTImage(t1);
+ pyr->levels=lv;
+
+ deleteKernel(k);
+ return(pyr);
+}
+
+struct tpyramid *tweightedPyr(struct tpyramid *lPyr, struct tpyramid *gPyr)
+{
+ // Typed version of weightedPyr(). Each layer of the 3-layer lPyr is
+ // multiplied by the 1-layer weights in gPyr.
+ int lv,ly,i,j;
+ struct tpyramid *pyr;
+ struct timage *im;
+ float *r1, *w;
+
+ if ((*(lPyr->images))->nlayers!=3||(*(gPyr->images))->nlayers!=1)
+ {
+  fprintf(stderr,"tweightedPyr(): Error, expected 3-layer lPyr and 1-layer gPyr\n");
+  return(NULL);
+ }
+ if (lPyr->levels!=gPyr->levels)
+ {
+  fprintf(stderr,"tweightedPyr(): Error, pyramids must have the same number of levels\n");
+  return(NULL);
+ }
+ pyr=(struct tpyramid *)calloc(1,sizeof(struct tpyramid));
+ if (!pyr){fprintf(stderr,"tweightedPyr(): Unable to allocated pyramid data structure!\n");return(NULL);}
+ pyr->images=(struct timage **)calloc(lPyr->levels,sizeof(struct timage *));
+ if (!pyr->images){fprintf(stderr,"tweightedPyr(): Unable to allocated pyramid data structure!\n");free(pyr);return(NULL);}
+
+ for (lv=0;lv<lPyr->levels;lv++)
+ {
+  im=copyTImage(*(lPyr->images+lv),(*(lPyr->images+lv))->type,IM_PLANAR);
+  *(pyr->images+lv)=im;
+  r1=(float *)calloc(im->sx,sizeof(float));
+  w=(float *)calloc(im->sx,sizeof(float));
+  for (j=0;j<im->sy;j++)
+  {
+   getRowTImage(*(gPyr->images+lv),0,j,w);
+   for (ly=0;ly<3;ly++)
+   {
+    getRowTImage(im,ly,j,r1);
+    for (i=0;i<im->sx;i++) *(r1+i)*=*(w+i);
+    putRowTImage(im,ly,j,r1);
+   }
+  }
+  free(r1);
+  free(w);
+ }
+ pyr->levels=lPyr->levels;
+ return(pyr);
+}
+
+struct timage *tcollapsePyr(struct tpyramid *pyr)
+{
+ // Typed version of collapsePyr(). The result has the type of the
+ // pyramid levels.
+ int lv;
+ struct timage *t1, *t2;
+
+ t1=copyTImage(*(pyr->images+pyr->levels-1),(*(pyr->images+pyr->levels-1))->type,IM_PLANAR);
+
+ for (lv=pyr->levels-2;lv>=0; lv--)
+ {
+  t2=tresize(t1,(*(pyr->images+lv))->sx,(*(pyr->images+lv))->sy);
+  deleteTImage(t1);
+  tpointwise_add(t2,*(pyr->images+lv));
+  t1=t2;
+ }
+
+ return(t1);
+}
+
+void deleteTPyramid(struct tpyramid *pyr)
+{
+ // De-allocate memory occupied by a typed image pyramid
+ int i;
+ if (!pyr) return;
+ for (i=0; i<pyr->levels; i++)
+  deleteTImage(*(pyr->images+i));
+ free(pyr->images);
+ free(pyr);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// Pixel format conversion
+//////////////////////////////////////////////////////////////////////////
+// YUYV to RGB uses the integer conversion from uvccapture:
+//  r=((y<<8)+359v)>>8, g=((y<<8)-88u-183v)>>8, b=((y<<8)+454u)>>8
+// with u,v centered at 0 and results clamped to [0,255]. Since y<<8 is
+// a multiple of 256 this is the same as y+((359v)>>8) etc. The SIMD
+// versions split the large coefficients (359=256+103, 454=256+198,
+// -183=-256+73) so every product fits in 16 bits, which gives exactly
+// the same values as the scalar code for every y,u,v.
+static int yuyvSelected=-1;	// Converter in use, -1 until the first call
+
+static void yuyvRowScalar(unsigned char *src, int x0, int sx, unsigned char *r, unsigned char *g, unsigned char *b, int step)
+{
+ // Convert pixels [x0,sx) of one row. Output for pixel x goes to
+ // r[x*step], g[x*step], b[x*step].
+ int x,y,u,v,t;
+
+ for (x=x0;x<sx;x++)
+ {
+  y=*(src+(2*x))<<8;
+  u=*(src+(4*(x>>1))+1)-128;
+  v=*(src+(4*(x>>1))+3)-128;
+  t=(y+(359*v))>>8;
+  *(r+(x*step))=(t>255)?255:((t<0)?0:t);
+  t=(y-(88*u)-(183*v))>>8;
+  *(g+(x*step))=(t>255)?255:((t<0)?0:t);
+  t=(y+(454*u))>>8;
+  *(b+(x*step))=(t>255)?255:((t<0)?0:t);
+ }
+}
+
+#ifdef __SSE2__
+static inline void yuyvPix8SSE2(const unsigned char *src, __m128i *R, __m128i *G, __m128i *B)
+{
+ // 8 pixels (16 bytes of YUYV) to 16-bit R,G,B (not yet clamped)
+ __m128i p,y,c,u,v,t;
+
+ p=_mm_loadu_si128((const __m128i *)src);
+ y=_mm_and_si128(p,_mm_set1_epi16(0x00FF));
+ c=_mm_sub_epi16(_mm_srli_epi16(p,8),_mm_set1_epi16(128));	// u0 v0 u1 v1 ...
+ u=_mm_shufflehi_epi16(_mm_shufflelo_epi16(c,_MM_SHUFFLE(2,2,0,0)),_MM_SHUFFLE(2,2,0,0));
+ v=_mm_shufflehi_epi16(_mm_shufflelo_epi16(c,_MM_SHUFFLE(3,3,1,1)),_MM_SHUFFLE(3,3,1,1));
+ *R=_mm_add_epi16(_mm_add_epi16(y,v),_mm_srai_epi16(_mm_mullo_epi16(v,_mm_set1_epi16(103)),8));
+ t=_mm_add_epi16(_mm_mullo_epi16(u,_mm_set1_epi16(-88)),_mm_mullo_epi16(v,_mm_set1_epi16(73)));
+ *G=_mm_add_epi16(_mm_sub_epi16(y,v),_mm_srai_epi16(t,8));
+ *B=_mm_add_epi16(_mm_add_epi16(y,u),_mm_srai_epi16(_mm_mullo_epi16(u,_mm_set1_epi16(198)),8));
+}
+
+static inline void storeRGB4SSE2(unsigned char *dst, __m128i p)
+{
+ // 4 pixels as RGB0 words to 12 bytes of packed RGB
+ __m128i q;
+ int w;
+ q=_mm_or_si128(_mm_and_si128(p,_mm_set_epi32(0,0xFFFFFF,0,0xFFFFFF)),
+                _mm_and_si128(_mm_srli_epi64(p,8),_mm_set_epi32(0xFFFF,0xFF000000,0xFFFF,0xFF000000)));
+ q=_mm_or_si128(_mm_and_si128(q,_mm_set_epi32(0,0,0xFFFF,0xFFFFFFFF)),
+                _mm_and_si128(_mm_srli_si128(q,2),_mm_set_epi32(0,0xFFFFFFFF,0xFFFF0000,0)));
+ _mm_storel_epi64((__m128i *)dst,q);
+ w=_mm_cvtsi128_si32(_mm_srli_si128(q,8));
+ memcpy(dst+8,&w,4);
+}
+
+static int yuyvRowSSE2(unsigned char *src, int sx, unsigned char *r, unsigned char *g, unsigned char *b, int step)
+{
+ // 16 pixels at a time, returns the number of pixels converted
+ __m128i R0,G0,B0,R1,G1,B1,R,G,B,z,rg,b0;
+ int x;
+
+ z=_mm_setzero_si128();
+ for (x=0;x+16<=sx;x+=16)
+ {
+  yuyvPix8SSE2(src+(2*x),&R0,&G0,&B0);
+  yuyvPix8SSE2(src+(2*x)+16,&R1,&G1,&B1);
+  R=_mm_packus_epi16(R0,R1);
+  G=_mm_packus_epi16(G0,G1);
+  B=_mm_packus_epi16(B0,B1);
+  if (step==1)
+  {
+   _mm_storeu_si128((__m128i *)(r+x),R);
+   _mm_storeu_si128((__m128i *)(g+x),G);
+   _mm_storeu_si128((__m128i *)(b+x),B);
+  }
+  else
+  {
+   rg=_mm_unpacklo_epi8(R,G);
+   b0=_mm_unpacklo_epi8(B,z);
+   storeRGB4SSE2(r+(3*x),_mm_unpacklo_epi16(rg,b0));
+   storeRGB4SSE2(r+(3*x)+12,_mm_unpackhi_epi16(rg,b0));
+   rg=_mm_unpackhi_epi8(R,G);
+   b0=_mm_unpackhi_epi8(B,z);
+   storeRGB4SSE2(r+(3*x)+24,_mm_unpacklo_epi16(rg,b0));
+   storeRGB4SSE2(r+(3*x)+36,_mm_unpackhi_epi16(rg,b0));
+  }
+ }
+ return(x);
+}
+#endif
+
+#ifdef HAVE_AVX2_TARGET
+__attribute__((target("avx2"))) static int yuyvRowAVX2(unsigned char *src, int sx, unsigned char *r, unsigned char *g, unsigned char *b, int step)
+{
+ // Same arithmetic as yuyvPix8SSE2() on 16 pixels at a time, with
+ // pshufb to interleave the output. Returns the number of pixels converted.
+ __m256i p,y,c,u,v,t,R16,G16,B16;
+ __m128i R,G,B;
+ int x;
+
+ for (x=0;x+16<=sx;x+=16)
+ {
+  p=_mm256_loadu_si256((const __m256i *)(src+(2*x)));
+  y=_mm256_and_si256(p,_mm256_set1_epi16(0x00FF));
+  c=_mm256_sub_epi16(_mm256_srli_epi16(p,8),_mm256_set1_epi16(128));
+  u=_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c,_MM_SHUFFLE(2,2,0,0)),_MM_SHUFFLE(2,2,0,0));
+  v=_mm256_shufflehi_epi16(_mm256_shufflelo_epi16(c,_MM_SHUFFLE(3,3,1,1)),_MM_SHUFFLE(3,3,1,1));
+  R16=_mm256_add_epi16(_mm256_add_epi16(y,v),_mm256_srai_epi16(_mm256_mullo_epi16(v,_mm256_set1_epi16(103)),8));
+  t=_mm256_add_epi16(_mm256_mullo_epi16(u,_mm256_set1_epi16(-88)),_mm256_mullo_epi16(v,_mm256_set1_epi16(73)));
+  G16=_mm256_add_epi16(_mm256_sub_epi16(y,v),_mm256_srai_epi16(t,8));
+  B16=_mm256_add_epi16(_mm256_add_epi16(y,u),_mm256_srai_epi16(_mm256_mullo_epi16(u,_mm256_set1_epi16(198)),8));
+  R=_mm_packus_epi16(_mm256_castsi256_si128(R16),_mm256_extracti128_si256(R16,1));
+  G=_mm_packus_epi16(_mm256_castsi256_si128(G16),_mm256_extracti128_si256(G16,1));
+  B=_mm_packus_epi16(_mm256_castsi256_si128(B16),_mm256_extracti128_si256(B16,1));
+  if (step==1)
+  {
+   _mm_storeu_si128((__m128i *)(r+x),R);
+   _mm_storeu_si128((__m128i *)(g+x),G);
+   _mm_storeu_si128((__m128i *)(b+x),B);
+  }
+  else
+  {
+   // Output byte i of each 16 byte block comes from byte (i/3)+k of
+   // channel i%3, -1 entries give 0 and are filled by the other channels
+   const char X=-1;
+   _mm_storeu_si128((__m128i *)(r+(3*x)),_mm_or_si128(_mm_or_si128(
+    _mm_shuffle_epi8(R,_mm_setr_epi8(0,X,X,1,X,X,2,X,X,3,X,X,4,X,X,5)),
+    _mm_shuffle_epi8(G,_mm_setr_epi8(X,0,X,X,1,X,X,2,X,X,3,X,X,4,X,X))),
+    _mm_shuffle_epi8(B,_mm_setr_epi8(X,X,0,X,X,1,X,X,2,X,X,3,X,X,4,X))));
+   _mm_storeu_si128((__m128i *)(r+(3*x)+16),_mm_or_si128(_mm_or_si128(
+    _mm_shuffle_epi8(R,_mm_setr_epi8(X,X,6,X,X,7,X,X,8,X,X,9,X,X,10,X)),
+    _mm_shuffle_epi8(G,_mm_setr_epi8(5,X,X,6,X,X,7,X,X,8,X,X,9,X,X,10))),
+    _mm_shuffle_epi8(B,_mm_setr_epi8(X,5,X,X,6,X,X,7,X,X,8,X,X,9,X,X))));
+   _mm_storeu_si128((__m128i *)(r+(3*x)+32),_mm_or_si128(_mm_or_si128(
+    _mm_shuffle_epi8(R,_mm_setr_epi8(X,11,X,X,12,X,X,13,X,X,14,X,X,15,X,X)),
+    _mm_shuffle_epi8(G,_mm_setr_epi8(X,X,11,X,X,12,X,X,13,X,X,14,X,X,15,X))),
+    _mm_shuffle_epi8(B,_mm_setr_epi8(10,X,X,11,X,X,12,X,X,13,X,X,14,X,X,15))));
+  }
+ }
+ return(x);
+}
+#endif
+
+int yuyvISA(int isa)
+{
+ // Select the YUYV converter. isa is YUYV_SCALAR, YUYV_SSE2, YUYV_AVX2,
+ // or -1 for the best one this CPU supports. Requests for a version
+ // that is not built in or not supported fall back to the next best.
+ // Returns the converter now in use.
+ int best;
+
+ best=YUYV_SCALAR;
+#ifdef __SSE2__
+ best=YUYV_SSE2;
+#endif
+#ifdef HAVE_AVX2_TARGET
+ __builtin_cpu_init();
+ if (__builtin_cpu_supports("avx2")) best=YUYV_AVX2;
+#endif
+ yuyvSelected=(isa<0||isa>best)?best:isa;
+ return(yuyvSelected);
+}
+
+int yuyvToRGB(unsigned char *yuyv, int sx, int sy, unsigned char *dst, int layout)
+{
+ // Convert a YUYV (4:2:2) frame of size sx*sy into dst, which must
+ // hold sx*sy*3 bytes. With IM_INTERLEAVED the output is packed RGB
+ // (as a frame buffer), with IM_PLANAR it is the R plane followed by
+ // the G and B planes. sx must be even.
+ // Returns 0, or -1 if the arguments are not valid.
+ int j;
+
+ if (yuyv==NULL||dst==NULL||sx<2||(sx&1)||sy<1||(layout!=IM_PLANAR&&layout!=IM_INTERLEAVED))
+ {
+  fprintf(stderr,"yuyvToRGB(): Invalid input\n");
+  return(-1);
+ }
+ if (yuyvSelected<0) yuyvISA(-1);
+
+#pragma omp parallel for schedule(dynamic,32) private(j)
+ for (j=0;j<sy;j++)
+ {
+  unsigned char *src,*r,*g,*b;
+  int x,step;
+
+  src=yuyv+(j*sx*2);
+  if (layout==IM_INTERLEAVED)
+  {
+   r=dst+(j*sx*3);
+   g=r+1;
+   b=r+2;
+   step=3;
+  }
+  else
+  {
+   r=dst+(j*sx);
+   g=r+(sx*sy);
+   b=g+(sx*sy);
+   step=1;
+  }
+  x=0;
+#ifdef HAVE_AVX2_TARGET
+  if (yuyvSelected==YUYV_AVX2) x=yuyvRowAVX2(src,sx,r,g,b,step);
+#endif
+#ifdef __SSE2__
+  if (yuyvSelected==YUYV_SSE2) x=yuyvRowSSE2(src,sx,r,g,b,step);
+#endif
+  yuyvRowScalar(src,x,sx,r,g,b,step);
+ }
+ return(0);
+}
+
 //////////////////////////////////////////////////////////////////////////
 // Image I/O functions
 //////////////////////////////////////////////////////////////////////////
@@ -19,9 +19,11 @@
 // This module provides:
 //
 // Image storage data structures
+// Typed (uint8/int16/float, planar/interleaved) images and views
 // Pyramid data structures
 // .ppm reading/writing
 // Simple filtering (separable kernels)
+// Bit-packed binary masks and morphology
 // Feature maps: Contrast, Saturation, well-exposedness
 //
 ////////////////////////////////////////////////////////////////
@@ -57,6 +59,46 @@ struct pyramid{
  int levels;
 };
 
+// Typed image data structure. Same idea as struct image, but the
+// elements can be stored as uint8, int16, or float, either one layer
+// after another (planar) or with the layers of each pixel together
+// (interleaved, as in a frame buffer). Rows may be padded (stride),
+// and an image may be a view on memory it does not own (e.g. a frame
+// buffer, or a rectangle inside another image).
+//
+// Element (x,y) of layer ly is at (in elements, from data):
+//  planar:      (ly*plane) + (y*stride) + x
+//  interleaved: (y*stride) + (x*nlayers) + ly
+#define IM_U8 0
+#define IM_S16 1
+#define IM_F32 2
+#define IM_PLANAR 0
+#define IM_INTERLEAVED 1
+
+struct timage{
+ void *data;
+ int type;		// IM_U8, IM_S16, or IM_F32
+ int layout;		// IM_PLANAR or IM_INTERLEAVED
+ int sx,sy;
+ int nlayers;
+ int stride;		// Elements from one row to the next
+ int plane;		// Elements from one layer to the next (planar only)
+ int owner;		// 1 if data is released by deleteTImage()
+};
+
+// Pyramid of typed images
+struct tpyramid{
+ struct timage **images;
+ int levels;
+};
+
+// Binary masks are stored one bit per pixel, in rows of MASK_WORDS(sx)
+// 64-bit words. Pixel (x,y) is bit (x&63) of word (y*MASK_WORDS(sx))+(x>>6).
+#define MASK_WORDS(sx) (((sx)+63)>>6)
+// Scratch space (in words) the morphology functions need for an sx x sy
+// mask. Passing it in as work means they do not allocate.
+#define MASK_WORK(sx,sy) (3*MASK_WORDS(sx)*(sy))
+
 // Simple filter kernel structure. Contains a pointer to a
 // 1D filter's entries, and the size and half-size of
 // the kernel. Kernels are always odd length, and the
@@ -76,6 +118,14 @@ struct kernel *doGKernel(double sigma);					// Create a derivative of Gaussian k
 void deleteKernel(struct kernel *k);					// Free memory allocated to a kernel
 struct image *convolve_x(struct image *im, struct kernel *k);		// Filter image along the x direction
 struct image *convolve_y(struct image *im, struct kernel *k);		// Filter image along the y direction
+int convolve_sep(struct image *im, struct kernel *kx, struct kernel *ky, struct image *dst);	// Filter along x then y, into dst
+
+// Bit-packed binary masks
+void maskFromBuffer(unsigned char *buf, int sx, int sy, int nlayers, unsigned long long *mask);	// Mask of non-zero pixels
+int maskDilate(unsigned long long *src, unsigned long long *dst, int sx, int sy, int r, unsigned long long *work);	// Dilate with a (2r+1)^2 square
+int maskErode(unsigned long long *src, unsigned long long *dst, int sx, int sy, int r, unsigned long long *work);	// Erode with a (2r+1)^2 square
+int maskOpen(unsigned long long *mask, int sx, int sy, int r, unsigned long long *work);			// Opening, in place
+int maskClose(unsigned long long *mask, int sx, int sy, int r, unsigned long long *work);			// Closing, in place
 
 // Image feature computations
 struct image *gradient(struct image *im, double sigma);				// Compute the derivatives Ix and Iy using
@@ -121,6 +171,42 @@ struct pyramid *weightedPyr(struct pyramid *lPyr, struct pyramid *gPyr);	// Inpu
 struct image *collapsePyr(struct pyramid *pyr);			// Collapse pyramid
 void deletePyramid(struct pyramid *pyr);			// De-allocate pyramid data
 
+// Typed images - these mirror the double-precision functions above.
+// Filtering is done in single precision, and results are rounded and
+// clamped to the range of the output type.
+struct timage *newTImage(int sx, int sy, int nlayers, int type, int layout);	// New (all zeroes) typed image
+struct timage *viewTImage(void *data, int sx, int sy, int nlayers, int type, int layout, int stride);
+										// Non-owning view on existing data
+struct timage *subTImage(struct timage *im, int x, int y, int sx, int sy);	// View on a rectangle within im
+void deleteTImage(struct timage *im);						// Free a typed image (data only if owned)
+struct timage *copyTImage(struct timage *im, int type, int layout);		// Copy with type/layout conversion
+struct timage *timageFromImage(struct image *im, int type, int layout);	// Convert from double image
+struct image *imageFromTImage(struct timage *im);				// Convert to double image
+void getRowTImage(struct timage *im, int ly, int y, float *row);		// Read one row of a layer as float
+void putRowTImage(struct timage *im, int ly, int y, float *row);		// Write one row of a layer from float
+struct timage *tconvolve_x(struct timage *im, struct kernel *k, int type);	// Filter along x, output of given type
+struct timage *tconvolve_y(struct timage *im, struct kernel *k, int type);	// Filter along y, output of given type
+int tconvolve_sep(struct timage *im, struct kernel *kx, struct kernel *ky, struct timage *dst);	// Filter along x then y, into dst
+struct timage *tresize(struct timage *im, int sx, int sy);			// Resize with bilinear interp.
+void tpointwise_add(struct timage *im1, struct timage *im2);			// im1=im1+im2
+void tpointwise_sub(struct timage *im1, struct timage *im2);			// im1=im1-im2
+void tpointwise_mul(struct timage *im1, struct timage *im2);			// im1=im1.*im2
+void tpointwise_div(struct timage *im1, struct timage *im2);			// im1=im1./im2
+void tpointwise_pow(struct timage *im1, double p);				// im1=im1.^p
+void timage_scale(struct timage *im, double k);				// Multiply image by k
+struct tpyramid *tLaplacianPyr(struct timage *im, int levels);			// Laplacian pyramid (int16 levels for uint8 input)
+struct tpyramid *tGaussianPyr(struct timage *im, int levels);			// Gaussian pyramid
+struct tpyramid *tweightedPyr(struct tpyramid *lPyr, struct tpyramid *gPyr);	// Weighted Laplacian pyramid
+struct timage *tcollapsePyr(struct tpyramid *pyr);				// Collapse pyramid
+void deleteTPyramid(struct tpyramid *pyr);					// De-allocate pyramid data
+
+// Pixel format conversion
+#define YUYV_SCALAR 0
+#define YUYV_SSE2 1
+#define YUYV_AVX2 2
+int yuyvToRGB(unsigned char *yuyv, int sx, int sy, unsigned char *dst, int layout);	// YUYV frame to RGB, into dst
+int yuyvISA(int isa);								// Select the YUYV converter (-1 = best)
+
 // Image I/O  functions
 struct image *readPPM(const char *name);		// Read a PPM image from file
 int writePPM(const char *name, struct image *im);	// Write PPM image to file
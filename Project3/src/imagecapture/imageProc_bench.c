@@ -0,0 +1,458 @@
+/////////////////////////////////////////////////////////////////////////
+// Micro-benchmarks for the imageProc kernels
+//
+// Runs each kernel at the resolutions used by the robo-soccer pipeline
+// (1280x720 camera frames and the 1024x768 rectified field), for 1 and
+// 3 layer images, at each of the requested thread counts. For every
+// combination it reports the median and minimum time over a number of
+// repetitions (after warm-up runs), ns per pixel, and the effective
+// memory bandwidth, and writes the same numbers to a CSV file so runs
+// before and after a change can be compared.
+//
+// Bandwidth is computed from a nominal number of bytes each kernel
+// reads and writes per pixel and layer (see the kernel table below),
+// so it is meant for comparing runs of the same kernel, not as an
+// exact measure of memory traffic.
+//
+// Kernels that work in place run on a copy of the input images, which
+// is restored before every run (outside the timed region), so neither
+// they nor the kernels after them see data drifting towards denormals,
+// inf, or NaN over the repetitions.
+//
+// Before timing anything, the YUYV to RGB converters built into this
+// binary (and supported by the CPU) are checked against the scalar
+// formula for every y,u,v combination, in both output layouts. Any
+// difference is reported and the benchmark exits with an error.
+//
+// The blob labeler is also checked: a red patch above a blue one, with
+// a gap between them small enough for the mask closing to fill, must
+// come out as two blobs, one of each colour. If not, the benchmark
+// exits with an error.
+//
+// Build with compile_bench.sh, which links in the image capture code
+// for the blob labeler. Thread counts other than 1 need OpenMP.
+//
+// Usage: imageProc_bench [-w warmup] [-r reps] [-t threads,...] [-k kernel] [-o out.csv]
+/////////////////////////////////////////////////////////////////////////
+
+#include "imageCapture.h"
+#include "../roboAI.h"
+#include <string.h>
+#include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#define MAX_THREADS 16
+
+extern struct frameArena frameMem;	// Scratch memory used by blobDetect2(), see imageCapture.c
+
+int setupAI(int mode, int own_col, struct RoboAI *ai)
+{
+ // The bench never starts the AI, this stands in for roboAI.c so it
+ // does not have to be linked in.
+ return(0);
+}
+
+// Inputs and outputs for one benchmark configuration
+struct benchData{
+ struct image *im, *im2;		// Input images (double)
+ struct image *work;			// Copy of im for the in-place kernels, restored before each run
+ struct image *out;			// Output image, released after timing
+ struct image *dst;			// Preallocated output for convolve_sep()
+ struct pyramid *pyr, *pyrOut;		// Input/output pyramids
+ struct timage *tim, *tim2, *tout;	// Typed inputs/output
+ struct timage *twork;			// Copy of tim2 for the in-place kernels, restored before each run
+ struct timage *tdst;			// Preallocated output for tconvolve_sep()
+ struct tpyramid *tpyr, *tpyrOut;	// Typed pyramids
+ struct kernel *k;
+ unsigned char *yuyv, *rgb;		// YUYV frame and RGB output for yuyvToRGB()
+};
+
+struct benchKernel{
+ const char *name;
+ int oneLayer;		// 1 if the kernel only works on single-layer images
+ int inPlace;		// 1 if the kernel overwrites its input (it runs on d->work/d->twork)
+ double bytes;		// Nominal bytes read+written per pixel and layer
+ void (*run)(struct benchData *d);
+};
+
+/////////////////////////////////////////////////////////////////////////
+// Kernel wrappers - outputs are left in d and released by benchRelease()
+/////////////////////////////////////////////////////////////////////////
+static void b_convolve_x(struct benchData *d) {d->out=convolve_x(d->im,d->k);}
+static void b_convolve_y(struct benchData *d) {d->out=convolve_y(d->im,d->k);}
+static void b_convolve_sep(struct benchData *d) {convolve_sep(d->im,d->k,d->k,d->dst);}
+static void b_gradient(struct benchData *d) {d->out=gradient(d->im,1.0);}
+static void b_nonMax(struct benchData *d)
+{
+ // Works on a gradient map, which is rebuilt for each run since
+ // nonMaxSuppression() modifies it in place
+ nonMaxSuppression(d->out);
+}
+static void b_resize(struct benchData *d) {d->out=resize(d->im,d->im->sx/2,d->im->sy/2);}
+static void b_add(struct benchData *d) {pointwise_add(d->work,d->im2);}
+static void b_sub(struct benchData *d) {pointwise_sub(d->work,d->im2);}
+static void b_mul(struct benchData *d) {pointwise_mul(d->work,d->im2);}
+static void b_div(struct benchData *d) {pointwise_div(d->work,d->im2);}
+static void b_pow(struct benchData *d) {pointwise_pow(d->work,1.0);}
+static void b_scale(struct benchData *d) {image_scale(d->work,1.0);}
+static void b_gaussPyr(struct benchData *d) {d->pyrOut=GaussianPyr(d->im,4);}
+static void b_lapPyr(struct benchData *d) {d->pyrOut=LaplacianPyr(d->im,4);}
+static void b_collapse(struct benchData *d) {d->out=collapsePyr(d->pyr);}
+static void b_tconvolve_x(struct benchData *d) {d->tout=tconvolve_x(d->tim,d->k,IM_F32);}
+static void b_tconvolve_y(struct benchData *d) {d->tout=tconvolve_y(d->tim2,d->k,IM_F32);}
+static void b_tconvolve_sep(struct benchData *d) {tconvolve_sep(d->tim,d->k,d->k,d->tdst);}
+static void b_tresize(struct benchData *d) {d->tout=tresize(d->tim2,d->tim2->sx/2,d->tim2->sy/2);}
+static void b_tadd(struct benchData *d) {tpointwise_add(d->twork,d->tim2);}
+static void b_tlapPyr(struct benchData *d) {d->tpyrOut=tLaplacianPyr(d->tim,4);}
+static void b_tcollapse(struct benchData *d) {d->tout=tcollapsePyr(d->tpyr);}
+static void b_yuyv(struct benchData *d) {yuyvToRGB(d->yuyv,d->im->sx,d->im->sy,d->rgb,IM_INTERLEAVED);}
+static void b_yuyvPlanar(struct benchData *d) {yuyvToRGB(d->yuyv,d->im->sx,d->im->sy,d->rgb,IM_PLANAR);}
+
+static struct benchKernel kernels[]={
+ {"convolve_x",0,0,16,b_convolve_x},
+ {"convolve_y",0,0,16,b_convolve_y},
+ {"convolve_sep",0,0,16,b_convolve_sep},		// x and y passes
+ {"gradient",1,0,168,b_gradient},
+ {"nonMaxSuppression",1,0,32,b_nonMax},
+ {"resize",0,0,10,b_resize},
+ {"pointwise_add",0,1,24,b_add},
+ {"pointwise_sub",0,1,24,b_sub},
+ {"pointwise_mul",0,1,24,b_mul},
+ {"pointwise_div",0,1,24,b_div},
+ {"pointwise_pow",0,1,16,b_pow},
+ {"image_scale",0,1,16,b_scale},
+ {"GaussianPyr",0,0,56,b_gaussPyr},
+ {"LaplacianPyr",0,0,110,b_lapPyr},
+ {"collapsePyr",0,0,53,b_collapse},
+ {"tconvolve_x_u8",0,0,5,b_tconvolve_x},		// U8 interleaved -> F32
+ {"tconvolve_y_f32",0,0,8,b_tconvolve_y},		// F32 interleaved -> F32
+ {"tconvolve_sep_u8",0,0,5,b_tconvolve_sep},		// U8 interleaved -> F32, x and y passes
+ {"tresize_f32",0,0,5,b_tresize},
+ {"tpointwise_add_f32",0,1,12,b_tadd},
+ {"tLaplacianPyr_u8",0,0,20,b_tlapPyr},
+ {"tcollapsePyr",0,0,12,b_tcollapse},
+ {"yuyvToRGB",1,0,5,b_yuyv},				// YUYV -> interleaved RGB
+ {"yuyvToRGB_planar",1,0,5,b_yuyvPlanar},		// YUYV -> planar RGB
+};
+
+static double benchClock(void)
+{
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC,&t);
+ return((t.tv_sec*1000.0)+(t.tv_nsec/1000000.0));
+}
+
+static void benchRelease(struct benchData *d)
+{
+ // Release kernel outputs
+ if (d->out) deleteImage(d->out);
+ if (d->pyrOut) deletePyramid(d->pyrOut);
+ if (d->tout) deleteTImage(d->tout);
+ if (d->tpyrOut) deleteTPyramid(d->tpyrOut);
+ d->out=NULL;
+ d->pyrOut=NULL;
+ d->tout=NULL;
+ d->tpyrOut=NULL;
+}
+
+static void benchRestore(struct benchData *d)
+{
+ // Reset the inputs of the in-place kernels, so every run sees the same data
+ int l;
+
+ for (l=0;l<d->im->nlayers;l++)
+  memcpy(d->work->layers[l],d->im->layers[l],d->im->sx*d->im->sy*sizeof(double));
+ memcpy(d->twork->data,d->tim2->data,d->tim2->sy*d->tim2->stride*sizeof(float));
+}
+
+static int cmpDouble(const void *a, const void *b)
+{
+ double x=*(const double *)a, y=*(const double *)b;
+ return((x>y)-(x<y));
+}
+
+static void benchSetup(struct benchData *d, int sx, int sy, int layers)
+{
+ // Test images with values in [.1,1.1] (so pointwise_div is well behaved)
+ int i,l;
+ unsigned char *buf;
+
+ memset(d,0,sizeof(struct benchData));
+ d->im=newImage(sx,sy,layers);
+ d->im2=newImage(sx,sy,layers);
+ srand(1);
+ for (l=0;l<layers;l++)
+  for (i=0;i<sx*sy;i++)
+  {
+   *(d->im->layers[l]+i)=.1+((rand()%1000)/1000.0);
+   *(d->im2->layers[l]+i)=.1+((rand()%1000)/1000.0);
+  }
+ d->dst=newImage(sx,sy,layers);
+ d->work=copyImage(d->im);
+ d->k=GaussKernel(2);
+ d->pyr=LaplacianPyr(d->im,4);
+
+ buf=(unsigned char *)calloc(sx*sy*layers,sizeof(unsigned char));
+ for (i=0;i<sx*sy*layers;i++) *(buf+i)=(unsigned char)(rand()%256);
+ d->tim=newTImage(sx,sy,layers,IM_U8,IM_INTERLEAVED);
+ memcpy(d->tim->data,buf,sx*sy*layers);
+ free(buf);
+ d->tim2=copyTImage(d->tim,IM_F32,IM_INTERLEAVED);
+ d->twork=copyTImage(d->tim2,IM_F32,IM_INTERLEAVED);
+ d->tdst=newTImage(sx,sy,layers,IM_F32,IM_INTERLEAVED);
+ d->tpyr=tLaplacianPyr(d->tim,4);
+
+ d->yuyv=(unsigned char *)malloc(sx*sy*2);
+ d->rgb=(unsigned char *)malloc(sx*sy*3);
+ for (i=0;i<sx*sy*2;i++) *(d->yuyv+i)=(unsigned char)(rand()%256);
+}
+
+static void benchCleanup(struct benchData *d)
+{
+ benchRelease(d);
+ deleteImage(d->im);
+ deleteImage(d->im2);
+ deleteImage(d->dst);
+ deleteImage(d->work);
+ deletePyramid(d->pyr);
+ deleteKernel(d->k);
+ deleteTImage(d->tim);
+ deleteTImage(d->tim2);
+ deleteTImage(d->twork);
+ deleteTImage(d->tdst);
+ deleteTPyramid(d->tpyr);
+ free(d->yuyv);
+ free(d->rgb);
+}
+
+static int yuyvCheck(void)
+{
+ // Compare each available YUYV converter with the scalar formula.
+ // The test frame is 256x65536: row u*256+v holds y=0..255 with that
+ // u,v, so every combination is covered. A second, narrower frame
+ // with random data exercises the tails of rows that are not a
+ // multiple of the SIMD width. Returns the number of mismatches.
+ static const char *names[3]={"scalar","SSE2","AVX2"};
+ int sizes[2][2]={{256,65536},{254,99}};
+ int s,i,x,j,isa,best,lay,bad,t;
+ int y,u,v,ref[3];
+ unsigned char *yuyv,*out,*px;
+
+ bad=0;
+ best=yuyvISA(-1);
+ for (s=0;s<2;s++)
+ {
+  yuyv=(unsigned char *)malloc(sizes[s][0]*sizes[s][1]*2);
+  out=(unsigned char *)malloc(sizes[s][0]*sizes[s][1]*3);
+  for (j=0;j<sizes[s][1];j++)
+   for (x=0;x<sizes[s][0];x+=2)
+   {
+    px=yuyv+(((j*sizes[s][0])+x)*2);
+    if (s==0) {*px=x; *(px+1)=j>>8; *(px+2)=x+1; *(px+3)=j&255;}
+    else for (i=0;i<4;i++) *(px+i)=(unsigned char)(rand()%256);
+   }
+  for (isa=YUYV_SCALAR;isa<=best;isa++)
+   for (lay=0;lay<2;lay++)
+   {
+    yuyvISA(isa);
+    memset(out,0,sizes[s][0]*sizes[s][1]*3);
+    yuyvToRGB(yuyv,sizes[s][0],sizes[s][1],out,(lay==0)?IM_INTERLEAVED:IM_PLANAR);
+    for (j=0;j<sizes[s][1];j++)
+     for (x=0;x<sizes[s][0];x++)
+     {
+      px=yuyv+(((j*sizes[s][0])+(x&~1))*2);
+      y=*(px+((x&1)*2))<<8;
+      u=*(px+1)-128;
+      v=*(px+3)-128;
+      ref[0]=(y+(359*v))>>8;
+      ref[1]=(y-(88*u)-(183*v))>>8;
+      ref[2]=(y+(454*u))>>8;
+      for (i=0;i<3;i++)
+      {
+       ref[i]=(ref[i]>255)?255:((ref[i]<0)?0:ref[i]);
+       if (lay==0) t=*(out+(((j*sizes[s][0])+x)*3)+i);
+       else t=*(out+(i*sizes[s][0]*sizes[s][1])+(j*sizes[s][0])+x);
+       if (t!=ref[i])
+       {
+        if (bad<10) fprintf(stderr,"yuyvToRGB (%s, %s) at %d,%d: %d, expected %d\n",names[isa],\
+                            (lay==0)?"interleaved":"planar",x,j,t,ref[i]);
+        bad++;
+       }
+      }
+     }
+   }
+  free(yuyv);
+  free(out);
+ }
+ yuyvISA(-1);
+ if (bad==0) fprintf(stdout,"yuyvToRGB: %s and lower match the scalar formula\n",names[best]);
+ else fprintf(stderr,"yuyvToRGB: %d mismatches\n",bad);
+ return(bad);
+}
+
+static void benchYUV(int R, int G, int B, unsigned char *yuv)
+{
+ // RGB to the YUV layout blobDetect2() reads, as rgbToYUV() in imageCapture.c
+ int y,u,v;
+
+ y=((77*R)+(150*G)+(29*B)+128)>>8;
+ u=((((B-y)*144)+128)>>8)+128;
+ v=((((R-y)*183)+128)>>8)+128;
+ *(yuv+0)=y;
+ *(yuv+1)=(u>255)?255:((u<0)?0:u);
+ *(yuv+2)=(v>255)?255:((v<0)?0:v);
+}
+
+static int labelCheck(void)
+{
+ // A red patch above a blue one on a 1024x768 field, with a gap of 1
+ // to 2*MASK_CLOSE_R rows between them (which the mask closing fills
+ // in), must be labeled as two blobs, each with its own colour.
+ // Returns the number of gaps for which it is not.
+ unsigned char *fg;
+ unsigned char red[3],blue[3];
+ struct blob *bl,*p;
+ int gap,i,j,n,nb,nred,nblue,bad;
+
+ fg=(unsigned char *)calloc(1024*768*3,sizeof(unsigned char));
+ if (fg==NULL)
+ {
+  fprintf(stderr,"labelCheck(): Out of memory!\n");
+  return(1);
+ }
+ benchYUV(255,0,0,&red[0]);
+ benchYUV(0,0,255,&blue[0]);
+ bad=0;
+ for (gap=1;gap<=2*MASK_CLOSE_R;gap++)
+ {
+  memset(fg,0,1024*768*3*sizeof(unsigned char));
+  for (j=300;j<340;j++)
+   for (i=400;i<500;i++) memcpy(fg+((i+(j*1024))*3),&red[0],3);
+  for (j=340+gap;j<380+gap;j++)
+   for (i=400;i<500;i++) memcpy(fg+((i+(j*1024))*3),&blue[0],3);
+  bl=NULL;
+  nb=0;
+  arenaReset(&frameMem);
+  blobDetect2(fg,NULL,1024,768,&bl,&nb);
+  n=nred=nblue=0;
+  for (p=bl;p!=NULL;p=p->next)
+  {
+   n++;
+   if (p->R>200&&p->B<50) nred++;
+   if (p->B>200&&p->R<50) nblue++;
+  }
+  if (n!=2||nred!=1||nblue!=1)
+  {
+   fprintf(stderr,"blobDetect2: red and blue patches %d rows apart give %d blobs (%d red, %d blue)\n",gap,n,nred,nblue);
+   bad++;
+  }
+  releaseBlobs(bl);
+ }
+ arenaReset(&frameMem);
+ free(fg);
+ if (bad==0) fprintf(stdout,"blobDetect2: patches of different colours stay apart\n");
+ return(bad);
+}
+
+int main(int argc, char *argv[])
+{
+ int sizes[2][2]={{1280,720},{1024,768}};
+ int threads[MAX_THREADS];
+ int nthreads,warmup,reps;
+ int s,ly,t,k,r,nk,layers;
+ double *times,t0,med,mn,nspp,gbs;
+ const char *outName;
+ char *only, *p;
+ struct benchData d;
+ FILE *f;
+
+ warmup=2;
+ reps=10;
+ outName="imageProc_bench.csv";
+ only=NULL;
+ nthreads=1;
+ threads[0]=1;
+#ifdef _OPENMP
+ if (omp_get_max_threads()>1) threads[nthreads++]=omp_get_max_threads();
+#endif
+
+ for (k=1;k<argc;k++)
+ {
+  if (!strcmp(argv[k],"-w")&&k+1<argc) warmup=atoi(argv[++k]);
+  else if (!strcmp(argv[k],"-r")&&k+1<argc) reps=atoi(argv[++k]);
+  else if (!strcmp(argv[k],"-o")&&k+1<argc) outName=argv[++k];
+  else if (!strcmp(argv[k],"-k")&&k+1<argc) only=argv[++k];
+  else if (!strcmp(argv[k],"-t")&&k+1<argc)
+  {
+   nthreads=0;
+   for (p=strtok(argv[++k],",");p!=NULL&&nthreads<MAX_THREADS;p=strtok(NULL,","))
+    if (atoi(p)>0) threads[nthreads++]=atoi(p);
+  }
+  else
+  {
+   fprintf(stderr,"USAGE: imageProc_bench [-w warmup] [-r reps] [-t threads,...] [-k kernel] [-o out.csv]\n");
+   return(1);
+  }
+ }
+ if (reps<1) reps=1;
+ if (nthreads==0) {threads[0]=1; nthreads=1;}
+ if (yuyvCheck()!=0||labelCheck()!=0) return(1);
+#ifndef _OPENMP
+ if (nthreads>1||threads[0]!=1)
+  fprintf(stderr,"Built without OpenMP, all kernels run on 1 thread\n");
+#endif
+
+ f=fopen(outName,"w");
+ if (f==NULL)
+ {
+  fprintf(stderr,"Unable to open %s for writing\n",outName);
+  return(1);
+ }
+ fprintf(f,"kernel,sx,sy,layers,threads,reps,median_ms,min_ms,ns_per_pixel,gb_per_s\n");
+ fprintf(stdout,"%-20s %9s %6s %7s %10s %10s %8s %8s\n","kernel","size","layers","threads","median ms","min ms","ns/px","GB/s");
+
+ times=(double *)calloc(reps,sizeof(double));
+ nk=sizeof(kernels)/sizeof(struct benchKernel);
+ for (s=0;s<2;s++)
+  for (ly=0;ly<2;ly++)
+  {
+   layers=(ly==0)?1:3;
+   benchSetup(&d,sizes[s][0],sizes[s][1],layers);
+   for (k=0;k<nk;k++)
+   {
+    if (only!=NULL&&strcmp(only,kernels[k].name)) continue;
+    if (kernels[k].oneLayer&&layers!=1) continue;
+    for (t=0;t<nthreads;t++)
+    {
+#ifdef _OPENMP
+     omp_set_num_threads(threads[t]);
+#endif
+     for (r=-warmup;r<reps;r++)
+     {
+      if (kernels[k].run==b_nonMax) d.out=gradient(d.im,1.0);
+      if (kernels[k].inPlace) benchRestore(&d);
+      t0=benchClock();
+      kernels[k].run(&d);
+      if (r>=0) *(times+r)=benchClock()-t0;
+      benchRelease(&d);
+     }
+     qsort(times,reps,sizeof(double),cmpDouble);
+     med=*(times+(reps/2));
+     mn=*(times);
+     nspp=(med*1000000.0)/(sizes[s][0]*sizes[s][1]);
+     gbs=(kernels[k].bytes*sizes[s][0]*sizes[s][1]*layers)/(med*1000000.0);
+     fprintf(stdout,"%-20s %4dx%-4d %6d %7d %10.3f %10.3f %8.3f %8.2f\n",kernels[k].name,sizes[s][0],sizes[s][1],\
+             layers,threads[t],med,mn,nspp,gbs);
+     fprintf(f,"%s,%d,%d,%d,%d,%d,%f,%f,%f,%f\n",kernels[k].name,sizes[s][0],sizes[s][1],layers,threads[t],\
+             reps,med,mn,nspp,gbs);
+     fflush(stdout);
+    }
+   }
+   benchCleanup(&d);
+  }
+ free(times);
+ fclose(f);
+ return(0);
+}
@@ -33,6 +33,14 @@
 #include <time.h>
 #include <limits.h>
 #include "huffman.h"
+#include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 #define ISHIFT 11
 
@@ -46,12 +54,6 @@
 #define M_BADHUFF	-1
 #define M_EOF		0x80
 
-struct jpeg_decdata {
-    int dcts[6 * 64 + 16];
-    int out[64 * 6];
-    int dquant[3][64];
-};
-
 struct in {
     unsigned char *p;
     unsigned int bits;
@@ -92,7 +94,8 @@ struct dec_hufftbl {
     unsigned char vals[256];
     unsigned int llvals[1 << DECBITS];
 };
-static int huffman_init(void);
+struct jpeg_decoder;
+static int huffman_init(struct jpeg_decoder *dec);
 static void decode_mcus
 __P((struct in *, int *, int, struct scan *, int *));
 static int dec_readmarker __P((struct in *));
@@ -108,6 +111,12 @@ static void setinput __P((struct in *, unsigned char *));
 static void idctqtab __P((unsigned char *, PREC *));
 
 inline static void idct(int *in, int *out, int *quant, long off, int max);
+static void quanttabs(unsigned char *qin, float *fq, float *rq);
+#ifdef __SSE2__
+static void idct_sse(int *in, int *out, float *fq, float off, int max);
+#endif
+inline static void idct_reduced(int *in, int *out, float *rq, float off, int max, int n, float *rc);
+static void mcuToYUYV(int *out, unsigned char *pic, int pitch, int hs, int vs, int n, int gray);
 
 int is_huffman(unsigned char *buf);
 
@@ -131,21 +140,6 @@ typedef void (*ftopict) ( int *out, unsigned char *pic, int width) ;
 #define M_EOI	0xd9
 #define M_COM	0xfe
 
-static unsigned char *datap;
-
-static int getbyte(void)
-{
-    return *datap++;
-}
-
-static int getword(void)
-{
-    int c1, c2;
-    c1 = *datap++;
-    c2 = *datap++;
-    return c1 << 8 | c2;
-}
-
 struct comp {
     int cid;
     int hv;
@@ -161,29 +155,49 @@ struct jpginfo {
     int rm;			/* next restart marker */
 };
 
-static struct jpginfo info;
-static struct comp comps[MAXCOMP];
-
-static struct scan dscans[MAXCOMP];
-
-static unsigned char quant[4][64];
+/* All the state of a decode lives here, so decoders on different threads
+ * don't interfere (see jpeg_decoder_new()). */
+struct jpeg_decoder {
+    struct jpginfo info;
+    struct comp comps[MAXCOMP];
+    struct scan dscans[MAXCOMP];
+    unsigned char quant[4][64];
+    struct dec_hufftbl dhuff[4];
+    struct in in;
+    unsigned char *datap;
+    int dcts[6 * 64 + 16];
+    int out[64 * 6];
+    int dquant[3][64];		/* scalar idct() tables */
+    float fquant[3][64];	/* idct_sse() tables: AAN scaled, natural order */
+    float rquant[3][64];	/* idct_reduced() tables: natural order */
+    float rcos[2][16];		/* idct_reduced() bases, 4 and 2 outputs */
+};
 
-static struct dec_hufftbl dhuff[4];
+#define dec_huffdc(dec) ((dec)->dhuff + 0)
+#define dec_huffac(dec) ((dec)->dhuff + 2)
 
-#define dec_huffdc (dhuff + 0)
-#define dec_huffac (dhuff + 2)
+static int getbyte(struct jpeg_decoder *dec)
+{
+    return *dec->datap++;
+}
 
-static struct in in;
+static int getword(struct jpeg_decoder *dec)
+{
+    int c1, c2;
+    c1 = *dec->datap++;
+    c2 = *dec->datap++;
+    return c1 << 8 | c2;
+}
 
-static int readtables(int till, int *isDHT)
+static int readtables(struct jpeg_decoder *dec, int till, int *isDHT)
 {
     int m, l, i, j, lq, pq, tq;
     int tc, th, tt;
 
     for (;;) {
-	if (getbyte() != 0xff)
+	if (getbyte(dec) != 0xff)
 	    return -1;
-	if ((m = getbyte()) == till)
+	if ((m = getbyte(dec)) == till)
 	    break;
 
 	switch (m) {
@@ -192,9 +206,9 @@ static int readtables(int till, int *isDHT)
 
 	case M_DQT:
 	//printf("find DQT \n");
-	    lq = getword();
+	    lq = getword(dec);
 	    while (lq > 2) {
-		pq = getbyte();
+		pq = getbyte(dec);
 		tq = pq & 15;
 		if (tq > 3)
 		    return -1;
@@ -202,48 +216,48 @@ static int readtables(int till, int *isDHT)
 		if (pq != 0)
 		    return -1;
 		for (i = 0; i < 64; i++)
-		    quant[tq][i] = getbyte();
+		    dec->quant[tq][i] = getbyte(dec);
 		lq -= 64 + 1;
 	    }
 	    break;
 
 	case M_DHT:
 	//printf("find DHT \n");
-	    l = getword();
+	    l = getword(dec);
 	    while (l > 2) {
 		int hufflen[16], k;
 		unsigned char huffvals[256];
 
-		tc = getbyte();
+		tc = getbyte(dec);
 		th = tc & 15;
 		tc >>= 4;
 		tt = tc * 2 + th;
 		if (tc > 1 || th > 1)
 		    return -1;
 		for (i = 0; i < 16; i++)
-		    hufflen[i] = getbyte();
+		    hufflen[i] = getbyte(dec);
 		l -= 1 + 16;
 		k = 0;
 		for (i = 0; i < 16; i++) {
 		    for (j = 0; j < hufflen[i]; j++)
-			huffvals[k++] = getbyte();
+			huffvals[k++] = getbyte(dec);
 		    l -= hufflen[i];
 		}
-		dec_makehuff(dhuff + tt, hufflen, huffvals);
+		dec_makehuff(dec->dhuff + tt, hufflen, huffvals);
 	    }
 	    *isDHT= 1;
 	    break;
 
 	case M_DRI:
 	printf("find DRI \n");
-	    l = getword();
-	    info.dri = getword();
+	    l = getword(dec);
+	    dec->info.dri = getword(dec);
 	    break;
 
 	default:
-	    l = getword();
+	    l = getword(dec);
 	    while (l-- > 2)
-		getbyte();
+		getbyte(dec);
 	    break;
 	}
     }
@@ -251,91 +265,154 @@ static int readtables(int till, int *isDHT)
     return 0;
 }
 
-static void dec_initscans(void)
+static void dec_initscans(struct jpeg_decoder *dec)
 {
     int i;
 
-    info.nm = info.dri + 1;
-    info.rm = M_RST0;
-    for (i = 0; i < info.ns; i++)
-	dscans[i].dc = 0;
+    dec->info.nm = dec->info.dri + 1;
+    dec->info.rm = M_RST0;
+    for (i = 0; i < dec->info.ns; i++)
+	dec->dscans[i].dc = 0;
 }
 
-static int dec_checkmarker(void)
+static int dec_checkmarker(struct jpeg_decoder *dec)
 {
     int i;
 
-    if (dec_readmarker(&in) != info.rm)
+    if (dec_readmarker(&dec->in) != dec->info.rm)
 	return -1;
-    info.nm = info.dri;
-    info.rm = (info.rm + 1) & ~0x08;
-    for (i = 0; i < info.ns; i++)
-	dscans[i].dc = 0;
+    dec->info.nm = dec->info.dri;
+    dec->info.rm = (dec->info.rm + 1) & ~0x08;
+    for (i = 0; i < dec->info.ns; i++)
+	dec->dscans[i].dc = 0;
     return 0;
 }
 
+struct jpeg_decoder *jpeg_decoder_new(void)
+{
+    /* Allocate a decoder. Each thread decoding frames needs its own. */
+    struct jpeg_decoder *dec;
+    int x, u, s, k;
+    double w;
+
+    dec = (struct jpeg_decoder *) calloc(1, sizeof(struct jpeg_decoder));
+    if (!dec)
+	return NULL;
+    /* Reduced idct bases. Averaging 2 (4) adjacent outputs of the 8 point
+     * idct gives a 4 (2) point idct of the low frequencies, with each
+     * frequency u weighted by cos(u*pi/16) (times cos(u*pi/8)). */
+    for (s = 0; s < 2; s++) {
+	k = 4 >> s;
+	for (x = 0; x < k; x++)
+	    for (u = 0; u < k; u++) {
+		w = (u == 0) ? 0.5 / sqrt(2.0) : 0.5;
+		w *= cos(u * M_PI / 16.0);
+		if (s)
+		    w *= cos(u * M_PI / 8.0);
+		dec->rcos[s][x * k + u] = (float) (w * cos((2 * x + 1) * u * M_PI / (2.0 * k)));
+	    }
+    }
+    return dec;
+}
+
+void jpeg_decoder_free(struct jpeg_decoder *dec)
+{
+    free(dec);
+}
+
+static void dec_idct(struct jpeg_decoder *dec, int *in, int *out, int tq, int luma, int max, int n)
+{
+    /* One block: full size idct, or reduced to n x n outputs for scaled decoding */
+    if (n == 8) {
+#ifdef __SSE2__
+	idct_sse(in, out, dec->fquant[tq], luma ? 128.0f : 0.0f, max);
+#else
+	idct(in, out, dec->dquant[tq], luma ? IFIX(128.5) : IFIX(0.5), max);
+#endif
+    } else if (n == 4)
+	idct_reduced(in, out, dec->rquant[tq], luma ? 128.0f : 0.0f, max, 4, dec->rcos[0]);
+    else
+	idct_reduced(in, out, dec->rquant[tq], luma ? 128.0f : 0.0f, max, 2, dec->rcos[1]);
+}
 
 int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 		int *height)
 {
-    struct jpeg_decdata *decdata;
+    /* Full size decode with a decoder of its own */
+    struct jpeg_decoder *dec;
+    int err;
+
+    dec = jpeg_decoder_new();
+    if (!dec)
+	return -1;
+    err = jpeg_decode_scaled(dec, pic, buf, width, height, 1);
+    jpeg_decoder_free(dec);
+    return err;
+}
+
+int jpeg_decode_scaled(struct jpeg_decoder *dec, unsigned char **pic, unsigned char *buf,
+		       int *width, int *height, int scale)
+{
+    /* Decode the frame in buf into *pic as YUYV at 1/scale size (scale 1, 2
+     * or 4), downscaling in the DCT domain. *pic is reallocated if *width x
+     * *height is not the output size, which is returned in them. */
     int i, j, m, tac, tdc;
     int intwidth, intheight;
     int mcusx, mcusy, mx, my;
     int ypitch ,xpitch,bpp,pitch,x,y;
-    int mb;
+    int mb, ny, hs, vs, n, b;
     int max[6];
     ftopict convert;
     int err = 0;
     int isInitHuffman = 0;
-    decdata = (struct jpeg_decdata *) malloc(sizeof(struct jpeg_decdata));
-    
-    if (!decdata) {
-	err = -1;
-	goto error;
-    }
-    if (buf == NULL) {
+    struct jpginfo *info = &dec->info;
+    struct scan *dscans = dec->dscans;
+    struct comp *comps = dec->comps;
+
+    if (buf == NULL || (scale != 1 && scale != 2 && scale != 4)) {
 	err = -1;
 	goto error;
     }
-    datap = buf;
-    if (getbyte() != 0xff) {
+    n = 8 / scale;
+    info->dri = 0;
+    dec->datap = buf;
+    if (getbyte(dec) != 0xff) {
 	err = ERR_NO_SOI;
 	goto error;
     }
-    if (getbyte() != M_SOI) {
+    if (getbyte(dec) != M_SOI) {
 	err = ERR_NO_SOI;
 	goto error;
     }
-    if (readtables(M_SOF0, &isInitHuffman)) {
+    if (readtables(dec, M_SOF0, &isInitHuffman)) {
 	err = ERR_BAD_TABLES;
 	goto error;
     }
-    getword();
-    i = getbyte();
+    getword(dec);
+    i = getbyte(dec);
     if (i != 8) {
 	err = ERR_NOT_8BIT;
 	goto error;
     }
-    intheight = getword();
-    intwidth = getword();
+    intheight = getword(dec);
+    intwidth = getword(dec);
     
     if ((intheight & 7) || (intwidth & 7)) {
 	err = ERR_BAD_WIDTH_OR_HEIGHT;
 	goto error;
     }
-    info.nc = getbyte();
-    if (info.nc > MAXCOMP) {
+    info->nc = getbyte(dec);
+    if (info->nc > MAXCOMP) {
 	err = ERR_TOO_MANY_COMPPS;
 	goto error;
     }
-    for (i = 0; i < info.nc; i++) {
+    for (i = 0; i < info->nc; i++) {
 	int h, v;
-	comps[i].cid = getbyte();
-	comps[i].hv = getbyte();
+	comps[i].cid = getbyte(dec);
+	comps[i].hv = getbyte(dec);
 	v = comps[i].hv & 15;
 	h = comps[i].hv >> 4;
-	comps[i].tq = getbyte();
+	comps[i].tq = getbyte(dec);
 	if (h > 3 || v > 3) {
 	    err = ERR_ILLEGAL_HV;
 	    goto error;
@@ -345,106 +422,67 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 	    goto error;
 	}
     }
-    if (readtables(M_SOS,&isInitHuffman)) {
+    if (readtables(dec, M_SOS, &isInitHuffman)) {
 	err = ERR_BAD_TABLES;
 	goto error;
     }
-    getword();
-    info.ns = getbyte();
-    if (!info.ns){
-    printf("info ns %d/n",info.ns);
+    getword(dec);
+    info->ns = getbyte(dec);
+    if (!info->ns){
+    printf("info ns %d/n",info->ns);
 	err = ERR_NOT_YCBCR_221111;
 	goto error;
     }
-    for (i = 0; i < info.ns; i++) {
-	dscans[i].cid = getbyte();
-	tdc = getbyte();
+    for (i = 0; i < info->ns; i++) {
+	dscans[i].cid = getbyte(dec);
+	tdc = getbyte(dec);
 	tac = tdc & 15;
 	tdc >>= 4;
 	if (tdc > 1 || tac > 1) {
 	    err = ERR_QUANT_TABLE_SELECTOR;
 	    goto error;
 	}
-	for (j = 0; j < info.nc; j++)
+	for (j = 0; j < info->nc; j++)
 	    if (comps[j].cid == dscans[i].cid)
 		break;
-	if (j == info.nc) {
+	if (j == info->nc) {
 	    err = ERR_UNKNOWN_CID_IN_SCAN;
 	    goto error;
 	}
 	dscans[i].hv = comps[j].hv;
 	dscans[i].tq = comps[j].tq;
-	dscans[i].hudc.dhuff = dec_huffdc + tdc;
-	dscans[i].huac.dhuff = dec_huffac + tac;
+	dscans[i].hudc.dhuff = dec_huffdc(dec) + tdc;
+	dscans[i].huac.dhuff = dec_huffac(dec) + tac;
     }
 
-    i = getbyte();
-    j = getbyte();
-    m = getbyte();
+    i = getbyte(dec);
+    j = getbyte(dec);
+    m = getbyte(dec);
 
     if (i != 0 || j != 63 || m != 0) {
     	printf("hmm FW error,not seq DCT ??\n");
     }
    // printf("ext huffman table %d \n",isInitHuffman);
     if(!isInitHuffman) {
-    	if(huffman_init() < 0)
+    	if(huffman_init(dec) < 0)
 		return -ERR_BAD_TABLES;
 	}
-/*
-    if (dscans[0].cid != 1 || dscans[1].cid != 2 || dscans[2].cid != 3) {
-	err = ERR_NOT_YCBCR_221111;
-	goto error;
-    }
-
-    if (dscans[1].hv != 0x11 || dscans[2].hv != 0x11) {
-	err = ERR_NOT_YCBCR_221111;
-	goto error;
-    }
-*/    
-    /* if internal width and external are not the same or heigth too 
-       and pic not allocated realloc the good size and mark the change 
-       need 1 macroblock line more ?? */
-    if (intwidth != *width || intheight != *height || *pic == NULL) {
-	*width = intwidth;
-	*height = intheight;
-	// BytesperPixel 2 yuyv , 3 rgb24 
-	*pic =
-	    (unsigned char *) realloc((unsigned char *) *pic,
-				      (size_t) intwidth * (intheight +
-							   8) * 2);
-    }
-
 
     switch (dscans[0].hv) {
     case 0x22: // 411
     	mb=6;
-	mcusx = *width >> 4;
-	mcusy = *height >> 4;
-	bpp=2;
-	xpitch = 16 * bpp;
-	pitch = *width * bpp; // YUYV out
-	ypitch = 16 * pitch;
+	hs = 2; vs = 2;
 	convert = yuv420pto422;	
 	break;
     case 0x21: //422
    // printf("find 422 %dx%d\n",*width,*height);
     	mb=4;
-	mcusx = *width >> 4;
-	mcusy = *height >> 3;
-	bpp=2;	
-	xpitch = 16 * bpp;
-	pitch = *width * bpp; // YUYV out
-	ypitch = 8 * pitch;
+	hs = 2; vs = 1;
 	convert = yuv422pto422;	
 	break;
     case 0x11: //444
-	mcusx = *width >> 3;
-	mcusy = *height >> 3;
-	bpp=2;
-	xpitch = 8 * bpp;
-	pitch = *width * bpp; // YUYV out
-	ypitch = 8 * pitch;
-	 if (info.ns==1) {
+	hs = 1; vs = 1;
+	 if (info->ns==1) {
     		mb = 1;
 		convert = yuv400pto422;
 	} else {
@@ -457,95 +495,74 @@ int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 	goto error;
 	break;
     }
+    ny = hs * vs;
+    mcusx = intwidth / (8 * hs);
+    mcusy = intheight / (8 * vs);
 
-    idctqtab(quant[dscans[0].tq], decdata->dquant[0]);
-    idctqtab(quant[dscans[1].tq], decdata->dquant[1]);
-    idctqtab(quant[dscans[2].tq], decdata->dquant[2]);
-    setinput(&in, datap);
-    dec_initscans();
+    /* if the output size is not what the caller has, or pic is not
+       allocated, realloc the good size and mark the change 
+       need 1 macroblock line more ?? */
+    if (intwidth / scale != *width || intheight / scale != *height || *pic == NULL) {
+	*width = intwidth / scale;
+	*height = intheight / scale;
+	// BytesperPixel 2 yuyv , 3 rgb24 
+	*pic =
+	    (unsigned char *) realloc((unsigned char *) *pic,
+				      (size_t) *width * (*height +
+							   8) * 2);
+    }
+    bpp = 2;
+    pitch = *width * bpp; // YUYV out
+    xpitch = hs * n * bpp;
+    ypitch = vs * n * pitch;
+
+    for (i = 0; i < 3; i++) {
+	m = dscans[info->ns > i ? i : 0].tq;
+	idctqtab(dec->quant[m], dec->dquant[i]);
+	quanttabs(dec->quant[m], dec->fquant[i], dec->rquant[i]);
+    }
+    setinput(&dec->in, dec->datap);
+    dec_initscans(dec);
 
     dscans[0].next = 2;
     dscans[1].next = 1;
     dscans[2].next = 0;	/* 4xx encoding */
     for (my = 0,y=0; my < mcusy; my++,y+=ypitch) {
 	for (mx = 0,x=0; mx < mcusx; mx++,x+=xpitch) {
-	    if (info.dri && !--info.nm)
-		if (dec_checkmarker()) {
+	    if (info->dri && !--info->nm)
+		if (dec_checkmarker(dec)) {
 		    err = ERR_WRONG_MARKER;
 		    goto error;
 		}
-	switch (mb){
-	    case 6: {
-		decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);
-		idct(decdata->dcts + 64, decdata->out + 64,
-		     decdata->dquant[0], IFIX(128.5), max[1]);
-		idct(decdata->dcts + 128, decdata->out + 128,
-		     decdata->dquant[0], IFIX(128.5), max[2]);
-		idct(decdata->dcts + 192, decdata->out + 192,
-		     decdata->dquant[0], IFIX(128.5), max[3]);
-		idct(decdata->dcts + 256, decdata->out + 256,
-		     decdata->dquant[1], IFIX(0.5), max[4]);
-		idct(decdata->dcts + 320, decdata->out + 320,
-		     decdata->dquant[2], IFIX(0.5), max[5]);
-	  
-	    } break;
-	    case 4:
-	    {
-		decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);
-		idct(decdata->dcts + 64, decdata->out + 64,
-		     decdata->dquant[0], IFIX(128.5), max[1]);
-		idct(decdata->dcts + 128, decdata->out + 256,
-		     decdata->dquant[1], IFIX(0.5), max[4]);
-		idct(decdata->dcts + 192, decdata->out + 320,
-		     decdata->dquant[2], IFIX(0.5), max[5]);
-	   	   
+	    /* luma blocks go to out + 0..3 * 64, chroma to out + 256 and 320 */
+	    decode_mcus(&dec->in, dec->dcts, mb, dscans, max);
+	    for (b = 0; b < ny; b++)
+		dec_idct(dec, dec->dcts + b * 64, dec->out + b * 64, 0, 1, max[b], n);
+	    if (mb > 1) {
+		dec_idct(dec, dec->dcts + ny * 64, dec->out + 256, 1, 0, max[ny], n);
+		dec_idct(dec, dec->dcts + (ny + 1) * 64, dec->out + 320, 2, 0, max[ny + 1], n);
 	    }
-	    break;
-	    case 3:
-	    	 decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);		     
-		idct(decdata->dcts + 64, decdata->out + 256,
-		     decdata->dquant[1], IFIX(0.5), max[4]);
-		idct(decdata->dcts + 128, decdata->out + 320,
-		     decdata->dquant[2], IFIX(0.5), max[5]);
-	    
-		         
-	    break;
-	    case 1:
-	    	 decode_mcus(&in, decdata->dcts, mb, dscans, max);
-		idct(decdata->dcts, decdata->out, decdata->dquant[0],
-		     IFIX(128.5), max[0]);
-		  
-	    break;
-	    
-	} // switch enc411
-	convert(decdata->out,*pic+y+x,pitch); 
+	    if (n == 8)
+		convert(dec->out, *pic + y + x, pitch);
+	    else
+		mcuToYUYV(dec->out, *pic + y + x, pitch, hs, vs, n, mb == 1);
 	}
     }
 
-    m = dec_readmarker(&in);
+    m = dec_readmarker(&dec->in);
     if (m != M_EOI) {
 	err = ERR_NO_EOI;
 	goto error;
     }
-    if (decdata)
-	free(decdata);
     return 0;
   error:
-    if (decdata)
-	free(decdata);
     return err;
 }
 
 /****************************************************************/
 /**************       huffman decoder             ***************/
 /****************************************************************/
-static int huffman_init(void)
+static int huffman_init(struct jpeg_decoder *dec)
 {    	int tc, th, tt;
  	const unsigned char *ptr= JPEGHuffmanTable ;
 	int i, j, l;
@@ -569,7 +586,7 @@ static int huffman_init(void)
 			huffvals[k++] = *ptr++;
 		    l -= hufflen[i];
 		}
-		dec_makehuff(dhuff + tt, hufflen, huffvals);
+		dec_makehuff(dec->dhuff + tt, hufflen, huffvals);
 	    }
 	    return 0;
 }
@@ -954,6 +971,13 @@ static PREC aaidct[8] = {
     IFIX(0.1913417162), IFIX(0.0975451610)
 };
 
+static float aanscale[8] = {
+    0.3535533906, 0.4903926402,
+    0.4619397663, 0.4157348062,
+    0.3535533906, 0.2777851165,
+    0.1913417162, 0.0975451610
+};
+
 
 static void idctqtab(unsigned char *qin, PREC *qout)
 {
@@ -965,6 +989,202 @@ static void idctqtab(unsigned char *qin, PREC *qout)
 		IMULT(aaidct[i], aaidct[j]);
 }
 
+/* Dequantization tables in natural order, for the float idcts */
+static void quanttabs(unsigned char *qin, float *fq, float *rq)
+{
+    int i, j;
+
+    for (i = 0; i < 8; i++)
+	for (j = 0; j < 8; j++) {
+	    rq[i * 8 + j] = qin[zig[i * 8 + j]];
+	    fq[i * 8 + j] = qin[zig[i * 8 + j]] * aanscale[i] * aanscale[j];
+	}
+}
+
+#ifdef __SSE2__
+/* 8 point AAN idct (the same butterflies as idct()) on 4 columns at once.
+ * x[0..7] holds frequencies 0..7 on entry, outputs 0..7 on return. */
+static inline void idct8_sse(__m128 *x)
+{
+    const __m128 ic4 = _mm_set1_ps(1.414213562f);
+    const __m128 s22 = _mm_set1_ps(0.765366864f);
+    const __m128 c22ms22 = _mm_set1_ps(1.082392200f);
+    const __m128 c22ps22 = _mm_set1_ps(2.613125930f);
+    __m128 t0, t1, t2, t3, t4, t5, t6, t7;
+    __m128 tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6;
+
+    t0 = x[0]; t5 = x[1]; t2 = x[2]; t7 = x[3];
+    t1 = x[4]; t4 = x[5]; t3 = x[6]; t6 = x[7];
+
+    tmp0 = _mm_add_ps(t0, t1);
+    t1 = _mm_sub_ps(t0, t1);
+    tmp2 = _mm_sub_ps(t2, t3);
+    t3 = _mm_add_ps(t2, t3);
+    tmp2 = _mm_sub_ps(_mm_mul_ps(tmp2, ic4), t3);
+    tmp3 = _mm_add_ps(tmp0, t3);
+    t3 = _mm_sub_ps(tmp0, t3);
+    tmp1 = _mm_add_ps(t1, tmp2);
+    tmp2 = _mm_sub_ps(t1, tmp2);
+    tmp4 = _mm_sub_ps(t4, t7);
+    t7 = _mm_add_ps(t4, t7);
+    tmp5 = _mm_add_ps(t5, t6);
+    t6 = _mm_sub_ps(t5, t6);
+    tmp6 = _mm_sub_ps(tmp5, t7);
+    t7 = _mm_add_ps(tmp5, t7);
+    tmp5 = _mm_mul_ps(tmp6, ic4);
+    tmp6 = _mm_mul_ps(_mm_add_ps(tmp4, t6), s22);
+    tmp4 = _mm_add_ps(_mm_mul_ps(tmp4, c22ms22), tmp6);
+    t6 = _mm_sub_ps(_mm_mul_ps(t6, c22ps22), tmp6);
+    t6 = _mm_sub_ps(t6, t7);
+    t5 = _mm_sub_ps(tmp5, t6);
+    t4 = _mm_sub_ps(tmp4, t5);
+
+    x[0] = _mm_add_ps(tmp3, t7);
+    x[1] = _mm_add_ps(tmp1, t6);
+    x[2] = _mm_add_ps(tmp2, t5);
+    x[3] = _mm_add_ps(t3, t4);
+    x[4] = _mm_sub_ps(t3, t4);
+    x[5] = _mm_sub_ps(tmp2, t5);
+    x[6] = _mm_sub_ps(tmp1, t6);
+    x[7] = _mm_sub_ps(tmp3, t7);
+}
+
+/* Transpose the 8x8 block held as rows a[r] (columns 0-3), a[8 + r]
+ * (columns 4-7) */
+static inline void transpose8_sse(__m128 *a)
+{
+    __m128 t;
+
+    _MM_TRANSPOSE4_PS(a[0], a[1], a[2], a[3]);
+    _MM_TRANSPOSE4_PS(a[4], a[5], a[6], a[7]);
+    _MM_TRANSPOSE4_PS(a[8], a[9], a[10], a[11]);
+    _MM_TRANSPOSE4_PS(a[12], a[13], a[14], a[15]);
+    t = a[4]; a[4] = a[8]; a[8] = t;
+    t = a[5]; a[5] = a[9]; a[9] = t;
+    t = a[6]; a[6] = a[10]; a[10] = t;
+    t = a[7]; a[7] = a[11]; a[11] = t;
+}
+
+/* Same as idct(), in single precision with SSE2, fq from quanttabs() and
+ * off the level shift (128 for luma, 0 for chroma) */
+static void idct_sse(int *in, int *out, float *fq, float off, int max)
+{
+    __m128 a[16];
+    float blk[64] __attribute__ ((aligned(16)));
+    __m128i v;
+    int i;
+
+    if (max == 1) {
+	v = _mm_set1_epi32((int) floorf(in[0] * fq[0] + off + 0.5f));
+	for (i = 0; i < 64; i += 4)
+	    _mm_storeu_si128((__m128i *) (out + i), v);
+	return;
+    }
+    for (i = 0; i < 64; i++)
+	blk[i] = in[zig[i]] * fq[i];
+    blk[0] += off;
+    for (i = 0; i < 8; i++) {
+	a[i] = _mm_load_ps(blk + i * 8);
+	a[8 + i] = _mm_load_ps(blk + i * 8 + 4);
+    }
+    /* columns, then rows (as columns of the transpose) */
+    idct8_sse(a);
+    idct8_sse(a + 8);
+    transpose8_sse(a);
+    idct8_sse(a);
+    idct8_sse(a + 8);
+    transpose8_sse(a);
+    for (i = 0; i < 8; i++) {
+	_mm_storeu_si128((__m128i *) (out + i * 8), _mm_cvtps_epi32(a[i]));
+	_mm_storeu_si128((__m128i *) (out + i * 8 + 4), _mm_cvtps_epi32(a[8 + i]));
+    }
+}
+#endif
+
+/* Scaled decoding: the n x n outputs (n = 4 or 2) of the block from its
+ * n x n lowest frequencies, each output the average of the 8/n x 8/n pixels
+ * it covers. rq from quanttabs(), rc the bases from jpeg_decoder_new(). */
+inline static void idct_reduced(int *in, int *out, float *rq, float off, int max, int n, float *rc)
+{
+    float c[16], t[16], s;
+    int x, y, u;
+
+    if (max == 1) {
+	x = (int) floorf(in[0] * rq[0] * rc[0] * rc[0] + off + 0.5f);
+	for (y = 0; y < n * n; y++)
+	    out[y] = x;
+	return;
+    }
+
+    for (y = 0; y < n; y++)
+	for (u = 0; u < n; u++)
+	    c[y * n + u] = in[zig[y * 8 + u]] * rq[y * 8 + u];
+#ifdef __SSE2__
+    if (n == 4) {
+	/* rows of t = c * rc', then out = rc * t, a row at a time */
+	__m128 b[4], r[4], v;
+
+	for (u = 0; u < 4; u++)
+	    b[u] = _mm_loadu_ps(rc + u * 4);
+	_MM_TRANSPOSE4_PS(b[0], b[1], b[2], b[3]);
+	for (y = 0; y < 4; y++) {
+	    v = _mm_mul_ps(_mm_set1_ps(c[y * 4]), b[0]);
+	    for (u = 1; u < 4; u++)
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(c[y * 4 + u]), b[u]));
+	    r[y] = v;
+	}
+	for (y = 0; y < 4; y++) {
+	    v = _mm_set1_ps(off);
+	    for (u = 0; u < 4; u++)
+		v = _mm_add_ps(v, _mm_mul_ps(_mm_set1_ps(rc[y * 4 + u]), r[u]));
+	    _mm_storeu_si128((__m128i *) (out + y * 4), _mm_cvtps_epi32(v));
+	}
+	return;
+    }
+#endif
+    for (y = 0; y < n; y++)
+	for (x = 0; x < n; x++) {
+	    s = 0;
+	    for (u = 0; u < n; u++)
+		s += c[y * n + u] * rc[x * n + u];
+	    t[y * n + x] = s;
+	}
+    for (y = 0; y < n; y++)
+	for (x = 0; x < n; x++) {
+	    s = off;
+	    for (u = 0; u < n; u++)
+		s += t[u * n + x] * rc[y * n + u];
+	    out[y * n + x] = (int) floorf(s + 0.5f);
+	}
+}
+
+/* YUYV output of an MCU decoded at n x n per block: hs x vs luma blocks in
+ * out + 0..3 * 64, chroma blocks (each covering the MCU) in out + 256 and
+ * out + 320 */
+static void mcuToYUYV(int *out, unsigned char *pic, int pitch, int hs, int vs, int n, int gray)
+{
+    int bx, by, r, c, ci;
+    int *yb, *cu, *cv;
+    unsigned char *p;
+
+    for (by = 0; by < vs; by++)
+	for (r = 0; r < n; r++) {
+	    p = pic + (by * n + r) * pitch;
+	    cu = out + 256 + ((by * n + r) / vs) * n;
+	    cv = cu + 64;
+	    for (bx = 0; bx < hs; bx++) {
+		yb = out + (by * hs + bx) * 64 + r * n;
+		for (c = 0; c < n; c += 2) {
+		    ci = (bx * n + c) >> (hs - 1);
+		    *p++ = CLIP(yb[c]);
+		    *p++ = gray ? 128 : CLIP(128 + cu[ci]);
+		    *p++ = CLIP(yb[c + 1]);
+		    *p++ = gray ? 128 : CLIP(128 + cv[ci]);
+		}
+	    }
+	}
+}
+
 #define  FOUR_TWO_TWO 2		//Y00 Cb Y01 Cr
 
 
@@ -1075,7 +1295,7 @@ static void yuv422pto422(int * out,unsigned char *pic,int width)
 	   
 	  }
 	  
-	    outy += 16;outu +=8; outv +=8;
+	    outy += 16;outu +=16; outv +=16;
 	    outv1 = 0; outu1=0;
 	    outy1 = 0;
 	    outy2 = 8;
@@ -37,8 +37,16 @@
 #define ERR_BAD_TABLES 14
 #define ERR_DEPTH_MISMATCH 15
 
+struct jpeg_decoder;
+
 int jpeg_decode(unsigned char **pic, unsigned char *buf, int *width,
 		int *height);
+/* Reentrant decoding: one decoder per thread, frames decoded at 1/scale
+ * size (scale 1, 2 or 4) in the DCT domain */
+struct jpeg_decoder *jpeg_decoder_new(void);
+void jpeg_decoder_free(struct jpeg_decoder *dec);
+int jpeg_decode_scaled(struct jpeg_decoder *dec, unsigned char **pic,
+		       unsigned char *buf, int *width, int *height, int scale);
 int 
 get_picture(unsigned char *buf,int size);
 int
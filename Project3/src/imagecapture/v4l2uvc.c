@@ -114,6 +114,11 @@ init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps,
     vd->captureFile = NULL;
     vd->bytesWritten = 0;
     vd->framesWritten = 0;
+    vd->borrowed = -1;
+    vd->ownbuffer = NULL;
+    vd->framefd = -1;
+    for (i = 0; i < NB_BUFFER; i++)
+	vd->dmafd[i] = -1;
     if (init_v4l2(vd) < 0) {
 	printf(" Init v4L2 failed !! exit fatal\n");
 	goto error;;
@@ -123,10 +128,15 @@ init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps,
     vd->framesizeIn = (vd->width * vd->height << 1);
     switch (vd->formatIn) {
     case V4L2_PIX_FMT_MJPEG:
-	vd->tmpbuffer =
-	    (unsigned char *) calloc(1, (size_t) vd->framesizeIn);
-	if (!vd->tmpbuffer)
+	/* frames are decoded straight from the mmap'd buffers, no tmpbuffer */
+	vd->jdec = jpeg_decoder_new();
+	if (!vd->jdec)
 	    goto error;
+	/* from here on width and height are the size of the decoded frames */
+	if (vd->scale < 1)
+	    vd->scale = 1;
+	vd->width /= vd->scale;
+	vd->height /= vd->scale;
 	vd->framebuffer =
 	    (unsigned char *) calloc(1,
 				     (size_t) vd->width * (vd->height +
@@ -527,25 +537,16 @@ static int video_disable(struct vdIn *vd)
 }
 
 
-int uvcGrab(struct vdIn *vd)
+/* Handle a dequeued buffer: optional raw frame/stream capture, then
+ * decode (MJPEG) or copy (YUYV) the frame into *dst. Returns 0 on
+ * success, 1 if the buffer was empty, -1 on error. The buffer is not
+ * requeued here. */
+static int uvcFill(struct vdIn *vd, struct v4l2_buffer *buf, unsigned char **dst)
 {
 #define HEADERFRAME1 0xaf
-    int ret;
-
-    if (!vd->isstreaming)
-	if (video_enable(vd))
-	    goto err;
-    memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
-    vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    vd->buf.memory = V4L2_MEMORY_MMAP;
-    ret = ioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
-    if (ret < 0) {
-	perror("Unable to dequeue buffer");
-	goto err;
-    }
 
 	/* Capture a single raw frame */
-	if (vd->rawFrameCapture && vd->buf.bytesused > 0) {
+	if (vd->rawFrameCapture && buf->bytesused > 0) {
 		FILE *frame = NULL;
 		char filename[13];
 		int ret;
@@ -563,14 +564,14 @@ int uvcGrab(struct vdIn *vd)
 		}
 		
 		/* Write the raw data to the file */
-		ret = fwrite(vd->mem[vd->buf.index], vd->buf.bytesused, 1, frame);
+		ret = fwrite(vd->mem[buf->index], buf->bytesused, 1, frame);
 		if(ret < 1) {
 			perror("Unable to write to file");
 			goto end_capture;
 		}
-		printf("Saved raw frame to %s (%u bytes)\n", filename, vd->buf.bytesused);
+		printf("Saved raw frame to %s (%u bytes)\n", filename, buf->bytesused);
 		if(vd->rawFrameCapture == 2) {
-			vd->rfsBytesWritten += vd->buf.bytesused;
+			vd->rfsBytesWritten += buf->bytesused;
 			vd->rfsFramesWritten++;
 		}
 
@@ -584,9 +585,9 @@ end_capture:
    
 
 	/* Capture raw stream data */
-	if (vd->captureFile && vd->buf.bytesused > 0) {
+	if (vd->captureFile && buf->bytesused > 0) {
 		int ret;
-		ret = fwrite(vd->mem[vd->buf.index], vd->buf.bytesused, 1, vd->captureFile);
+		ret = fwrite(vd->mem[buf->index], buf->bytesused, 1, vd->captureFile);
 		if (ret < 1) {
 			perror("Unable to write raw stream to file");
 			fprintf(stderr, "Stream capturing terminated.\n");
@@ -596,42 +597,68 @@ end_capture:
 			vd->bytesWritten = 0;
 		} else {
 			vd->framesWritten++;
-			vd->bytesWritten += vd->buf.bytesused;
+			vd->bytesWritten += buf->bytesused;
 			if (debug)
-				printf("Appended raw frame to stream file (%u bytes)\n", vd->buf.bytesused);
+				printf("Appended raw frame to stream file (%u bytes)\n", buf->bytesused);
 		}
 	}
 
     switch (vd->formatIn) {
     case V4L2_PIX_FMT_MJPEG:
-        if(vd->buf.bytesused <= HEADERFRAME1) {	/* Prevent crash on empty image */
+        if(buf->bytesused <= HEADERFRAME1) {	/* Prevent crash on empty image */
 /*	    if(debug)*/
 	        printf("Ignoring empty buffer ...\n");
-	    return 0;
+	    return 1;
         }
-	memcpy(vd->tmpbuffer, vd->mem[vd->buf.index],vd->buf.bytesused);
-	 /* avi recording is toggled on */
-	if (jpeg_decode(&vd->framebuffer, vd->tmpbuffer, &vd->width,
-	     &vd->height) < 0) {
+	/* the decoder only reads its input, so decode the driver's buffer in place */
+	if (jpeg_decode_scaled(vd->jdec, dst, (unsigned char *) vd->mem[buf->index],
+	     &vd->width, &vd->height, vd->scale) < 0) {
 	    printf("jpeg decode errors\n");
-	    goto err;
+	    return -1;
 	}
 
 	if (debug)
-	    printf("bytes in used %d\n", vd->buf.bytesused);
+	    printf("bytes in used %d\n", buf->bytesused);
 	break;
     case V4L2_PIX_FMT_YUYV:
-	if (vd->buf.bytesused > vd->framesizeIn)
-	    memcpy(vd->framebuffer, vd->mem[vd->buf.index],
+	if (buf->bytesused > vd->framesizeIn)
+	    memcpy(*dst, vd->mem[buf->index],
 		   (size_t) vd->framesizeIn);
 	else
-	    memcpy(vd->framebuffer, vd->mem[vd->buf.index],
-		   (size_t) vd->buf.bytesused);
+	    memcpy(*dst, vd->mem[buf->index],
+		   (size_t) buf->bytesused);
 	break;
     default:
-	goto err;
+	return -1;
 	break;
     }
+    return 0;
+}
+
+int uvcGrab(struct vdIn *vd)
+{
+    int ret;
+
+    if (!vd->isstreaming)
+	if (video_enable(vd))
+	    goto err;
+    memset(&vd->buf, 0, sizeof(struct v4l2_buffer));
+    vd->buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vd->buf.memory = V4L2_MEMORY_MMAP;
+    ret = ioctl(vd->fd, VIDIOC_DQBUF, &vd->buf);
+    if (ret < 0) {
+	perror("Unable to dequeue buffer");
+	goto err;
+    }
+
+    ret = uvcFill(vd, &vd->buf, &vd->framebuffer);
+    if (ret < 0)
+	goto err;
+    if (ret == 0) {
+	vd->frameTime = vd->buf.timestamp;
+	vd->frameSeq = vd->buf.sequence;
+    }
+
     ret = ioctl(vd->fd, VIDIOC_QBUF, &vd->buf);
     if (ret < 0) {
 	perror("Unable to requeue buffer");
@@ -643,13 +670,439 @@ end_capture:
     vd->signalquit = 0;
     return -1;
 }
+
+/*******************************************************************************
+ * Capture thread and frame ring
+ *
+ * uvcStartCapture() starts a thread that keeps all NB_BUFFER mmap'd buffers
+ * queued with the driver. Every completed buffer is decoded/copied into a
+ * free slot of a small ring and requeued at once. The ring has a single
+ * producer (the capture thread) and a single consumer (uvcGrabLatest()),
+ * and slots move between states with compare-and-swap only:
+ *
+ *   FREE -> WRITING -> READY -> READING -> FREE
+ *
+ * When no slot is FREE, the policy decides: RING_DROP_OLDEST overwrites the
+ * oldest READY frame, RING_DROP_NEWEST discards the incoming one. The mutex
+ * and condition variable are only used to put an idle consumer to sleep.
+ *
+ * With vd->zerocopy (YUYV only) nothing is copied: a slot holds the index of
+ * the dequeued driver buffer, and uvcBorrow() lends that buffer to the
+ * consumer until uvcReturn() requeues it. At most one frame is kept READY,
+ * so with one buffer borrowed and one being dequeued the driver still has
+ * NB_BUFFER-3 buffers to fill.
+ ******************************************************************************/
+static int ringBufferSize(struct vdIn *vd)
+{
+    if (vd->formatIn == V4L2_PIX_FMT_MJPEG)
+	return vd->width * (vd->height + 8) * 2;
+    return vd->framesizeIn;
+}
+
+static int ringClaim(struct vdIn *vd)
+{
+    /* Producer - get a slot to write into, or -1 to drop the frame */
+    int i, old;
+
+    for (i = 0; i < NB_SLOTS; i++)
+	if (__sync_bool_compare_and_swap(&vd->ring[i].state, SLOT_FREE, SLOT_WRITING))
+	    return i;
+    if (vd->ringPolicy == RING_DROP_NEWEST)
+	return -1;
+    for (;;) {
+	old = -1;
+	for (i = 0; i < NB_SLOTS; i++)
+	    if (vd->ring[i].state == SLOT_READY &&
+		(old < 0 || vd->ring[i].seq < vd->ring[old].seq))
+		old = i;
+	if (old < 0)
+	    return -1;
+	if (__sync_bool_compare_and_swap(&vd->ring[old].state, SLOT_READY, SLOT_WRITING)) {
+	    __sync_fetch_and_add(&vd->framesDropped, 1);
+	    return old;
+	}
+    }
+}
+
+static int ringNewest(struct vdIn *vd)
+{
+    /* Index of the most recent READY slot, -1 if there is none */
+    int i, best = -1;
+
+    for (i = 0; i < NB_SLOTS; i++)
+	if (vd->ring[i].state == SLOT_READY &&
+	    (best < 0 || vd->ring[i].seq > vd->ring[best].seq))
+	    best = i;
+    return best;
+}
+
+static void requeueBuffer(struct vdIn *vd, int index)
+{
+    /* Give a dequeued driver buffer back to the driver */
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    if (ioctl(vd->fd, VIDIOC_QBUF, &buf) < 0)
+	perror("Unable to requeue buffer");
+}
+
+static void ringPutBuffer(struct vdIn *vd, struct v4l2_buffer *buf)
+{
+    /* Zero-copy producer - publish the dequeued buffer itself. A READY frame
+     * that was never picked up is replaced (RING_DROP_OLDEST, its buffer is
+     * requeued) or kept (RING_DROP_NEWEST, the new buffer is requeued). */
+    int i, s = -1;
+
+    for (i = 0; i < NB_SLOTS && s < 0; i++) {
+	if (vd->ring[i].state != SLOT_READY)
+	    continue;
+	if (vd->ringPolicy == RING_DROP_NEWEST) {
+	    requeueBuffer(vd, buf->index);
+	    __sync_fetch_and_add(&vd->framesDropped, 1);
+	    return;
+	}
+	if (__sync_bool_compare_and_swap(&vd->ring[i].state, SLOT_READY, SLOT_WRITING)) {
+	    requeueBuffer(vd, vd->ring[i].index);
+	    __sync_fetch_and_add(&vd->framesDropped, 1);
+	    s = i;
+	}
+    }
+    for (i = 0; i < NB_SLOTS && s < 0; i++)
+	if (__sync_bool_compare_and_swap(&vd->ring[i].state, SLOT_FREE, SLOT_WRITING))
+	    s = i;
+    if (s < 0) {
+	requeueBuffer(vd, buf->index);
+	__sync_fetch_and_add(&vd->framesDropped, 1);
+	return;
+    }
+    vd->ring[s].index = buf->index;
+    vd->ring[s].stamp = buf->timestamp;
+    vd->ring[s].vseq = buf->sequence;
+    vd->ring[s].seq = ++vd->ringSeq;
+    __sync_bool_compare_and_swap(&vd->ring[s].state, SLOT_WRITING, SLOT_READY);
+    pthread_mutex_lock(&vd->ringLock);
+    pthread_cond_signal(&vd->ringCond);
+    pthread_mutex_unlock(&vd->ringLock);
+}
+
+static void *captureLoop(void *arg)
+{
+    struct vdIn *vd = (struct vdIn *) arg;
+    struct v4l2_buffer buf;
+    struct timeval tv;
+    fd_set fds;
+    int s, ret;
+
+    while (vd->capturing) {
+	/* Wait (with a timeout, so we can be stopped) for a buffer */
+	FD_ZERO(&fds);
+	FD_SET(vd->fd, &fds);
+	tv.tv_sec = 1;
+	tv.tv_usec = 0;
+	ret = select(vd->fd + 1, &fds, NULL, NULL, &tv);
+	if (ret < 0 && errno == EINTR)
+	    continue;
+	if (ret <= 0)
+	    continue;
+
+	memset(&buf, 0, sizeof(struct v4l2_buffer));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(vd->fd, VIDIOC_DQBUF, &buf) < 0) {
+	    perror("Unable to dequeue buffer");
+	    continue;
+	}
+	if (vd->zerocopy) {
+	    ringPutBuffer(vd, &buf);
+	    continue;
+	}
+
+	s = ringClaim(vd);
+	if (s < 0) {
+	    __sync_fetch_and_add(&vd->framesDropped, 1);
+	} else if (uvcFill(vd, &buf, &vd->ring[s].data) != 0) {
+	    __sync_bool_compare_and_swap(&vd->ring[s].state, SLOT_WRITING, SLOT_FREE);
+	} else {
+	    vd->ring[s].stamp = buf.timestamp;
+	    vd->ring[s].vseq = buf.sequence;
+	    vd->ring[s].seq = ++vd->ringSeq;
+	    __sync_bool_compare_and_swap(&vd->ring[s].state, SLOT_WRITING, SLOT_READY);
+	    pthread_mutex_lock(&vd->ringLock);
+	    pthread_cond_signal(&vd->ringCond);
+	    pthread_mutex_unlock(&vd->ringLock);
+	}
+
+	if (ioctl(vd->fd, VIDIOC_QBUF, &buf) < 0)
+	    perror("Unable to requeue buffer");
+    }
+    return NULL;
+}
+
+int uvcStartCapture(struct vdIn *vd, int policy)
+{
+    int i;
+
+    if (vd->capturing)
+	return 0;
+    if (!vd->isstreaming)
+	if (video_enable(vd))
+	    return -1;
+    if (vd->formatIn != V4L2_PIX_FMT_YUYV)
+	vd->zerocopy = 0;	/* MJPEG frames have to be decoded somewhere */
+    for (i = 0; i < NB_SLOTS; i++) {
+	vd->ring[i].index = -1;
+	vd->ring[i].data = NULL;
+	vd->ring[i].state = SLOT_FREE;
+	vd->ring[i].seq = 0;
+	if (vd->zerocopy)
+	    continue;
+	vd->ring[i].data = (unsigned char *) calloc(1, (size_t) ringBufferSize(vd));
+	if (!vd->ring[i].data) {
+	    while (--i >= 0) {
+		free(vd->ring[i].data);
+		vd->ring[i].data = NULL;
+	    }
+	    return -1;
+	}
+    }
+    vd->ringPolicy = policy;
+    vd->ringSeq = 0;
+    vd->framesDropped = 0;
+    pthread_mutex_init(&vd->ringLock, NULL);
+    pthread_cond_init(&vd->ringCond, NULL);
+    vd->capturing = 1;
+    if (pthread_create(&vd->captureThread, NULL, captureLoop, vd) != 0) {
+	perror("Unable to start capture thread");
+	vd->capturing = 0;
+	for (i = 0; i < NB_SLOTS; i++) {
+	    free(vd->ring[i].data);
+	    vd->ring[i].data = NULL;
+	}
+	return -1;
+    }
+    return 0;
+}
+
+static int ringTake(struct vdIn *vd, int wait)
+{
+    /* Consumer - claim the freshest READY slot (it is left READING) and
+     * drop the older frames still in the ring. Returns the slot, -2 if none
+     * was ready (only when wait is 0), and -1 if the capture thread is not
+     * running. */
+    struct timespec ts;
+    int s, i;
+
+    for (;;) {
+	if (!vd->capturing)
+	    return -1;
+	s = ringNewest(vd);
+	if (s < 0) {
+	    if (!wait)
+		return -2;
+	    pthread_mutex_lock(&vd->ringLock);
+	    while (ringNewest(vd) < 0 && vd->capturing) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+		    ts.tv_sec++;
+		    ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&vd->ringCond, &vd->ringLock, &ts);
+	    }
+	    pthread_mutex_unlock(&vd->ringLock);
+	    continue;
+	}
+	if (!__sync_bool_compare_and_swap(&vd->ring[s].state, SLOT_READY, SLOT_READING))
+	    continue;		/* the producer took it back (drop-oldest) */
+
+	/* Anything older than this frame will never be used. Slots are
+	 * claimed before their sequence number is checked, the producer
+	 * may have just refilled one with a newer frame. */
+	for (i = 0; i < NB_SLOTS; i++) {
+	    if (i == s ||
+		!__sync_bool_compare_and_swap(&vd->ring[i].state, SLOT_READY, SLOT_READING))
+		continue;
+	    if (vd->ring[i].seq < vd->ring[s].seq) {
+		if (vd->ring[i].index >= 0) {
+		    requeueBuffer(vd, vd->ring[i].index);
+		    vd->ring[i].index = -1;
+		}
+		__sync_bool_compare_and_swap(&vd->ring[i].state, SLOT_READING, SLOT_FREE);
+		__sync_fetch_and_add(&vd->framesDropped, 1);
+	    } else
+		__sync_bool_compare_and_swap(&vd->ring[i].state, SLOT_READING, SLOT_READY);
+	}
+	return s;
+    }
+}
+
+int uvcGrabLatest(struct vdIn *vd, int wait)
+{
+    /* Consumer - swap the freshest captured frame into vd->framebuffer.
+     * Older frames still in the ring are discarded. Returns 1 if a new
+     * frame was obtained, 0 if none was ready (only when wait is 0), and
+     * -1 if the capture thread is not running. */
+    unsigned char *tmp;
+    int s;
+
+    if (vd->zerocopy)
+	return uvcBorrow(vd, wait);
+    s = ringTake(vd, wait);
+    if (s < 0)
+	return (s == -2) ? 0 : -1;
+    tmp = vd->framebuffer;
+    vd->framebuffer = vd->ring[s].data;
+    vd->ring[s].data = tmp;
+    vd->frameTime = vd->ring[s].stamp;
+    vd->frameSeq = vd->ring[s].vseq;
+    __sync_bool_compare_and_swap(&vd->ring[s].state, SLOT_READING, SLOT_FREE);
+    return 1;
+}
+
+int uvcBorrow(struct vdIn *vd, int wait)
+{
+    /* Zero-copy consumer - point vd->framebuffer at the freshest frame in
+     * the driver's own (mmap'd) buffer, without copying it. The buffer stays
+     * dequeued until uvcReturn(), or the next uvcBorrow() that gets a new
+     * frame. The frame must not be used after it is returned. Works with a
+     * zero-copy capture thread (uvcStartCapture() with vd->zerocopy set), or
+     * without a capture thread, when the buffer is dequeued here (blocking).
+     * YUYV only. Returns 1 if a new frame was obtained, 0 if none was ready
+     * (only when wait is 0, the previous frame is kept), and -1 on error. */
+    struct v4l2_buffer buf;
+    int s, index;
+
+    if (vd->formatIn != V4L2_PIX_FMT_YUYV)
+	return -1;
+    if (vd->capturing) {
+	if (!vd->zerocopy)
+	    return -1;
+	s = ringTake(vd, wait);
+	if (s < 0)
+	    return (s == -2) ? 0 : -1;
+	index = vd->ring[s].index;
+	buf.timestamp = vd->ring[s].stamp;
+	buf.sequence = vd->ring[s].vseq;
+	vd->ring[s].index = -1;
+	__sync_bool_compare_and_swap(&vd->ring[s].state, SLOT_READING, SLOT_FREE);
+    } else {
+	if (!vd->isstreaming)
+	    if (video_enable(vd))
+		return -1;
+	memset(&buf, 0, sizeof(struct v4l2_buffer));
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if (ioctl(vd->fd, VIDIOC_DQBUF, &buf) < 0) {
+	    perror("Unable to dequeue buffer");
+	    return -1;
+	}
+	index = buf.index;
+    }
+
+    uvcReturn(vd);
+    vd->ownbuffer = vd->framebuffer;
+    vd->framebuffer = (unsigned char *) vd->mem[index];
+    vd->borrowed = index;
+    vd->framefd = vd->dmafd[index];
+    vd->frameTime = buf.timestamp;
+    vd->frameSeq = buf.sequence;
+    return 1;
+}
+
+void uvcReturn(struct vdIn *vd)
+{
+    /* Requeue the driver buffer lent out by uvcBorrow(), if any.
+     * vd->framebuffer goes back to its own memory (which does not hold
+     * the returned frame). */
+    if (vd->borrowed < 0)
+	return;
+    vd->framebuffer = vd->ownbuffer;
+    vd->ownbuffer = NULL;
+    requeueBuffer(vd, vd->borrowed);
+    vd->borrowed = -1;
+    vd->framefd = -1;
+}
+
+int uvcExportBuffers(struct vdIn *vd)
+{
+    /* Export the driver buffers as DMABUF file descriptors (vd->dmafd[]),
+     * so a borrowed frame (vd->framefd) can be passed to another device,
+     * e.g. imported as a GPU texture, without a copy. The fds are closed by
+     * close_v4l2(). Returns 0, or -1 if the driver (or the kernel headers)
+     * do not support it. */
+#ifdef VIDIOC_EXPBUF
+    struct v4l2_exportbuffer eb;
+    int i;
+
+    for (i = 0; i < NB_BUFFER; i++) {
+	if (vd->dmafd[i] >= 0)
+	    continue;
+	memset(&eb, 0, sizeof(struct v4l2_exportbuffer));
+	eb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	eb.index = i;
+	eb.flags = O_RDONLY | O_CLOEXEC;
+	if (ioctl(vd->fd, VIDIOC_EXPBUF, &eb) < 0) {
+	    perror("Unable to export buffer");
+	    while (--i >= 0) {
+		close(vd->dmafd[i]);
+		vd->dmafd[i] = -1;
+	    }
+	    return -1;
+	}
+	vd->dmafd[i] = eb.fd;
+    }
+    if (vd->borrowed >= 0)
+	vd->framefd = vd->dmafd[vd->borrowed];
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+void uvcStopCapture(struct vdIn *vd)
+{
+    int i;
+
+    if (!vd->capturing)
+	return;
+    vd->capturing = 0;
+    pthread_mutex_lock(&vd->ringLock);
+    pthread_cond_broadcast(&vd->ringCond);
+    pthread_mutex_unlock(&vd->ringLock);
+    pthread_join(vd->captureThread, NULL);
+    for (i = 0; i < NB_SLOTS; i++) {
+	free(vd->ring[i].data);
+	vd->ring[i].data = NULL;
+    }
+    pthread_cond_destroy(&vd->ringCond);
+    pthread_mutex_destroy(&vd->ringLock);
+}
+
 int close_v4l2(struct vdIn *vd)
 {
+    int i;
+
+    uvcStopCapture(vd);
+    if (vd->borrowed >= 0) {
+	vd->framebuffer = vd->ownbuffer;	/* the driver buffer is not ours to free */
+	vd->borrowed = -1;
+    }
+    for (i = 0; i < NB_BUFFER; i++)
+	if (vd->dmafd[i] >= 0) {
+	    close(vd->dmafd[i]);
+	    vd->dmafd[i] = -1;
+	}
     if (vd->isstreaming)
 	video_disable(vd);
     if (vd->tmpbuffer)
 	free(vd->tmpbuffer);
     vd->tmpbuffer = NULL;
+    if (vd->jdec)
+	jpeg_decoder_free(vd->jdec);
+    vd->jdec = NULL;
     free(vd->framebuffer);
     vd->framebuffer = NULL;
     free(vd->videodevice);
@@ -658,6 +1111,7 @@ int close_v4l2(struct vdIn *vd)
     vd->videodevice = NULL;
     vd->status = NULL;
     vd->pictName = NULL;
+    return 0;
 }
 
 /* return >= 0 ok otherwhise -1 */
@@ -1120,3 +1574,53 @@ int enum_frame_formats(int dev, unsigned int *supported_formats, unsigned int ma
 
 	return 0;
 }
+
+int enum_modes(int dev, struct uvcMode *modes, int max)
+{
+	/* Quiet version of enum_frame_formats() for picking a mode: lists the
+	 * YUYV and MJPEG frame sizes the camera supports (discrete sizes only),
+	 * each with its fastest frame rate. Returns the number of modes stored. */
+	struct v4l2_fmtdesc fmt;
+	struct v4l2_frmsizeenum fsize;
+	struct v4l2_frmivalenum fival;
+	int n = 0, fps;
+
+	memset(&fmt, 0, sizeof(fmt));
+	fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	for (fmt.index = 0; ioctl(dev, VIDIOC_ENUM_FMT, &fmt) == 0; fmt.index++) {
+		if (fmt.pixelformat != V4L2_PIX_FMT_YUYV &&
+		    fmt.pixelformat != V4L2_PIX_FMT_MJPEG)
+			continue;
+		memset(&fsize, 0, sizeof(fsize));
+		fsize.pixel_format = fmt.pixelformat;
+		for (fsize.index = 0; ioctl(dev, VIDIOC_ENUM_FRAMESIZES, &fsize) == 0; fsize.index++) {
+			if (fsize.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+				break;
+			fps = 0;
+			memset(&fival, 0, sizeof(fival));
+			fival.pixel_format = fmt.pixelformat;
+			fival.width = fsize.discrete.width;
+			fival.height = fsize.discrete.height;
+			for (fival.index = 0; ioctl(dev, VIDIOC_ENUM_FRAMEINTERVALS, &fival) == 0; fival.index++) {
+				if (fival.type == V4L2_FRMIVAL_TYPE_DISCRETE) {
+					if (fival.discrete.numerator > 0 &&
+					    (int) (fival.discrete.denominator / fival.discrete.numerator) > fps)
+						fps = fival.discrete.denominator / fival.discrete.numerator;
+				} else {
+					/* stepwise or continuous, the shortest interval is min */
+					if (fival.stepwise.min.numerator > 0)
+						fps = fival.stepwise.min.denominator / fival.stepwise.min.numerator;
+					break;
+				}
+			}
+			if (fps <= 0 || n >= max)
+				continue;
+			modes[n].format = fmt.pixelformat;
+			modes[n].width = fsize.discrete.width;
+			modes[n].height = fsize.discrete.height;
+			modes[n].fps = fps;
+			n++;
+		}
+	}
+	return n;
+}
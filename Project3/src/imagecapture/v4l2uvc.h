@@ -29,6 +29,9 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/select.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
 #include <SDL/SDL.h>
 #include <linux/videodev2.h>
 #include "avilib.h"
@@ -37,10 +40,39 @@
 #include "dynctrl-logitech.h"
 
 
-#define NB_BUFFER 1		// <-- Mind this! this creates the buffering and was set to 4
+#define NB_BUFFER 4		// <-- Mind this! Buffers queued with the driver. With a blocking
+				// uvcGrab() this must be 1 or frames arrive late, the capture
+				// thread (uvcStartCapture()) drains them as they complete
 #define DHT_SIZE 432
 
+/* Frame ring between the capture thread and the consumer */
+#define NB_SLOTS 3
+#define SLOT_FREE 0
+#define SLOT_WRITING 1
+#define SLOT_READY 2
+#define SLOT_READING 3
+#define RING_DROP_OLDEST 0	/* ring full: overwrite the oldest unread frame */
+#define RING_DROP_NEWEST 1	/* ring full: discard the frame just captured */
 
+struct uvcSlot {
+    volatile int state;
+    unsigned char *data;
+    struct timeval stamp;	/* kernel (driver) timestamp */
+    unsigned int vseq;		/* driver frame sequence number */
+    volatile unsigned int seq;	/* ring sequence number, orders the slots */
+    int index;			/* driver buffer held by the slot (zero-copy), -1 if none */
+};
+
+
+struct jpeg_decoder;
+
+/* A capture mode the camera supports (see enum_modes()) */
+struct uvcMode {
+    __u32 format;		/* V4L2_PIX_FMT_YUYV or V4L2_PIX_FMT_MJPEG */
+    int width;
+    int height;
+    int fps;			/* fastest frame rate at this size */
+};
 
 struct vdIn {
     int fd;
@@ -54,6 +86,8 @@ struct vdIn {
     void *mem[NB_BUFFER];
     unsigned char *tmpbuffer;
     unsigned char *framebuffer;
+    int scale;			/* MJPEG frames are decoded at 1/scale size */
+    struct jpeg_decoder *jdec;
     int isstreaming;
     int grabmethod;
     int width;
@@ -80,6 +114,24 @@ struct vdIn {
     int framecount;
     int recordstart;
     int recordtime;
+    /* capture thread and frame ring (see uvcStartCapture()) */
+    pthread_t captureThread;
+    volatile int capturing;
+    int ringPolicy;
+    struct uvcSlot ring[NB_SLOTS];
+    unsigned int ringSeq;
+    unsigned int framesDropped;
+    pthread_mutex_t ringLock;	/* only used to sleep/wake an idle consumer */
+    pthread_cond_t ringCond;
+    /* timestamp and sequence number of the frame in framebuffer */
+    struct timeval frameTime;
+    unsigned int frameSeq;
+    /* zero-copy capture (see uvcBorrow()) */
+    int zerocopy;		/* set before uvcStartCapture(): the ring passes on driver buffers, not copies */
+    int borrowed;		/* driver buffer framebuffer points to, -1 if none */
+    unsigned char *ownbuffer;	/* framebuffer's own memory while a driver buffer is borrowed */
+    int dmafd[NB_BUFFER];	/* DMABUF fds of the driver buffers (see uvcExportBuffers()), -1 if not exported */
+    int framefd;		/* DMABUF fd of the borrowed buffer, -1 if none */
 };
 int
 init_videoIn(struct vdIn *vd, char *device, int width, int height, int fps,
@@ -89,6 +141,12 @@ int save_controls(int vd);
 int load_controls(int vd);
 	     
 int uvcGrab(struct vdIn *vd);
+int uvcStartCapture(struct vdIn *vd, int policy);
+int uvcGrabLatest(struct vdIn *vd, int wait);
+int uvcBorrow(struct vdIn *vd, int wait);
+void uvcReturn(struct vdIn *vd);
+int uvcExportBuffers(struct vdIn *vd);
+void uvcStopCapture(struct vdIn *vd);
 int close_v4l2(struct vdIn *vd);
 
 int v4l2GetControl(struct vdIn *vd, int control);
@@ -105,4 +163,5 @@ int v4l2SetLightFrequencyFilter(struct vdIn *vd,int flt);
 int enum_frame_intervals(int dev, __u32 pixfmt, __u32 width, __u32 height);
 int enum_frame_sizes(int dev, __u32 pixfmt);
 int enum_frame_formats(int dev, unsigned int *supported_formats, unsigned int max_formats);
+int enum_modes(int dev, struct uvcMode *modes, int max);
 
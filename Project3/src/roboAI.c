@@ -177,6 +177,17 @@ struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col)
  return(fnd);
 }
 
+struct blob *blobWithId(struct blob *blobs, int id)
+{
+ // Returns the blob in the list that belongs to track id (see trackBlobs()), NULL if
+ // there is none
+ struct blob *p;
+
+ if (id==0) return(NULL);
+ for (p=blobs;p!=NULL;p=p->next)
+  if (p->blobId==id) return(p);
+ return(NULL);
+}
 
 void track_agents(struct RoboAI *ai, struct blob *blobs)
 {
@@ -215,13 +226,21 @@ void track_agents(struct RoboAI *ai, struct blob *blobs)
  // This function receives a pointer to the robot's AI data structure,
  // and a list of blobs.
  //
+ // Blobs arrive already tracked from frame to frame (see trackBlobs() in
+ // imageCapture.c): each has a stable blobId, and filtered position,
+ // velocity, and heading. Once an agent has been identified by colour,
+ // the blob with the same blobId is used in the following frames. This
+ // keeps the agents from swapping when colours are ambiguous, and lets
+ // them coast through a few frames where the blob is lost. All agents
+ // are identified by colour again every AI_REID frames.
+ //
  // You can change this function if you feel the tracking is not stable.
  // First, though, be sure to completely understand what it's doing.
  /////////////////////////////////////////////////////////////////////////
 
  struct blob *p;
- double mg,vx,vy,pink,doff,dmin,dmax,adj;
- double NOISE_VAR=5;
+ double pink,doff,dmin,dmax,adj,lead;
+ int reid;
 
  // Reset ID flags
  ai->st.ballID=0;
@@ -231,44 +250,49 @@ void track_agents(struct RoboAI *ai, struct blob *blobs)
  ai->st.self=NULL;			// trying to access data for the ball/self/opponent!
  ai->st.opp=NULL;
 
+ // Time to identify all agents by colour again?
+ ai->st.reid++;
+ reid=(ai->st.reid>=AI_REID);
+ if (reid) ai->st.reid=0;
+
  // Find the ball
- p=id_coloured_blob2(ai,blobs,2);
+ p=reid?NULL:blobWithId(blobs,ai->st.ballTrack);
+ if (p==NULL) p=id_coloured_blob2(ai,blobs,2);
  if (p)
  {
   ai->st.ball=p;			// New pointer to ball
   ai->st.ballID=1;			// Set ID flag for ball (we found it!)
-  ai->st.bvx=p->cx-ai->st.old_bcx;	// Update ball velocity in ai structure and blob structure
-  ai->st.bvy=p->cy-ai->st.old_bcy;
-  ai->st.ball->vx=ai->st.bvx;
-  ai->st.ball->vy=ai->st.bvy;
-
-  ai->st.old_bcx=p->cx; 		// Update old position for next frame's computation
-  ai->st.old_bcy=p->cy;
-  ai->st.ball->idtype=3;
-
-  vx=ai->st.bvx;			// Compute heading direction (normalized motion vector)
-  vy=ai->st.bvy;
-  mg=sqrt((vx*vx)+(vy*vy));
-  if (mg>NOISE_VAR)			// Update heading vector if meaningful motion detected
+  ai->st.ballTrack=p->blobId;
+  ai->st.bvx=p->vx;			// Velocity and heading come filtered from the tracker
+  ai->st.bvy=p->vy;
+  if (p->mx!=0||p->my!=0)
   {
-   vx/=mg;
-   vy/=mg;
-   ai->st.bmx=vx;
-   ai->st.bmy=vy;
+   ai->st.bmx=p->mx;
+   ai->st.bmy=p->my;
   }
   ai->st.ball->mx=ai->st.bmx;
   ai->st.ball->my=ai->st.bmy;
+
+  ai->st.old_bcx=p->cx; 		// Keep last position
+  ai->st.old_bcy=p->cy;
+  ai->st.ball->idtype=3;
  }
  else {
   ai->st.ball=NULL;
+  ai->st.ballTrack=0;
  }
  
  // ID our bot
- if (ai->st.botCol==0) p=id_coloured_blob2(ai,blobs,1);
- else p=id_coloured_blob2(ai,blobs,0);
+ p=reid?NULL:blobWithId(blobs,ai->st.selfTrack);
+ if (p==NULL)
+ {
+  if (ai->st.botCol==0) p=id_coloured_blob2(ai,blobs,1);
+  else p=id_coloured_blob2(ai,blobs,0);
+ }
  if (p!=NULL&&p!=ai->st.ball)
  {
   ai->st.self=p;			// Update pointer to self-blob
+  ai->st.selfTrack=p->blobId;
 
   // Adjust Y position if we have calibration data
   if (fabs(p->adj_Y[0][0])>.1)
@@ -283,37 +307,37 @@ void track_agents(struct RoboAI *ai, struct blob *blobs)
   }
 
   ai->st.selfID=1;
-  ai->st.svx=p->cx-ai->st.old_scx;
-  ai->st.svy=p->cy-ai->st.old_scy;
-  ai->st.self->vx=ai->st.svx;
-  ai->st.self->vy=ai->st.svy;
-
-  ai->st.old_scx=p->cx; 
-  ai->st.old_scy=p->cy;
-  ai->st.self->idtype=1;
-
-  vx=ai->st.svx;
-  vy=ai->st.svy;
-  mg=sqrt((vx*vx)+(vy*vy));
-  if (mg>NOISE_VAR)
+  ai->st.svx=p->vx;
+  ai->st.svy=p->vy;
+  if (p->mx!=0||p->my!=0)
   {
-   vx/=mg;
-   vy/=mg;
-   ai->st.smx=vx;
-   ai->st.smy=vy;
+   ai->st.smx=p->mx;
+   ai->st.smy=p->my;
   }
-
   ai->st.self->mx=ai->st.smx;
   ai->st.self->my=ai->st.smy;
+
+  ai->st.old_scx=p->cx; 
+  ai->st.old_scy=p->cy;
+  ai->st.self->idtype=1;
+ }
+ else
+ {
+  ai->st.self=NULL;
+  ai->st.selfTrack=0;
  }
- else ai->st.self=NULL;
 
  // ID our opponent
- if (ai->st.botCol==0) p=id_coloured_blob2(ai,blobs,0);
- else p=id_coloured_blob2(ai,blobs,1);
+ p=reid?NULL:blobWithId(blobs,ai->st.oppTrack);
+ if (p==NULL)
+ {
+  if (ai->st.botCol==0) p=id_coloured_blob2(ai,blobs,0);
+  else p=id_coloured_blob2(ai,blobs,1);
+ }
  if (p!=NULL&&p!=ai->st.ball&&p!=ai->st.self)
  {
   ai->st.opp=p;	
+  ai->st.oppTrack=p->blobId;
 
   if (fabs(p->adj_Y[0][1])>.1)
   {
@@ -327,29 +351,60 @@ void track_agents(struct RoboAI *ai, struct blob *blobs)
   }
 
   ai->st.oppID=1;
-  ai->st.ovx=p->cx-ai->st.old_ocx;
-  ai->st.ovy=p->cy-ai->st.old_ocy;
-  ai->st.opp->vx=ai->st.ovx;
-  ai->st.opp->vy=ai->st.ovy;
+  ai->st.ovx=p->vx;
+  ai->st.ovy=p->vy;
+  if (p->mx!=0||p->my!=0)
+  {
+   ai->st.omx=p->mx;
+   ai->st.omy=p->my;
+  }
+  ai->st.opp->mx=ai->st.omx;
+  ai->st.opp->my=ai->st.omy;
 
   ai->st.old_ocx=p->cx; 
   ai->st.old_ocy=p->cy;
   ai->st.opp->idtype=2;
+ }
+ else
+ {
+  ai->st.opp=NULL;
+  ai->st.oppTrack=0;
+ }
 
-  vx=ai->st.ovx;
-  vy=ai->st.ovy;
-  mg=sqrt((vx*vx)+(vy*vy));
-  if (mg>NOISE_VAR)
-  {
-   vx/=mg;
-   vy/=mg;
-   ai->st.omx=vx;
-   ai->st.omy=vy;
-  }
-  ai->st.opp->mx=ai->st.omx;
-  ai->st.opp->my=ai->st.omy;
+ // Predict where the agents will be when our commands take effect. Velocities
+ // are in pixels per frame, so the lead is the latency in frames.
+ lead=0;
+ if (ai->st.framePeriod>0) lead=ai->st.latency/ai->st.framePeriod;
+ if (ai->st.ball!=NULL)
+ {
+  ai->st.pbcx=ai->st.ball->cx+(lead*ai->st.bvx);
+  ai->st.pbcy=ai->st.ball->cy+(lead*ai->st.bvy);
+ }
+ else
+ {
+  ai->st.pbcx=ai->st.old_bcx;
+  ai->st.pbcy=ai->st.old_bcy;
+ }
+ if (ai->st.self!=NULL)
+ {
+  ai->st.pscx=ai->st.self->cx+(lead*ai->st.svx);
+  ai->st.pscy=ai->st.self->cy+(lead*ai->st.svy);
+ }
+ else
+ {
+  ai->st.pscx=ai->st.old_scx;
+  ai->st.pscy=ai->st.old_scy;
+ }
+ if (ai->st.opp!=NULL)
+ {
+  ai->st.pocx=ai->st.opp->cx+(lead*ai->st.ovx);
+  ai->st.pocy=ai->st.opp->cy+(lead*ai->st.ovy);
+ }
+ else
+ {
+  ai->st.pocx=ai->st.old_ocx;
+  ai->st.pocy=ai->st.old_ocy;
  }
- else ai->st.opp=NULL;
 
 }
 
@@ -470,6 +525,16 @@ int setupAI(int mode, int own_col, struct RoboAI *ai)
  ai->st.selfID=0;
  ai->st.oppID=0;
  ai->st.ballID=0;
+ ai->st.ballTrack=0;
+ ai->st.selfTrack=0;
+ ai->st.oppTrack=0;
+ ai->st.reid=0;
+ ai->st.frameStamp=0;
+ ai->st.framePeriod=0;
+ ai->st.latency=0;
+ ai->st.pbcx=ai->st.pbcy=0;
+ ai->st.pscx=ai->st.pscy=0;
+ ai->st.pocx=ai->st.pocy=0;
  clear_motion_flags(ai);
  fprintf(stderr,"Initialized!\n");
  
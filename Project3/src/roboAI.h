@@ -33,6 +33,8 @@
 #define AI_PENALTY 1    // Go score some goals!
 #define AI_CHASE 2 	// Kick the ball around and chase it!
 
+#define AI_REID 15	// Re-identify agents by colour every so many frames, even if their tracks are alive
+
 struct AI_data{
 	// This data structure is used to hold all data relevant to the state of the AI.
 	// This includes, of course, the current state, as well as the status of
@@ -67,6 +69,15 @@ struct AI_data{
 	int oppID;
 	int ballID;
 
+	// blobIds (see trackBlobs()) of the tracks identified as ball, self,
+	// and opponent. 0 if not locked on a track. While a track lives its
+	// blobs are used without matching colours again, except every AI_REID
+	// frames when all agents are re-identified.
+	int ballTrack;
+	int selfTrack;
+	int oppTrack;
+	int reid;			// Frames since the last re-identification
+
 	// Blob track data. Ball likely needs to be detected at each frame
 	// separately. So we keep old location to estimate v
 	struct blob *ball;		// Current ball blob
@@ -85,6 +96,21 @@ struct AI_data{
 	double old_ocx, old_ocy;	// Previous opponent (cx,cy)
 	double ovx,ovy;			// Current opponent [vx vy]
 	double omx,omy;			// Opponent heading
+
+	// Latency compensation. Set by the frame loop before the AI runs:
+	// the capture time of the current frame, the time between frames, and
+	// a running average of the time from capture to a motor command being
+	// acknowledged by the EV3 (all in ms). Agent positions are extrapolated
+	// over that latency, so they estimate where the agents are when the
+	// AI's commands take effect. Equal to the measured positions until a
+	// latency has been measured, and to the last measured position while
+	// an agent is not found.
+	double frameStamp;
+	double framePeriod;
+	double latency;
+	double pbcx,pbcy;		// Predicted ball (cx,cy)
+	double pscx,pscy;		// Predicted self (cx,cy)
+	double pocx,pocy;		// Predicted opponent (cx,cy)
 };
 
 struct RoboAI {
@@ -131,6 +157,7 @@ void AI_calibrate(struct RoboAI *ai, struct blob *blobs);
 /* PaCode - just the function headers - see the functions for descriptions */
 void id_bot(struct RoboAI *ai, struct blob *blobs);
 struct blob *id_coloured_blob2(struct RoboAI *ai, struct blob *blobs, int col);
+struct blob *blobWithId(struct blob *blobs, int id);
 void track_agents(struct RoboAI *ai, struct blob *blobs);
 void clear_motion_flags(struct RoboAI *ai);
 void chaseBall(struct RoboAI *ai);
@@ -12,6 +12,7 @@
 
 #include "imagecapture/imageCapture.h"
 #include <stdio.h>
+#include <string.h>
 #include <GL/glut.h>
 #include "roboAI.h"
 #include "API/btcomm.h"
@@ -25,14 +26,38 @@
 
 int main(int argc, char **argv)
 {
+  int i,j,headless=0,replay=0,paced=1,mjpeg=0,tune=0;
+  char *record=NULL;
 
-  if (argc<4||(atoi(argv[2])>1||atoi(argv[2])<0)||(atoi(argv[3])>2||atoi(argv[3])<0))
+  // Pull out options before checking the positional parameters
+  for (i=1,j=1;i<argc;i++)
+  {
+   if (!strcmp(argv[i],"--headless")) headless=1;
+   else if (!strcmp(argv[i],"--replay")) replay=1;
+   else if (!strcmp(argv[i],"--fast")) paced=0;
+   else if (!strcmp(argv[i],"--record")&&i+1<argc) record=argv[++i];
+   else if (!strcmp(argv[i],"--mjpeg")&&i+1<argc) mjpeg=atoi(argv[++i]);
+   else if (!strcmp(argv[i],"--autotune")&&i+1<argc) tune=atoi(argv[++i]);
+   else argv[j++]=argv[i];
+  }
+  argc=j;
+
+  if (argc<4||(mjpeg!=0&&mjpeg!=1&&mjpeg!=2&&mjpeg!=4)||tune<0||(atoi(argv[2])>1||atoi(argv[2])<0)||(atoi(argv[3])>2||atoi(argv[3])<0))
   {
    fprintf(stderr,"roboSoccer: Incorrect number of parameters.\n");
-   fprintf(stderr,"USAGE: roboSoccer video_device own_colour mode\n");
+   fprintf(stderr,"USAGE: roboSoccer [--headless] [--record file.avi] [--replay [--fast]] [--mjpeg N] [--autotune W] video_device own_colour mode\n");
    fprintf(stderr,"  video_device - path to camera (typically /dev/video0 or /dev/video1)\n");
    fprintf(stderr,"  own_colour - colour of the EV3 bot controlled by this program, 0 = GREEN, 1 = RED\n");
    fprintf(stderr,"  mode - AI mode: 0 = SOCCER, 1 = PENALTY, 2 = CHASE\n");
+   fprintf(stderr,"  --headless - no display window, keyboard commands are read from the terminal\n");
+   fprintf(stderr,"  --record file.avi - save the video frames (and their timestamps, in file.avi.ts)\n");
+   fprintf(stderr,"  --replay - video_device is a file saved with --record, played back at the recorded rate\n");
+   fprintf(stderr,"  --fast - with --replay, process the recorded frames as fast as possible\n");
+   fprintf(stderr,"  --mjpeg N - capture MJPEG at 60 fps and decode it at 1/N size (N = 1, 2 or 4),\n");
+   fprintf(stderr,"              the homography must be recalibrated when N changes\n");
+   fprintf(stderr,"  --autotune W - try the camera's modes and use the fastest one giving frames at least\n");
+   fprintf(stderr,"                 W pixels wide (the choice is cached in CameraModes.dat), the homography\n");
+   fprintf(stderr,"                 must be recalibrated if the mode changes\n");
    exit(0);
   }
 
@@ -41,10 +66,11 @@ int main(int argc, char **argv)
   BT_open(HEXKEY);
 
   // Start GLUT
-  glutInit(&argc, argv);
+  if (!headless) glutInit(&argc, argv);
 
   // Launch imageCapture
-  if (imageCaptureStartup(argv[1], 1280, 720, atoi(argv[2]), atoi(argv[3]))) {
+  captureOptions(record,replay,paced,mjpeg,tune);
+  if (imageCaptureStartup(argv[1], 1280, 720, atoi(argv[2]), atoi(argv[3]), headless)) {
     fprintf(stderr, "Couldn't start image capture, terminating...\n");
     exit(0);
   }